@@ -0,0 +1,701 @@
+#define _CRT_SECURE_NO_WARNINGS
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <functional>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <AccelerationEngine.hpp>
+#pragma comment(lib, "HardwareAcceleration.lib")
+#pragma comment(lib, "vulkan-1.lib")
+using namespace std;
+
+/// Measures the transfer, layout transition and dispatch paths of the api.
+/// Results are printed as a table and written as JSON (--json <path>, default benchmark.json).
+/// --quick runs small sizes and few iterations only, used as a smoke test.
+/// --max-size <bytes> caps the buffer sizes, 1 GB by default.
+
+struct BenchmarkResult {
+	string Name;
+	string Memory;
+	string Format;
+	uint64_t Bytes;
+	vector<double> Seconds;
+	string Error;
+};
+
+struct BenchmarkOptions {
+	bool Quick = false;
+	uint64_t MaxSize = 1024ull * 1024 * 1024;
+	string JsonPath = "benchmark.json";
+	// Each case runs until it used this much time or MaxIterations
+	double TimeBudget = 0.5;
+	size_t MinIterations = 3;
+	size_t MaxIterations = 200;
+};
+
+static double Elapsed(chrono::steady_clock::time_point begin)
+{
+	return chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+}
+
+/// <summary>
+/// Runs op once to warm up, then until the time budget is used.
+/// op returns the seconds of the measured part, so setup and cleanup can be left out.
+/// </summary>
+static BenchmarkResult Measure(const BenchmarkOptions& options, const string& name, const string& memory, const string& format,
+	uint64_t bytes, const function<double()>& op)
+{
+	BenchmarkResult result{ name, memory, format, bytes };
+	try {
+		op();
+		double total = 0;
+		while (result.Seconds.size() < options.MinIterations ||
+			(total < options.TimeBudget && result.Seconds.size() < options.MaxIterations)) {
+			double seconds = op();
+			result.Seconds.push_back(seconds);
+			total += seconds;
+		}
+	}
+	catch (const exception& e) {
+		result.Seconds.clear();
+		result.Error = e.what();
+	}
+	return result;
+}
+
+static double Percentile(const vector<double>& sorted, double p)
+{
+	size_t index = (size_t)(p * (sorted.size() - 1) + 0.5);
+	return sorted[min(index, sorted.size() - 1)];
+}
+
+static string Escape(const string& text)
+{
+	string escaped;
+	for (char c : text) {
+		if (c == '"' || c == '\\')
+			escaped += '\\';
+		if ((unsigned char)c >= 0x20)
+			escaped += c;
+	}
+	return escaped;
+}
+
+static void Report(const BenchmarkResult& result)
+{
+	if (!result.Error.empty()) {
+		printf("%-28s %-7s %-22s %12llu  skipped: %s\n", result.Name.c_str(), result.Memory.c_str(), result.Format.c_str(),
+			(unsigned long long)result.Bytes, result.Error.c_str());
+		return;
+	}
+	vector<double> sorted = result.Seconds;
+	sort(sorted.begin(), sorted.end());
+	double median = Percentile(sorted, 0.5);
+	printf("%-28s %-7s %-22s %12llu  %9.3f GB/s  p50 %10.1f us  p99 %10.1f us\n", result.Name.c_str(), result.Memory.c_str(),
+		result.Format.c_str(), (unsigned long long)result.Bytes, result.Bytes ? result.Bytes / median / 1e9 : 0.0,
+		median * 1e6, Percentile(sorted, 0.99) * 1e6);
+}
+
+static bool WriteJson(const BenchmarkOptions& options, const HA::HardwareDevice& device, const vector<BenchmarkResult>& results)
+{
+	FILE* io = fopen(options.JsonPath.c_str(), "w");
+	if (!io)
+		return false;
+	fprintf(io, "{\n\"device\":\"%s\",\n\"quick\":%s,\n\"results\":[", Escape(device.Name).c_str(), options.Quick ? "true" : "false");
+	for (size_t i = 0; i < results.size(); i++) {
+		auto& result = results[i];
+		fprintf(io, "%s\n{\"name\":\"%s\",\"memory\":\"%s\",\"format\":\"%s\",\"bytes\":%llu", i ? "," : "",
+			Escape(result.Name).c_str(), result.Memory.c_str(), result.Format.c_str(), (unsigned long long)result.Bytes);
+		if (!result.Error.empty()) {
+			fprintf(io, ",\"error\":\"%s\"}", Escape(result.Error).c_str());
+			continue;
+		}
+		vector<double> sorted = result.Seconds;
+		sort(sorted.begin(), sorted.end());
+		double sum = 0;
+		for (double seconds : sorted)
+			sum += seconds;
+		double median = Percentile(sorted, 0.5);
+		fprintf(io, ",\"iterations\":%llu,\"gb_per_s\":%.6f,\"ops_per_s\":%.3f,"
+			"\"latency_us\":{\"min\":%.3f,\"p50\":%.3f,\"p90\":%.3f,\"p99\":%.3f,\"max\":%.3f,\"mean\":%.3f}}",
+			(unsigned long long)sorted.size(), result.Bytes ? result.Bytes / median / 1e9 : 0.0, sorted.size() / sum,
+			sorted.front() * 1e6, median * 1e6, Percentile(sorted, 0.9) * 1e6, Percentile(sorted, 0.99) * 1e6,
+			sorted.back() * 1e6, sum / sorted.size() * 1e6);
+	}
+	fprintf(io, "\n]\n}\n");
+	return fclose(io) == 0;
+}
+
+static void BenchmarkBuffers(HA::AccelerationEngine* engine, const BenchmarkOptions& options, vector<BenchmarkResult>& results)
+{
+	const pair<HA::GPGPUMemoryType, const char*> memoryTypes[] = {
+		{ HA::GPGPUMemoryType::Static, "Static" },
+		{ HA::GPGPUMemoryType::Stream, "Stream" },
+		{ HA::GPGPUMemoryType::Host, "Host" },
+	};
+	for (uint64_t size = 64; size <= options.MaxSize; size *= 16) {
+		vector<char> data;
+		try {
+			data.resize(size, 1);
+		}
+		catch (const bad_alloc&) {
+			break;
+		}
+		for (auto& [memoryType, memoryName] : memoryTypes) {
+			HA::GPBuffer* buffer = nullptr;
+			try {
+				buffer = new HA::GPBuffer(engine->ImplementationContext, memoryType, size);
+			}
+			catch (const exception& e) {
+				results.push_back({ "GPBuffer", memoryName, "", size, {}, e.what() });
+				Report(results.back());
+				continue;
+			}
+
+			results.push_back(Measure(options, "GPBuffer::Write", memoryName, "", size, [&]() {
+				auto begin = chrono::steady_clock::now();
+				buffer->Write(data.data(), 0, size);
+				engine->WaitIdle();
+				return Elapsed(begin);
+			}));
+			Report(results.back());
+
+			results.push_back(Measure(options, "GPBuffer::WriteAsync", memoryName, "", size, [&]() {
+				auto begin = chrono::steady_clock::now();
+				buffer->WriteAsync(data.data(), 0, size);
+				engine->CommitMemory();
+				return Elapsed(begin);
+			}));
+			Report(results.back());
+
+			buffer->MapBuffer();
+			results.push_back(Measure(options, "GPBuffer::SyncRead", memoryName, "", size, [&]() {
+				auto begin = chrono::steady_clock::now();
+				buffer->SyncRead();
+				return Elapsed(begin);
+			}));
+			Report(results.back());
+			buffer->UnmapBuffer();
+
+			delete buffer;
+		}
+	}
+}
+
+static void BenchmarkImages(HA::AccelerationEngine* engine, const BenchmarkOptions& options, vector<BenchmarkResult>& results)
+{
+	struct ImageFormat {
+		VkFormat Format;
+		const char* Name;
+		uint32_t PixelSize;
+	};
+	const ImageFormat formats[] = {
+		{ VK_FORMAT_R8_UNORM, "R8_UNORM", 1 },
+		{ VK_FORMAT_R8G8B8A8_UNORM, "R8G8B8A8_UNORM", 4 },
+		{ VK_FORMAT_R16G16B16A16_SFLOAT, "R16G16B16A16_SFLOAT", 8 },
+		{ VK_FORMAT_R32G32B32A32_SFLOAT, "R32G32B32A32_SFLOAT", 16 },
+	};
+	vector<uint32_t> extents = { 256, 1024, 4096 };
+	if (options.Quick)
+		extents = { 256 };
+
+	for (uint32_t extent : extents) {
+		for (auto& format : formats) {
+			uint32_t rowLength = extent * format.PixelSize;
+			uint64_t size = (uint64_t)rowLength * extent;
+			if (size > options.MaxSize)
+				continue;
+			string name = string(format.Name) + " " + to_string(extent) + "x" + to_string(extent);
+			vector<uint8_t> pixels(size, 0x7f);
+			HA::GPImage* image = nullptr;
+			try {
+				image = new HA::GPImage(engine->ImplementationContext, format.Format, VK_IMAGE_TYPE_2D, { extent, extent, 1 },
+					rowLength, 1, HA::GPGPUMemoryType::Static);
+			}
+			catch (const exception& e) {
+				results.push_back({ "GPImage", "Static", name, size, {}, e.what() });
+				Report(results.back());
+				continue;
+			}
+
+			results.push_back(Measure(options, "GPImage::Write", "Static", name, size, [&]() {
+				auto begin = chrono::steady_clock::now();
+				image->Write((uint32_t)size, pixels.data());
+				engine->WaitIdle();
+				return Elapsed(begin);
+			}));
+			Report(results.back());
+
+			results.push_back(Measure(options, "GPImage::ReadBack", "Host", name, size, [&]() {
+				HA::GPBuffer* readback;
+				auto begin = chrono::steady_clock::now();
+				image->ReadBack(&readback, HA::GPGPUMemoryType::Host);
+				double seconds = Elapsed(begin);
+				delete readback;
+				return seconds;
+			}));
+			Report(results.back());
+
+			// Reuses the destination, as a frame readback loop would
+			HA::GPBuffer* target = new HA::GPBuffer(engine->ImplementationContext, HA::GPGPUMemoryType::Host, size);
+			results.push_back(Measure(options, "GPImage::ReadBackAsync", "Host", name, size, [&]() {
+				auto begin = chrono::steady_clock::now();
+				engine->Wait(image->ReadBackAsync(target));
+				return Elapsed(begin);
+			}));
+			Report(results.back());
+			delete target;
+
+			results.push_back(Measure(options, "GPImage::Copy", "Static", name, size, [&]() {
+				auto begin = chrono::steady_clock::now();
+				HA::GPImage* copy = image->Copy(HA::GPGPUMemoryType::Static);
+				engine->WaitIdle();
+				double seconds = Elapsed(begin);
+				delete copy;
+				return seconds;
+			}));
+			Report(results.back());
+
+			delete image;
+		}
+	}
+}
+
+static void BenchmarkSubmission(HA::AccelerationEngine* engine, const BenchmarkOptions& options, vector<BenchmarkResult>& results)
+{
+	// Round trip of the shared command buffer, it always contains the leading barrier.
+	results.push_back(Measure(options, "CommandThread::Execute", "", "empty", 0, [&]() {
+		auto begin = chrono::steady_clock::now();
+		engine->CommitMemory();
+		return Elapsed(begin);
+	}));
+	Report(results.back());
+
+	// Host cost of a submission without waiting for it
+	results.push_back(Measure(options, "CommandThread::Submit", "", "empty", 0, [&]() {
+		auto begin = chrono::steady_clock::now();
+		auto ticket = engine->CommitMemoryAsync();
+		double seconds = Elapsed(begin);
+		engine->Wait(ticket);
+		return seconds;
+	}));
+	Report(results.back());
+
+	HA::GPBuffer* buffer = new HA::GPBuffer(engine->ImplementationContext, HA::GPGPUMemoryType::Static, 64);
+	char data[64]{};
+	results.push_back(Measure(options, "CommandThread::Execute", "Static", "64 B upload", 64, [&]() {
+		auto begin = chrono::steady_clock::now();
+		buffer->WriteAsync(data, 0, sizeof(data));
+		engine->CommitMemory();
+		return Elapsed(begin);
+	}));
+	Report(results.back());
+	delete buffer;
+}
+
+static void BenchmarkAllocation(HA::AccelerationEngine* engine, const BenchmarkOptions& options, vector<BenchmarkResult>& results)
+{
+	// Creation and destruction of many small short-lived buffers, freed in creation order
+	const size_t count = options.Quick ? 256 : 16384;
+	const uint64_t size = 4096;
+	HA::MemoryAllocator linear(engine->ImplementationContext, HA::GPAllocatorMode::Linear);
+	HA::MemoryAllocator general(engine->ImplementationContext, HA::GPAllocatorMode::General);
+	const pair<HA::MemoryAllocator*, const char*> allocators[] = {
+		{ nullptr, "engine" },
+		{ &linear, "Linear pool" },
+		{ &general, "General pool" },
+	};
+	vector<HA::GPBuffer*> buffers(count);
+	for (auto& [allocator, name] : allocators) {
+		results.push_back(Measure(options, "GPBuffer create/delete", "Static", to_string(count) + " x 4 KB " + name,
+			count * size, [&]() {
+			auto begin = chrono::steady_clock::now();
+			for (auto& buffer : buffers)
+				buffer = new HA::GPBuffer(engine->ImplementationContext, HA::GPGPUMemoryType::Static, size, allocator);
+			for (auto buffer : buffers)
+				delete buffer;
+			return Elapsed(begin);
+		}));
+		Report(results.back());
+	}
+
+	HA::GPArena arena(engine->ImplementationContext, 16 * 1024 * 1024);
+	results.push_back(Measure(options, "GPArena allocate/release", "Static", to_string(count) + " x 4 KB", count * size, [&]() {
+		auto begin = chrono::steady_clock::now();
+		for (size_t i = 0; i < count; i++)
+			arena.Allocate(size);
+		arena.Release(engine->CommitMemoryAsync());
+		return Elapsed(begin);
+	}));
+	Report(results.back());
+}
+
+static void BenchmarkScatter(HA::AccelerationEngine* engine, const BenchmarkOptions& options, vector<BenchmarkResult>& results)
+{
+	// Small updates spread over a large buffer, one call per update against one batched call
+	const uint32_t count = options.Quick ? 256 : 4096;
+	const uint64_t updateSize = 64;
+	const uint64_t size = 16 * 1024 * 1024;
+	vector<char> data(count * updateSize, 1);
+	vector<HA::GPBufferRegion> regions(count);
+	for (uint32_t i = 0; i < count; i++)
+		regions[i] = { data.data() + i * updateSize, (size / count) * i, updateSize };
+
+	HA::GPBuffer* buffer = new HA::GPBuffer(engine->ImplementationContext, HA::GPGPUMemoryType::Static, size);
+	string name = to_string(count) + " x " + to_string(updateSize) + " B";
+	results.push_back(Measure(options, "GPBuffer::WriteAsync", "Static", name, count * updateSize, [&]() {
+		auto begin = chrono::steady_clock::now();
+		for (auto& region : regions)
+			buffer->WriteAsync((void*)region.Data, region.Offset, region.Size);
+		engine->CommitMemory();
+		return Elapsed(begin);
+	}));
+	Report(results.back());
+
+	results.push_back(Measure(options, "GPBuffer::WriteAsync batch", "Static", name, count * updateSize, [&]() {
+		auto begin = chrono::steady_clock::now();
+		buffer->WriteAsync(regions);
+		engine->CommitMemory();
+		return Elapsed(begin);
+	}));
+	Report(results.back());
+	delete buffer;
+
+	// 16x16 tiles of an atlas
+	const uint32_t extent = 1024, tile = 16;
+	vector<uint8_t> pixels(tile * tile * 4, 0x7f);
+	vector<HA::GPImageRegion> tiles;
+	for (uint32_t y = 0; y < extent && tiles.size() < count; y += tile * 2) {
+		for (uint32_t x = 0; x < extent && tiles.size() < count; x += tile * 2)
+			tiles.push_back({ pixels.data(), { (int32_t)x, (int32_t)y, 0 }, { tile, tile, 1 }, 0 });
+	}
+	HA::GPImage* atlas = new HA::GPImage(engine->ImplementationContext, VK_FORMAT_R8G8B8A8_UNORM, VK_IMAGE_TYPE_2D,
+		{ extent, extent, 1 }, extent * 4, 1, HA::GPGPUMemoryType::Static);
+	results.push_back(Measure(options, "GPImage::Write batch", "Static", to_string(tiles.size()) + " x 16x16 R8G8B8A8",
+		tiles.size() * pixels.size(), [&]() {
+		auto begin = chrono::steady_clock::now();
+		atlas->Write(tiles);
+		engine->WaitIdle();
+		return Elapsed(begin);
+	}));
+	Report(results.back());
+	delete atlas;
+}
+
+static void BenchmarkDirtyTracking(HA::AccelerationEngine* engine, const BenchmarkOptions& options, vector<BenchmarkResult>& results)
+{
+	// A large mapped Static table where a few KB change between syncs
+	const uint64_t size = min<uint64_t>(options.Quick ? 1024 * 1024 : 256 * 1024 * 1024, options.MaxSize);
+	const pair<HA::GPDirtyTracking, const char*> modes[] = {
+		{ HA::GPDirtyTracking::Disabled, "SyncWrite" },
+		{ HA::GPDirtyTracking::Manual, "SyncWrite manual dirty" },
+		{ HA::GPDirtyTracking::Automatic, "SyncWrite auto dirty" },
+	};
+	for (auto& [mode, name] : modes) {
+		HA::GPBuffer* table = new HA::GPBuffer(engine->ImplementationContext, HA::GPGPUMemoryType::Static, size);
+		table->SetDirtyTracking(mode);
+		char* shadow = (char*)table->MapBuffer();
+		uint32_t tick = 0;
+		results.push_back(Measure(options, string("GPBuffer::") + name, "Static", "8 x 64 B changed", size, [&]() {
+			auto begin = chrono::steady_clock::now();
+			for (uint64_t i = 0; i < 8; i++) {
+				uint64_t offset = (size / 8) * i;
+				memset(shadow + offset, (int)tick, 64);
+				table->MarkDirty(offset, 64);
+			}
+			tick++;
+			table->SyncWrite(0, 0);
+			engine->WaitIdle();
+			return Elapsed(begin);
+		}));
+		Report(results.back());
+		delete table;
+	}
+}
+
+static void BenchmarkFileStreaming(HA::AccelerationEngine* engine, const BenchmarkOptions& options, vector<BenchmarkResult>& results)
+{
+	// Page cache hot after the first iteration, so this measures the staging pipeline rather than the disk
+	const uint64_t size = min<uint64_t>(options.Quick ? 1024 * 1024 : 512 * 1024 * 1024, options.MaxSize);
+	const char* path = "benchmark_stream.bin";
+	HA::GPBuffer* buffer = new HA::GPBuffer(engine->ImplementationContext, HA::GPGPUMemoryType::Static, size);
+	results.push_back(Measure(options, "GPBuffer::StoreToFile", "Static", "", size, [&]() {
+		auto begin = chrono::steady_clock::now();
+		if (!buffer->StoreToFile(path))
+			throw runtime_error("Could not create the file.");
+		return Elapsed(begin);
+	}));
+	Report(results.back());
+	results.push_back(Measure(options, "GPBuffer::LoadFromFile", "Static", "", size, [&]() {
+		auto begin = chrono::steady_clock::now();
+		if (!buffer->LoadFromFile(path))
+			throw runtime_error("Could not open the file.");
+		return Elapsed(begin);
+	}));
+	Report(results.back());
+	delete buffer;
+	remove(path);
+}
+
+static void BenchmarkDispatch(HA::AccelerationEngine* engine, const BenchmarkOptions& options, vector<BenchmarkResult>& results)
+{
+	const char* source =
+		"#version 450\n"
+		"layout(local_size_x = 64) in;\n"
+		"layout(set = 0, binding = 0) buffer Values { uint values[]; };\n"
+		"layout(push_constant) uniform Params { uint count; };\n"
+		"void main() {\n"
+		"	uint i = gl_GlobalInvocationID.x;\n"
+		"	if (i < count) values[i] += 1;\n"
+		"}\n";
+	const uint32_t count = options.Quick ? 1024 : 16 * 1024 * 1024;
+	HA::GPBuffer* values = new HA::GPBuffer(engine->ImplementationContext, HA::GPGPUMemoryType::Static, count * sizeof(uint32_t));
+	HA::ComputeShader* shader = nullptr;
+	try {
+		shader = new HA::ComputeShader(engine, (void*)source, (uint32_t)strlen(source));
+	}
+	catch (const exception& e) {
+		results.push_back({ "ComputeShader::Dispatch", "Static", "", 0, {}, e.what() });
+		Report(results.back());
+		delete values;
+		return;
+	}
+	shader->Bind("Values", values);
+
+	for (uint32_t invocations : { 64u, count }) {
+		results.push_back(Measure(options, "ComputeShader::Dispatch", "Static", to_string(invocations) + " invocations",
+			(uint64_t)invocations * sizeof(uint32_t) * 2, [&]() {
+			auto begin = chrono::steady_clock::now();
+			shader->SetPushConstants(&invocations, sizeof(invocations));
+			shader->DispatchInvocations(invocations, 1, 1);
+			engine->CommitMemory();
+			return Elapsed(begin);
+		}));
+		Report(results.back());
+	}
+
+	// An upload to an unrelated buffer overlaps the dispatch when the device has a transfer queue
+	HA::GPBuffer* upload = new HA::GPBuffer(engine->ImplementationContext, HA::GPGPUMemoryType::Static, count * sizeof(uint32_t));
+	vector<uint32_t> data(count, 1);
+	results.push_back(Measure(options, "ComputeShader::Dispatch + GPBuffer::WriteAsync", "Static", to_string(count) + " invocations",
+		(uint64_t)count * sizeof(uint32_t) * 3, [&]() {
+		auto begin = chrono::steady_clock::now();
+		upload->WriteAsync(data.data(), 0, count * sizeof(uint32_t));
+		shader->SetPushConstants(&count, sizeof(count));
+		shader->DispatchInvocations(count, 1, 1);
+		engine->CommitMemory();
+		return Elapsed(begin);
+	}));
+	Report(results.back());
+	delete upload;
+
+	// Chains of small dispatches, into one buffer every dispatch waits on a barrier for the one
+	// before it, into 8 buffers in turn only every 8th does
+	vector<HA::GPBuffer*> targets;
+	for (int i = 0; i < 8; i++)
+		targets.push_back(new HA::GPBuffer(engine->ImplementationContext, HA::GPGPUMemoryType::Static, 64 * sizeof(uint32_t)));
+	for (uint32_t buffers : { 1u, 8u }) {
+		results.push_back(Measure(options, "ComputeShader::Dispatch", "Static", "64 x 64 invocations, " + to_string(buffers) + " buffers",
+			64ull * 64 * sizeof(uint32_t) * 2, [&]() {
+			auto begin = chrono::steady_clock::now();
+			uint32_t invocations = 64;
+			shader->SetPushConstants(&invocations, sizeof(invocations));
+			for (uint32_t i = 0; i < 64; i++) {
+				shader->Bind("Values", targets[i % buffers]);
+				shader->DispatchInvocations(invocations, 1, 1);
+			}
+			engine->CommitMemory();
+			return Elapsed(begin);
+		}));
+		Report(results.back());
+	}
+	for (auto target : targets)
+		delete target;
+	delete shader;
+	delete values;
+}
+
+static void BenchmarkTaskGraph(HA::AccelerationEngine* engine, const BenchmarkOptions& options, vector<BenchmarkResult>& results)
+{
+	const char* source =
+		"#version 450\n"
+		"layout(local_size_x = 64) in;\n"
+		"layout(set = 0, binding = 0) readonly buffer Source { uint source[]; };\n"
+		"layout(set = 0, binding = 1) writeonly buffer Target { uint target[]; };\n"
+		"layout(push_constant) uniform Params { uint count; };\n"
+		"void main() {\n"
+		"	uint i = gl_GlobalInvocationID.x;\n"
+		"	if (i < count) target[i] = source[i] + 1;\n"
+		"}\n";
+	const uint32_t count = options.Quick ? 64 * 1024 : 4 * 1024 * 1024, stages = 12;
+	const uint64_t size = count * sizeof(uint32_t);
+	HA::ComputeShader* shader = nullptr;
+	try {
+		shader = new HA::ComputeShader(engine, (void*)source, (uint32_t)strlen(source));
+	}
+	catch (const exception& e) {
+		results.push_back({ "GPTaskGraph::Execute", "Static", "", 0, {}, e.what() });
+		Report(results.back());
+		return;
+	}
+
+	// The same 12 stage chain once with a buffer per stage and dispatches one by one,
+	// once as a graph whose intermediates share the memory of two buffers
+	vector<HA::GPBuffer*> buffers;
+	for (uint32_t i = 0; i <= stages; i++)
+		buffers.push_back(new HA::GPBuffer(engine->ImplementationContext, HA::GPGPUMemoryType::Static, size));
+	shader->SetPushConstants(&count, sizeof(count));
+	results.push_back(Measure(options, "ComputeShader::Dispatch", "Static", to_string(stages) + " stages, " + to_string(stages + 1) + " buffers",
+		size * 2 * stages, [&]() {
+		auto begin = chrono::steady_clock::now();
+		for (uint32_t i = 0; i < stages; i++) {
+			shader->Bind("Source", buffers[i]);
+			shader->Bind("Target", buffers[i + 1]);
+			shader->DispatchInvocations(count, 1, 1);
+		}
+		engine->CommitMemory();
+		return Elapsed(begin);
+	}));
+	Report(results.back());
+
+	HA::GPTaskGraph* graph = new HA::GPTaskGraph(engine->ImplementationContext);
+	HA::GPTaskResource stage = graph->Import(buffers.front());
+	for (uint32_t i = 0; i < stages; i++) {
+		HA::GPTaskResource target = i + 1 < stages ? graph->CreateBuffer(size) : graph->Import(buffers.back());
+		graph->AddPass(shader, { { "Source", stage, HA::GPTaskAccess::Read }, { "Target", target, HA::GPTaskAccess::Write } },
+			(count + 63) / 64, 1, 1, &count, sizeof(count));
+		stage = target;
+	}
+	engine->Wait(graph->Execute());
+	HA::GPTaskGraphStats stats = graph->GetStats();
+	results.push_back(Measure(options, "GPTaskGraph::Execute", "Static", to_string(stages) + " stages, " + to_string(stats.AllocatedBytes >> 10) +
+		" of " + to_string(stats.TransientBytes >> 10) + " KB transient", size * 2 * stages, [&]() {
+		auto begin = chrono::steady_clock::now();
+		engine->Wait(graph->Execute());
+		return Elapsed(begin);
+	}));
+	Report(results.back());
+
+	delete graph;
+	for (auto buffer : buffers)
+		delete buffer;
+	delete shader;
+}
+
+static void BenchmarkMipmaps(HA::AccelerationEngine* engine, const BenchmarkOptions& options, vector<BenchmarkResult>& results)
+{
+	// Full chain of a 2048x2048 image (512 with --quick), one dispatch per chain
+	const uint32_t side = options.Quick ? 512 : 2048;
+	uint32_t mipCount = 1;
+	while ((side >> mipCount) > 0)
+		mipCount++;
+	HA::GPImage* image = new HA::GPImage(engine->ImplementationContext, VK_FORMAT_R8G8B8A8_UNORM, VK_IMAGE_TYPE_2D,
+		{ side, side, 1 }, side * sizeof(uint32_t), (int)mipCount, HA::GPGPUMemoryType::Static);
+	vector<uint32_t> pixels(side * side);
+	for (uint32_t i = 0; i < side * side; i++)
+		pixels[i] = i * 2654435761u;
+	image->Write((uint32_t)(pixels.size() * sizeof(uint32_t)), (uint8_t*)pixels.data());
+
+	const pair<HA::GPMipFilter, const char*> filters[] = { { HA::GPMipFilter::Box, "Box" }, { HA::GPMipFilter::Kaiser, "Kaiser" } };
+	for (auto& [filter, name] : filters) {
+		results.push_back(Measure(options, "GPImage::GenerateMipmap", "Static", to_string(side) + "x" + to_string(side) + " R8G8B8A8 " + name,
+			(uint64_t)side * side * sizeof(uint32_t), [&]() {
+			auto begin = chrono::steady_clock::now();
+			image->GenerateMipmap(filter);
+			engine->CommitMemory();
+			return Elapsed(begin);
+		}));
+		Report(results.back());
+	}
+	delete image;
+}
+
+static void BenchmarkThreads(HA::AccelerationEngine* engine, const BenchmarkOptions& options, vector<BenchmarkResult>& results)
+{
+	// Every thread uploads its own buffer, recording into its own command pool
+	const uint64_t size = options.Quick ? 64 * 1024 : 4 * 1024 * 1024;
+	const uint32_t maxThreads = min(32u, max(1u, thread::hardware_concurrency()));
+	vector<uint8_t> data(size, 1);
+	for (uint32_t threadCount = 1; threadCount <= maxThreads; threadCount *= 2) {
+		vector<HA::GPBuffer*> buffers(threadCount);
+		for (auto& buffer : buffers)
+			buffer = new HA::GPBuffer(engine->ImplementationContext, HA::GPGPUMemoryType::Static, size);
+		results.push_back(Measure(options, "GPBuffer::WriteAsync", "Static", to_string(threadCount) + " threads", size * threadCount, [&]() {
+			auto begin = chrono::steady_clock::now();
+			vector<thread> threads;
+			for (uint32_t t = 0; t < threadCount; t++)
+				threads.emplace_back([&, t]() { buffers[t]->WriteAsync(data.data(), 0, size); });
+			for (auto& worker : threads)
+				worker.join();
+			engine->CommitMemory();
+			return Elapsed(begin);
+		}));
+		Report(results.back());
+		for (auto buffer : buffers)
+			delete buffer;
+	}
+}
+
+int main(int argc, char** argv) {
+
+	BenchmarkOptions options;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--quick") == 0) {
+			options.Quick = true;
+		}
+		else if (strcmp(argv[i], "--max-size") == 0 && i + 1 < argc) {
+			options.MaxSize = strtoull(argv[++i], nullptr, 10);
+		}
+		else if (strcmp(argv[i], "--json") == 0 && i + 1 < argc) {
+			options.JsonPath = argv[++i];
+		}
+		else {
+			printf("Usage: %s [--quick] [--max-size <bytes>] [--json <path>]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (options.Quick) {
+		options.MaxSize = min<uint64_t>(options.MaxSize, 1024 * 1024);
+		options.TimeBudget = 0.05;
+		options.MaxIterations = 5;
+	}
+
+	if (!HA::AccelerationEngine::CheckVulkanSupport()) {
+		cout << "The current system does not support vulkan." << endl;
+		return 0;
+	}
+
+	HA::AccelerationEngine* engine = new HA::AccelerationEngine(false, HA::AccelerationEngineDebuggingOptions::CONSOLE);
+	auto devices = engine->EnumerateAvailableDevices();
+	auto device = HA::HardwareDevice::GetDefault(devices);
+	engine->UseDevice(device);
+	printf("%s\n", device.Name);
+
+	vector<BenchmarkResult> results;
+	BenchmarkSubmission(engine, options, results);
+	BenchmarkBuffers(engine, options, results);
+	BenchmarkImages(engine, options, results);
+	BenchmarkAllocation(engine, options, results);
+	BenchmarkScatter(engine, options, results);
+	BenchmarkDirtyTracking(engine, options, results);
+	BenchmarkFileStreaming(engine, options, results);
+	BenchmarkDispatch(engine, options, results);
+	BenchmarkTaskGraph(engine, options, results);
+	BenchmarkMipmaps(engine, options, results);
+	BenchmarkThreads(engine, options, results);
+
+	delete engine;
+
+	if (!WriteJson(options, device, results)) {
+		printf("Could not write %s\n", options.JsonPath.c_str());
+		return 1;
+	}
+	return 0;
+}
@@ -1,5 +1,12 @@
+#include <algorithm>
+#include <cmath>
 #include <iostream>
 #include <string>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+#include <new>
+#include <thread>
 #include <AccelerationEngine.hpp>
 #include <stb/stb_image.h>
 #include <stb/stb_image_write.h>
@@ -20,12 +27,19 @@ int main(int argc, char** argv) {
 
 	HA::AccelerationEngine* engine = new HA::AccelerationEngine(true, HA::AccelerationEngineDebuggingOptions::CONSOLE);
 
+	// --transfer-thread runs every copy through a second CommandThread, also on single queue devices
+	if (argc > 1 && strcmp(argv[1], "--transfer-thread") == 0) {
+		engine->SetForceTransferThread(true);
+		cout << "Forcing a transfer thread." << endl;
+	}
+
 	auto devices = engine->EnumerateAvailableDevices();
 	auto device = HA::HardwareDevice::GetDefault(devices);
 	engine->UseDevice(device);
+	engine->EnableProfiling(true);
 
-	printf("%s [%llu] --- Video RAM %llu MB; System Ram %llu MB\n", device.Name, device.Id,
-		device.VRAMSize / (1024 * 1024), device.SystemSharedMemorySize / (1024 * 1024));
+	printf("%s [%llu] --- Video RAM %llu MB; System Ram %llu MB\n", device.Name, (unsigned long long)device.Id,
+		(unsigned long long)device.VRAMSize / (1024 * 1024), (unsigned long long)device.SystemSharedMemorySize / (1024 * 1024));
 
 	HA::GPBuffer* buffer = new HA::GPBuffer(engine->ImplementationContext, HA::GPGPUMemoryType::Static, 10 * 1024 * 1024);
 	std::string dob = "2008/01/01";
@@ -39,6 +53,9 @@ int main(int argc, char** argv) {
 	printf("['%s']\n", mappedData);
 	delete copy;
 
+	// Non zero when a check fails, so the example can run as a test
+	int exitCode = 0;
+
 	using namespace HA;
 	VkExtent3D extent{ 512, 512, 1 };
 	GPImage* image = new GPImage(engine->ImplementationContext, VK_FORMAT_B8G8R8A8_UNORM, VK_IMAGE_TYPE_2D, extent, 512 * sizeof(int32_t), 1, HA::GPGPUMemoryType::Static);
@@ -60,7 +77,372 @@ int main(int argc, char** argv) {
 		delete imageReadback;
 	}
 
+	{
+		// Same readback into a reused buffer, the CPU could work on the previous frame meanwhile
+		GPBuffer* frame = new GPBuffer(engine->ImplementationContext, GPGPUMemoryType::Host, 512 * 512 * sizeof(int32_t));
+		auto* pixels = frame->MapBuffer();
+		CommandTicket ticket = imageCopy->ReadBackAsync(frame);
+		engine->Wait(ticket);
+		frame->SyncRead();
+		int x, y, c;
+		auto pepper = stbi_load("pepper.bmp", &x, &y, &c, 4);
+		bool correct = pepper && memcmp(pixels, pepper, 512 * 512 * sizeof(int32_t)) == 0;
+		printf("Async readback %s\n", correct ? "passed" : "failed");
+		if (!correct)
+			exitCode = 1;
+		stbi_image_free(pepper);
+		delete frame;
+	}
+
 	delete imageCopy;
+
+	{
+		const char* source =
+			"#version 450\n"
+			"layout(local_size_x = 64) in;\n"
+			"layout(set = 0, binding = 0) buffer Values { uint values[]; };\n"
+			"layout(push_constant) uniform Params { uint count; };\n"
+			"void main() {\n"
+			"	uint i = gl_GlobalInvocationID.x;\n"
+			"	if (i < count) values[i] *= 2;\n"
+			"}\n";
+		const uint32_t count = 1024;
+		std::vector<uint32_t> values(count);
+		for (uint32_t i = 0; i < count; i++)
+			values[i] = i;
+
+		GPBuffer* numbers = new GPBuffer(engine->ImplementationContext, GPGPUMemoryType::Static, count * sizeof(uint32_t));
+		numbers->WriteAsync(values.data(), 0, count * sizeof(uint32_t));
+		ComputeShader* doubler = new ComputeShader(engine, (void*)source, (uint32_t)strlen(source));
+		doubler->Bind("Values", numbers);
+		doubler->SetPushConstants(&count, sizeof(count));
+		doubler->DispatchInvocations(count, 1, 1);
+		engine->CommitMemory();
+
+		auto* result = (uint32_t*)numbers->MapBuffer();
+		numbers->SyncRead();
+		bool correct = true;
+		for (uint32_t i = 0; i < count; i++)
+			correct &= result[i] == i * 2;
+		printf("Compute dispatch %s\n", correct ? "passed" : "failed");
+		if (!correct)
+			exitCode = 1;
+
+		// Round trip of the results through a file streamed in chunks
+		GPBuffer* loaded = new GPBuffer(engine->ImplementationContext, GPGPUMemoryType::Static, count * sizeof(uint32_t));
+		correct = numbers->StoreToFile("numbers.bin") && loaded->LoadFromFile("numbers.bin");
+		auto* loadedValues = (uint32_t*)loaded->MapBuffer();
+		loaded->SyncRead();
+		correct = correct && memcmp(loadedValues, result, count * sizeof(uint32_t)) == 0;
+		printf("File streaming %s\n", correct ? "passed" : "failed");
+		if (!correct)
+			exitCode = 1;
+		delete loaded;
+		std::remove("numbers.bin");
+
+		// Per-batch temporaries sub-allocated from a linear pool, freed in creation order
+		MemoryAllocator* transient = new MemoryAllocator(engine->ImplementationContext, GPAllocatorMode::Linear, 1024 * 1024);
+		std::vector<GPBuffer*> temporaries;
+		for (uint32_t i = 0; i < 8; i++) {
+			temporaries.push_back(new GPBuffer(engine->ImplementationContext, GPGPUMemoryType::Static, count * sizeof(uint32_t), transient));
+			temporaries.back()->Write(result, 0, count * sizeof(uint32_t));
+		}
+		auto* pooled = (uint32_t*)temporaries.back()->MapBuffer();
+		temporaries.back()->SyncRead();
+		correct = memcmp(pooled, result, count * sizeof(uint32_t)) == 0;
+		printf("Linear allocator %s\n", correct ? "passed" : "failed");
+		if (!correct)
+			exitCode = 1;
+		for (auto temporary : temporaries)
+			delete temporary;
+		delete transient;
+
+		// Same dispatch on an arena range that is handed back with the batch
+		GPArena* arena = new GPArena(engine->ImplementationContext, 1024 * 1024);
+		arena->Allocate(100);
+		GPArenaAllocation scratch = arena->Allocate(count * sizeof(uint32_t));
+		scratch.Buffer->WriteAsync(values.data(), scratch.Offset, scratch.Size);
+		doubler->Bind("Values", scratch);
+		doubler->DispatchInvocations(count, 1, 1);
+		arena->Release(engine->CommitMemoryAsync());
+		auto* arenaValues = (uint32_t*)scratch.Buffer->MapBuffer() + scratch.Offset / sizeof(uint32_t);
+		scratch.Buffer->SyncRead(scratch.Offset, scratch.Size);
+		correct = memcmp(arenaValues, result, count * sizeof(uint32_t)) == 0;
+		printf("Arena allocation %s\n", correct ? "passed" : "failed");
+		if (!correct)
+			exitCode = 1;
+		scratch.Buffer->UnmapBuffer();
+		delete arena;
+
+		// Same dispatch on memory we own, imported without a copy when the device allows it
+		const size_t hostSize = 64 * 1024;
+		auto* hostValues = (uint32_t*)operator new(hostSize, std::align_val_t(hostSize));
+		for (uint32_t i = 0; i < count; i++)
+			hostValues[i] = i;
+		GPBuffer* wrapped = GPBuffer::WrapHostMemory(engine->ImplementationContext, hostValues, hostSize);
+		doubler->Bind("Values", wrapped);
+		doubler->DispatchInvocations(count, 1, 1);
+		engine->CommitMemory();
+		result = (uint32_t*)wrapped->MapBuffer();
+		wrapped->SyncRead();
+		correct = true;
+		for (uint32_t i = 0; i < count; i++)
+			correct &= result[i] == i * 2 && (!wrapped->IsHostMemoryImported() || hostValues[i] == i * 2);
+		printf("Wrapped host memory (%s) %s\n", wrapped->IsHostMemoryImported() ? "imported" : "copied", correct ? "passed" : "failed");
+		if (!correct)
+			exitCode = 1;
+		delete wrapped;
+		operator delete(hostValues, std::align_val_t(hostSize));
+
+		// Dependent dispatches in one batch, each waits on the barrier for the one before it.
+		// The last two write host memory that is read right after the batch.
+		GPBuffer* chained = new GPBuffer(engine->ImplementationContext, GPGPUMemoryType::Host, count * sizeof(uint32_t));
+		chained->Write(values.data(), 0, count * sizeof(uint32_t));
+		doubler->Bind("Values", numbers);
+		for (int i = 0; i < 4; i++)
+			doubler->DispatchInvocations(count, 1, 1);
+		doubler->Bind("Values", chained);
+		doubler->DispatchInvocations(count, 1, 1);
+		doubler->DispatchInvocations(count, 1, 1);
+		engine->CommitMemory();
+		result = (uint32_t*)numbers->MapBuffer();
+		numbers->SyncRead();
+		auto* chainValues = (uint32_t*)chained->MapBuffer();
+		correct = true;
+		for (uint32_t i = 0; i < count; i++)
+			correct &= result[i] == i * 32 && chainValues[i] == i * 4;
+		printf("Dispatch chain %s\n", correct ? "passed" : "failed");
+		if (!correct)
+			exitCode = 1;
+		chained->UnmapBuffer();
+		delete chained;
+
+		// Six dependent passes through five transient buffers, of which only two are live at once.
+		// The extra pass only reads the input and runs in the first wave.
+		const char* addSource =
+			"#version 450\n"
+			"layout(local_size_x = 64) in;\n"
+			"layout(set = 0, binding = 0) readonly buffer Source { uint source[]; };\n"
+			"layout(set = 0, binding = 1) writeonly buffer Target { uint target[]; };\n"
+			"layout(push_constant) uniform Params { uint count; };\n"
+			"void main() {\n"
+			"	uint i = gl_GlobalInvocationID.x;\n"
+			"	if (i < count) target[i] = source[i] + 1;\n"
+			"}\n";
+		ComputeShader* adder = new ComputeShader(engine, (void*)addSource, (uint32_t)strlen(addSource));
+		GPBuffer* graphOutput = new GPBuffer(engine->ImplementationContext, GPGPUMemoryType::Host, count * sizeof(uint32_t));
+		GPBuffer* sideOutput = new GPBuffer(engine->ImplementationContext, GPGPUMemoryType::Host, count * sizeof(uint32_t));
+		GPTaskGraph* graph = new GPTaskGraph(engine->ImplementationContext);
+		GPTaskResource stage = graph->Import(numbers);
+		for (int i = 0; i < 6; i++) {
+			GPTaskResource target = i < 5 ? graph->CreateBuffer(count * sizeof(uint32_t)) : graph->Import(graphOutput);
+			graph->AddPass(adder, { { "Source", stage, GPTaskAccess::Read }, { "Target", target, GPTaskAccess::Write } },
+				(count + 63) / 64, 1, 1, &count, sizeof(count));
+			stage = target;
+		}
+		graph->AddPass(adder, { { "Source", graph->Import(numbers), GPTaskAccess::Read }, { "Target", graph->Import(sideOutput), GPTaskAccess::Write } },
+			(count + 63) / 64, 1, 1, &count, sizeof(count));
+		auto* graphValues = (uint32_t*)graphOutput->MapBuffer();
+		auto* sideValues = (uint32_t*)sideOutput->MapBuffer();
+		correct = true;
+		for (int run = 0; run < 2; run++) {
+			engine->Wait(graph->Execute());
+			for (uint32_t i = 0; i < count; i++)
+				correct &= graphValues[i] == result[i] + 6 && sideValues[i] == result[i] + 1;
+		}
+		GPTaskGraphStats graphStats = graph->GetStats();
+		correct &= graphStats.Waves == 6 && graphStats.AllocatedBytes < graphStats.TransientBytes;
+		printf("Task graph, %u passes in %u waves, %llu of %llu transient bytes allocated, %s\n", graphStats.Passes, graphStats.Waves,
+			(unsigned long long)graphStats.AllocatedBytes, (unsigned long long)graphStats.TransientBytes, correct ? "passed" : "failed");
+		if (!correct)
+			exitCode = 1;
+		delete graph;
+		graphOutput->UnmapBuffer();
+		sideOutput->UnmapBuffer();
+		delete graphOutput;
+		delete sideOutput;
+		delete adder;
+		delete doubler;
+		delete numbers;
+	}
+
+	{
+		// Free every other buffer so the survivors can be compacted, their content must move along
+		std::vector<GPBuffer*> buffers;
+		for (uint32_t i = 0; i < 64; i++) {
+			buffers.push_back(new GPBuffer(engine->ImplementationContext, GPGPUMemoryType::Static, 256 * 1024));
+			std::vector<uint32_t> pattern(256 * 1024 / sizeof(uint32_t), i);
+			buffers.back()->Write(pattern.data(), 0, 256 * 1024);
+		}
+		for (uint32_t i = 0; i < 64; i += 2) {
+			delete buffers[i];
+			buffers[i] = nullptr;
+		}
+		DefragmentationStats defragmentation = engine->Defragment();
+		bool correct = true;
+		for (uint32_t i = 1; i < 64; i += 2) {
+			auto* pattern = (uint32_t*)buffers[i]->MapBuffer();
+			buffers[i]->SyncRead();
+			correct &= pattern[0] == i && pattern[256 * 1024 / sizeof(uint32_t) - 1] == i;
+			delete buffers[i];
+		}
+		printf("Defragmentation moved %u allocations, %s\n", defragmentation.AllocationsMoved, correct ? "passed" : "failed");
+		if (!correct)
+			exitCode = 1;
+	}
+
+	{
+		// Noise tells the filters apart and any wrong level or skipped tile shows up. The reference
+		// follows the shader: levels 2-5 come from the unrounded level before, clamped to its 32x32
+		// tile, every stored level is rounded to 8 bits.
+		const uint32_t side = 256, mipCount = 9;
+		std::vector<uint32_t> noise(side * side);
+		for (uint32_t i = 0; i < side * side; i++)
+			noise[i] = i * 2654435761u;
+		GPImage* pyramid = new GPImage(engine->ImplementationContext, VK_FORMAT_R8G8B8A8_UNORM, VK_IMAGE_TYPE_2D, { side, side, 1 },
+			side * sizeof(uint32_t), mipCount, GPGPUMemoryType::Static);
+		pyramid->Write(side * side * sizeof(uint32_t), (uint8_t*)noise.data());
+
+		auto quantize = [](float value) { return std::round(std::clamp(value, 0.0f, 1.0f) * 255.0f) / 255.0f; };
+		auto reference = [&](bool kaiser) {
+			const float weights[4] = { 0.054027f, 0.445973f, 0.445973f, 0.054027f };
+			std::vector<std::vector<float>> stored(mipCount);
+			stored[0].resize(side * side * 4);
+			for (uint32_t i = 0; i < side * side * 4; i++)
+				stored[0][i] = ((noise[i / 4] >> (i % 4 * 8)) & 0xff) / 255.0f;
+			std::vector<float> unrounded = stored[0];
+			for (uint32_t level = 1; level < mipCount; level++) {
+				int sourceSide = side >> (level - 1), levelSide = side >> level;
+				// Levels 2-5 read the unrounded tile in shared memory, the rest the stored level
+				bool tiled = level >= 2 && level <= 5;
+				const std::vector<float>& source = tiled ? unrounded : stored[level - 1];
+				int tileSide = tiled ? 32 >> (level - 1) : sourceSide;
+				std::vector<float> next(levelSide * levelSide * 4);
+				for (int y = 0; y < levelSide; y++) {
+					for (int x = 0; x < levelSide; x++) {
+						int originX = 2 * x / tileSide * tileSide, originY = 2 * y / tileSide * tileSide;
+						for (int c = 0; c < 4; c++) {
+							float sum = 0;
+							for (int ty = 0; ty < 4; ty++) {
+								for (int tx = 0; tx < 4; tx++) {
+									if (!kaiser && (tx < 1 || tx > 2 || ty < 1 || ty > 2))
+										continue;
+									int sx = std::clamp(2 * x + tx - 1, originX, originX + tileSide - 1);
+									int sy = std::clamp(2 * y + ty - 1, originY, originY + tileSide - 1);
+									float weight = kaiser ? weights[tx] * weights[ty] : 0.25f;
+									sum += weight * source[(sy * sourceSide + sx) * 4 + c];
+								}
+							}
+							next[(y * levelSide + x) * 4 + c] = sum;
+						}
+					}
+				}
+				stored[level].resize(next.size());
+				for (size_t i = 0; i < next.size(); i++)
+					stored[level][i] = quantize(next[i]);
+				unrounded = next;
+			}
+			return stored;
+		};
+
+		const char* source =
+			"#version 450\n"
+			"layout(local_size_x = 64) in;\n"
+			"layout(set = 0, binding = 0) uniform sampler2D Pyramid;\n"
+			"layout(set = 0, binding = 1) buffer Texels { vec4 texels[]; };\n"
+			"layout(push_constant) uniform Params { int level; int offset; };\n"
+			"void main() {\n"
+			"	ivec2 size = textureSize(Pyramid, level);\n"
+			"	int i = int(gl_GlobalInvocationID.x);\n"
+			"	if (i < size.x * size.y) texels[offset + i] = texelFetch(Pyramid, ivec2(i % size.x, i / size.x), level);\n"
+			"}\n";
+		ComputeShader* fetch = new ComputeShader(engine, (void*)source, (uint32_t)strlen(source));
+		uint32_t texelCount = 0;
+		for (uint32_t level = 1; level < mipCount; level++)
+			texelCount += (side >> level) * (side >> level);
+		GPBuffer* texels = new GPBuffer(engine->ImplementationContext, GPGPUMemoryType::Static, texelCount * 4 * sizeof(float));
+		fetch->Bind("Pyramid", pyramid);
+		fetch->Bind("Texels", texels);
+		auto* levels = (float*)texels->MapBuffer();
+		const std::pair<GPMipFilter, const char*> filters[] = { { GPMipFilter::Box, "Box" }, { GPMipFilter::Kaiser, "Kaiser" } };
+		for (auto& [filter, name] : filters) {
+			pyramid->GenerateMipmap(filter);
+			int32_t params[2] = { 0, 0 };
+			for (uint32_t level = 1; level < mipCount; level++) {
+				params[0] = (int32_t)level;
+				fetch->SetPushConstants(params, sizeof(params));
+				fetch->DispatchInvocations((side >> level) * (side >> level), 1, 1);
+				params[1] += (int32_t)((side >> level) * (side >> level));
+			}
+			engine->CommitMemory();
+			texels->SyncRead();
+			auto expected = reference(filter == GPMipFilter::Kaiser);
+			// One step of 8 bit rounding apart at most
+			bool correct = true;
+			const float* texel = levels;
+			for (uint32_t level = 1; level < mipCount; level++) {
+				for (float value : expected[level])
+					correct &= std::fabs(*texel++ - value) <= 1.01f / 255.0f;
+			}
+			printf("Mipmap generation (%s) %s\n", name, correct ? "passed" : "failed");
+			if (!correct)
+				exitCode = 1;
+		}
+		delete texels;
+		delete fetch;
+		delete pyramid;
+	}
+
+	{
+		// Every thread writes and reads back its own buffer, recording on its own command pools
+		const uint32_t threadCount = 8, count = 64 * 1024;
+		std::vector<int> passed(threadCount, 0);
+		std::vector<std::thread> threads;
+		for (uint32_t t = 0; t < threadCount; t++) {
+			threads.emplace_back([&, t]() {
+				std::vector<uint32_t> data(count);
+				for (uint32_t i = 0; i < count; i++)
+					data[i] = t * count + i;
+				GPBuffer* values = new GPBuffer(engine->ImplementationContext, GPGPUMemoryType::Static, count * sizeof(uint32_t));
+				const uint64_t half = count / 2 * sizeof(uint32_t);
+				values->WriteAsync(data.data(), 0, half);
+				values->Write(data.data() + count / 2, half, half);
+				auto* mapped = values->MapBuffer();
+				values->SyncRead();
+				passed[t] = memcmp(mapped, data.data(), count * sizeof(uint32_t)) == 0;
+				delete values;
+			});
+		}
+		for (auto& worker : threads)
+			worker.join();
+		engine->CommitMemory();
+		bool correct = std::count(passed.begin(), passed.end(), 1) == threadCount;
+		printf("Multi-threaded transfers %s\n", correct ? "passed" : "failed");
+		if (!correct)
+			exitCode = 1;
+	}
+
+	// Everything Static was deleted, only the staging pool keeps Host buffers cached
+	MemoryStats memory = engine->GetMemoryStats();
+	for (auto& heap : memory.Heaps)
+		printf("Heap %s %llu MB, usage %llu MB of %llu MB budget\n", heap.DeviceLocal ? "device" : "host  ", (unsigned long long)heap.Size / (1024 * 1024),
+			(unsigned long long)heap.Usage / (1024 * 1024), (unsigned long long)heap.Budget / (1024 * 1024));
+	auto& staticStats = memory.MemoryTypes[(int)GPGPUMemoryType::Static];
+	bool leaked = staticStats.LiveBytes || staticStats.BufferCount || staticStats.ImageCount;
+	printf("Static memory peak %llu KB, leak check %s\n", (unsigned long long)staticStats.PeakBytes / 1024, leaked ? "failed" : "passed");
+	if (leaked)
+		exitCode = 1;
+	bool exported = engine->ExportMemoryJson("memory.json");
+	printf("Memory json export %s\n", exported ? "passed" : "failed");
+	if (!exported)
+		exitCode = 1;
+	std::remove("memory.json");
+
+	for (auto& stats : engine->GetProfileStats())
+		printf("%-32s x%llu min %.1f us avg %.1f us p99 %.1f us\n", stats.Label.c_str(), (unsigned long long)stats.Count,
+			stats.MinNs / 1000.0, stats.AvgNs / 1000.0, stats.P99Ns / 1000.0);
+	engine->ExportChromeTrace("trace.json");
+
 	delete engine;
-	return 0;
+	return exitCode;
 }
\ No newline at end of file
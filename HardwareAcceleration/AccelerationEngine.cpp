@@ -1,23 +1,37 @@
+#define _CRT_SECURE_NO_WARNINGS
 #include "AccelerationEngine.hpp"
+#include "Defragmenter.hpp"
+#include "DescriptorAllocator.hpp"
 #include "ImplementationContext.hpp"
 #include "ImplementationLogger.hpp"
 #include "ImplementionManagedTypes.hpp"
 #include "MemoryAllocator.hpp"
+#include "MemoryStatistics.hpp"
+#include "MipGenerator.hpp"
+#include "Profiler.hpp"
+#include "ShaderCache.hpp"
+#include "StagingPool.hpp"
 #include <vk_mem_alloc.h>
 #include <vulkan/vulkan.h>
 #include <iostream>
 #include <cassert>
+#include <cstring>
+#include <stdio.h>
 #ifdef _WIN32
 #include <Windows.h>
+#else
+#include <dlfcn.h>
 #endif
 
 namespace HA {
 
 	static bool CheckInstanceSupport(const char* layerName);
+	static bool CheckInstanceExtensionSupport(const char* extensionName);
+	static bool CheckDeviceExtensionSupport(VkPhysicalDevice physicalDevice, const char* extensionName);
 	static VKAPI_ATTR VkBool32 VKAPI_CALL HA_VulkanValidation_DebugCallback(VkDebugUtilsMessageSeverityFlagBitsEXT messageSeverity, VkDebugUtilsMessageTypeFlagsEXT messageType, const VkDebugUtilsMessengerCallbackDataEXT* pCallbackData, void* pUserData);
 
 	AccelerationEngine::AccelerationEngine(bool DebugEnable, AccelerationEngineDebuggingOptions DebugMode)
-		: DebugEnable(DebugEnable), DebugMode(DebugMode), _Logger(nullptr)
+		: DebugEnable(DebugEnable), DebugMode(DebugMode), _Logger(nullptr), CacheDirectory("HACache"), ForceTransferThread(false)
 	{
 		ImplementationContext = new HA::ImplementationContext();
 		ImplementationContext->AllocationCallbacks = nullptr;
@@ -51,6 +65,16 @@ namespace HA {
 		instanceCreateInfo.enabledLayerCount = (uint32_t)extensions.size();
 		instanceCreateInfo.ppEnabledLayerNames = extensions.data();
 
+		// Required by the optional device extensions on a Vulkan 1.0 instance
+		std::vector<const char*> instanceExtensions;
+		for (const char* name : { VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME, VK_KHR_EXTERNAL_MEMORY_CAPABILITIES_EXTENSION_NAME }) {
+			if (CheckInstanceExtensionSupport(name))
+				instanceExtensions.push_back(name);
+		}
+		ImplementationContext->ExternalMemoryCapabilities = instanceExtensions.size() == 2;
+		instanceCreateInfo.enabledExtensionCount = (uint32_t)instanceExtensions.size();
+		instanceCreateInfo.ppEnabledExtensionNames = instanceExtensions.data();
+
 		VkResult result = vkCreateInstance(&instanceCreateInfo, ImplementationContext->AllocationCallbacks, &ImplementationContext->Instance);
 		if (result != VK_SUCCESS) {
 			if (DebugEnable)
@@ -62,7 +86,17 @@ namespace HA {
 
 	AccelerationEngine::~AccelerationEngine()
 	{
+		// Post functions of either thread may touch the other, idle both before deleting them
+		if (ImplementationContext->_CommandThread)
+			ImplementationContext->_CommandThread->WaitIdle();
 		delete ImplementationContext->_CommandThread;
+		delete ImplementationContext->_TransferThread;
+		delete ImplementationContext->_MipGenerator;
+		delete ImplementationContext->_StagingPool;
+		delete ImplementationContext->_ShaderCache;
+		delete ImplementationContext->_DescriptorAllocator;
+		delete ImplementationContext->_Profiler;
+		delete ImplementationContext->_MemoryStatistics;
 		if (ImplementationContext->Allocator)
 			vmaDestroyAllocator(ImplementationContext->Allocator);
 		if (ImplementationContext->Device) {
@@ -148,42 +182,247 @@ namespace HA {
 			return false;
 		}
 
-		float queuePriority = 1.0f;
-		VkDeviceQueueCreateInfo queueCreateInfo{ VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO };
-		queueCreateInfo.queueCount = 1;
-		queueCreateInfo.queueFamilyIndex = index;
-		queueCreateInfo.pQueuePriorities = &queuePriority;
+		// A second queue lets copies overlap compute: a transfer only family, another
+		// compute family or a second queue of the compute family, in that order
+		int transferIndex = -1;
+		for (int i = 0; i < (int)queueFamilyCount && transferIndex < 0; i++) {
+			auto flags = queueFamilyProps[i].queueFlags;
+			if (i != index && (flags & VK_QUEUE_TRANSFER_BIT) && !(flags & (VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT)))
+				transferIndex = i;
+		}
+		for (int i = 0; i < (int)queueFamilyCount && transferIndex < 0; i++) {
+			if (i != index && (queueFamilyProps[i].queueFlags & VK_QUEUE_COMPUTE_BIT))
+				transferIndex = i;
+		}
+		if (transferIndex < 0 && queueFamilyProps[index].queueCount > 1)
+			transferIndex = index;
+		bool sharedTransfer = transferIndex < 0 && ForceTransferThread;
+
+		float queuePriorities[] = { 1.0f, 1.0f };
+		VkDeviceQueueCreateInfo queueCreateInfos[2] = {};
+		uint32_t queueCreateInfoCount = 1;
+		queueCreateInfos[0].sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
+		queueCreateInfos[0].queueCount = transferIndex == index ? 2 : 1;
+		queueCreateInfos[0].queueFamilyIndex = index;
+		queueCreateInfos[0].pQueuePriorities = queuePriorities;
+		if (transferIndex >= 0 && transferIndex != index) {
+			queueCreateInfos[1] = queueCreateInfos[0];
+			queueCreateInfos[1].queueCount = 1;
+			queueCreateInfos[1].queueFamilyIndex = transferIndex;
+			queueCreateInfoCount = 2;
+		}
+
+		std::vector<const char*> deviceExtensions;
+		auto getProperties2 = (PFN_vkGetPhysicalDeviceProperties2KHR)vkGetInstanceProcAddr(ImplementationContext->Instance,
+			"vkGetPhysicalDeviceProperties2KHR");
+		bool externalMemoryHost = ImplementationContext->ExternalMemoryCapabilities && getProperties2 &&
+			CheckDeviceExtensionSupport(physicalDevice, VK_KHR_EXTERNAL_MEMORY_EXTENSION_NAME) &&
+			CheckDeviceExtensionSupport(physicalDevice, VK_EXT_EXTERNAL_MEMORY_HOST_EXTENSION_NAME);
+		if (externalMemoryHost) {
+			deviceExtensions.push_back(VK_KHR_EXTERNAL_MEMORY_EXTENSION_NAME);
+			deviceExtensions.push_back(VK_EXT_EXTERNAL_MEMORY_HOST_EXTENSION_NAME);
+		}
+		ImplementationContext->MemoryBudget = getProperties2 &&
+			CheckDeviceExtensionSupport(physicalDevice, VK_EXT_MEMORY_BUDGET_EXTENSION_NAME);
+		if (ImplementationContext->MemoryBudget)
+			deviceExtensions.push_back(VK_EXT_MEMORY_BUDGET_EXTENSION_NAME);
+
+		// Storage images in formats like r8 or rg16f, see GPImage::GenerateMipmap()
+		VkPhysicalDeviceFeatures supportedFeatures;
+		vkGetPhysicalDeviceFeatures(physicalDevice, &supportedFeatures);
+		VkPhysicalDeviceFeatures features{};
+		features.shaderStorageImageExtendedFormats = supportedFeatures.shaderStorageImageExtendedFormats;
 
 		VkDeviceCreateInfo createInfo{ VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO };
-		createInfo.queueCreateInfoCount = 1;
-		createInfo.pQueueCreateInfos = &queueCreateInfo;
+		createInfo.queueCreateInfoCount = queueCreateInfoCount;
+		createInfo.pQueueCreateInfos = queueCreateInfos;
+		createInfo.enabledExtensionCount = (uint32_t)deviceExtensions.size();
+		createInfo.ppEnabledExtensionNames = deviceExtensions.data();
+		createInfo.pEnabledFeatures = &features;
 
 		VkResult result = vkCreateDevice(physicalDevice, &createInfo, ImplementationContext->AllocationCallbacks, &ImplementationContext->Device);
 		if (result != VK_SUCCESS) {
 			return false;
 		}
+		if (externalMemoryHost) {
+			VkPhysicalDeviceExternalMemoryHostPropertiesEXT hostProperties{ VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTERNAL_MEMORY_HOST_PROPERTIES_EXT };
+			VkPhysicalDeviceProperties2KHR properties2{ VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2 };
+			properties2.pNext = &hostProperties;
+			getProperties2(physicalDevice, &properties2);
+			ImplementationContext->MinImportedHostPointerAlignment = hostProperties.minImportedHostPointerAlignment;
+			ImplementationContext->GetMemoryHostPointerProperties = (PFN_vkGetMemoryHostPointerPropertiesEXT)vkGetDeviceProcAddr(
+				ImplementationContext->Device, "vkGetMemoryHostPointerPropertiesEXT");
+		}
+		ImplementationContext->ExternalMemoryHost = externalMemoryHost && ImplementationContext->GetMemoryHostPointerProperties;
 		ImplementationContext->PhysicalDevice = physicalDevice;
+		ImplementationContext->StorageImageExtendedFormats = features.shaderStorageImageExtendedFormats;
 		vkGetPhysicalDeviceMemoryProperties(physicalDevice, &ImplementationContext->Properties);
 
 		vkGetDeviceQueue(ImplementationContext->Device, index, 0, &ImplementationContext->Queue);
+		ImplementationContext->QueueFamilies[0] = ImplementationContext->QueueFamilies[1] = index;
+		if (transferIndex >= 0) {
+			vkGetDeviceQueue(ImplementationContext->Device, transferIndex, transferIndex == index ? 1 : 0, &ImplementationContext->TransferQueue);
+			ImplementationContext->QueueFamilies[1] = transferIndex;
+			// The profiler resets its queries in the command buffer, which transfer-only families can not
+			ImplementationContext->TransferTimestamps = queueFamilyProps[transferIndex].timestampValidBits != 0 &&
+				(queueFamilyProps[transferIndex].queueFlags & VK_QUEUE_COMPUTE_BIT);
+			ImplementationContext->TransferCompute = (queueFamilyProps[transferIndex].queueFlags & VK_QUEUE_COMPUTE_BIT) != 0;
+			auto& granularity = queueFamilyProps[transferIndex].minImageTransferGranularity;
+			ImplementationContext->TransferImageGranularity = granularity.width == 1 && granularity.height == 1 && granularity.depth == 1;
+		}
+		else if (sharedTransfer) {
+			// Behaves like a transfer only family, so its barriers leave out the compute stage
+			ImplementationContext->TransferQueue = ImplementationContext->Queue;
+			ImplementationContext->TransferTimestamps = false;
+			ImplementationContext->TransferCompute = false;
+			ImplementationContext->TransferImageGranularity = true;
+		}
 		VmaAllocatorCreateInfo vcreateInfo{};
 		vcreateInfo.physicalDevice = ImplementationContext->PhysicalDevice;
 		vcreateInfo.device = ImplementationContext->Device;
 		vcreateInfo.pAllocationCallbacks = ImplementationContext->AllocationCallbacks;
 		vcreateInfo.instance = ImplementationContext->Instance;
 		vcreateInfo.vulkanApiVersion = VK_API_VERSION_1_0;
+		if (ImplementationContext->MemoryBudget)
+			vcreateInfo.flags |= VMA_ALLOCATOR_CREATE_EXT_MEMORY_BUDGET_BIT;
 		vmaCreateAllocator(&vcreateInfo, &ImplementationContext->Allocator);
 
 		ImplementationContext->_CommandThread = new CommandThread(ImplementationContext->Device, ImplementationContext->Queue, index, ImplementationContext->AllocationCallbacks);
+		if (transferIndex >= 0 || sharedTransfer) {
+			// Compute submissions wait for the copies submitted before them, copies only wait
+			// for compute work on the resources they touch
+			ImplementationContext->_TransferThread = new CommandThread(ImplementationContext->Device, ImplementationContext->TransferQueue,
+				ImplementationContext->QueueFamilies[1], ImplementationContext->AllocationCallbacks, 8, 1ull << 63);
+			ImplementationContext->_CommandThread->SetPartner(ImplementationContext->_TransferThread, true);
+			ImplementationContext->_TransferThread->SetPartner(ImplementationContext->_CommandThread, false);
+		}
+		ImplementationContext->_StagingPool = new StagingPool(ImplementationContext);
+		ImplementationContext->_ShaderCache = new ShaderCache(ImplementationContext, CacheDirectory);
+		ImplementationContext->_DescriptorAllocator = new DescriptorAllocator(ImplementationContext);
+		VkPhysicalDeviceProperties deviceProperties;
+		vkGetPhysicalDeviceProperties(physicalDevice, &deviceProperties);
+		ImplementationContext->_MemoryStatistics = new MemoryStatistics();
+		ImplementationContext->_MipGenerator = new MipGenerator(ImplementationContext);
+		ImplementationContext->_Profiler = new Profiler(ImplementationContext, queueFamilyProps[index].timestampValidBits,
+			deviceProperties.limits.timestampPeriod);
 
 		return true;
 	}
 
+	void AccelerationEngine::SetCacheDirectory(const char* path)
+	{
+		CacheDirectory = path ? path : "";
+	}
+
+	void AccelerationEngine::SetForceTransferThread(bool force)
+	{
+		ForceTransferThread = force;
+	}
+
+	void AccelerationEngine::EnableProfiling(bool enable)
+	{
+		ImplementationContext->_Profiler->SetEnabled(enable);
+	}
+
+	std::vector<ProfileStats> AccelerationEngine::GetProfileStats()
+	{
+		// Collect whatever finished since the last call
+		ImplementationContext->_CommandThread->PollAll();
+		return ImplementationContext->_Profiler->GetStats();
+	}
+
+	void AccelerationEngine::ResetProfileStats()
+	{
+		ImplementationContext->_Profiler->Reset();
+	}
+
+	bool AccelerationEngine::ExportChromeTrace(const char* path)
+	{
+		ImplementationContext->_CommandThread->PollAll();
+		return ImplementationContext->_Profiler->ExportChromeTrace(path);
+	}
+
+	MemoryStats AccelerationEngine::GetMemoryStats()
+	{
+		MemoryStats stats{};
+		for (int i = 0; i < 3; i++)
+			stats.MemoryTypes[i] = ImplementationContext->_MemoryStatistics->Get((GPGPUMemoryType)i);
+		stats.BudgetExtension = ImplementationContext->MemoryBudget;
+
+		auto& properties = ImplementationContext->Properties;
+		VmaBudget budgets[VK_MAX_MEMORY_HEAPS];
+		vmaGetHeapBudgets(ImplementationContext->Allocator, budgets);
+		for (uint32_t i = 0; i < properties.memoryHeapCount; i++) {
+			HeapBudget heap{};
+			heap.Size = properties.memoryHeaps[i].size;
+			heap.Usage = budgets[i].usage;
+			heap.Budget = budgets[i].budget;
+			heap.BlockBytes = budgets[i].statistics.blockBytes;
+			heap.AllocationBytes = budgets[i].statistics.allocationBytes;
+			heap.DeviceLocal = properties.memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT;
+			stats.Heaps.push_back(heap);
+		}
+
+		// Walks every block, still cheap next to a submission
+		VmaTotalStatistics total;
+		vmaCalculateStatistics(ImplementationContext->Allocator, &total);
+		stats.BlockBytes = total.total.statistics.blockBytes;
+		stats.AllocationBytes = total.total.statistics.allocationBytes;
+		stats.BlockCount = total.total.statistics.blockCount;
+		stats.AllocationCount = total.total.statistics.allocationCount;
+		uint64_t unused = stats.BlockBytes - stats.AllocationBytes;
+		stats.Fragmentation = unused && total.total.unusedRangeCount ? 1.0 - (double)total.total.unusedRangeSizeMax / unused : 0.0;
+		return stats;
+	}
+
+	DefragmentationStats AccelerationEngine::Defragment(uint64_t maxBytesPerPass, uint32_t maxPasses)
+	{
+		Defragmenter defragmenter(ImplementationContext);
+		return defragmenter.Run(maxBytesPerPass, maxPasses);
+	}
+
+	void AccelerationEngine::ResetMemoryPeaks()
+	{
+		ImplementationContext->_MemoryStatistics->ResetPeaks();
+	}
+
+	bool AccelerationEngine::ExportMemoryJson(const char* path)
+	{
+		FILE* io = fopen(path, "w");
+		if (!io)
+			return false;
+		char* json = nullptr;
+		vmaBuildStatsString(ImplementationContext->Allocator, &json, VK_TRUE);
+		bool written = fputs(json, io) >= 0;
+		vmaFreeStatsString(ImplementationContext->Allocator, json);
+		return fclose(io) == 0 && written;
+	}
+
 	void AccelerationEngine::CommitMemory()
 	{
 		ImplementationContext->_CommandThread->Execute();
 	}
 
+	CommandTicket AccelerationEngine::CommitMemoryAsync()
+	{
+		return ImplementationContext->_CommandThread->Submit();
+	}
+
+	void AccelerationEngine::Wait(CommandTicket ticket)
+	{
+		ImplementationContext->_CommandThread->Wait(ticket);
+	}
+
+	bool AccelerationEngine::Poll(CommandTicket ticket)
+	{
+		return ImplementationContext->_CommandThread->Poll(ticket);
+	}
+
+	void AccelerationEngine::WaitIdle()
+	{
+		ImplementationContext->_CommandThread->WaitIdle();
+	}
+
 	bool AccelerationEngine::CheckVulkanSupport()
 	{
 #ifdef _WIN32
@@ -194,9 +433,17 @@ namespace HA {
 		}
 		return false;
 #else
-#error "Not Supported"
+#ifdef __APPLE__
+		void* libraryTest = dlopen("libvulkan.1.dylib", RTLD_NOW | RTLD_LOCAL);
+#else
+		void* libraryTest = dlopen("libvulkan.so.1", RTLD_NOW | RTLD_LOCAL);
+#endif
+		if (libraryTest) {
+			dlclose(libraryTest);
+			return true;
+		}
+		return false;
 #endif
-		return true;
 	}
 
 	static bool CheckInstanceSupport(const char* layerName) {
@@ -222,6 +469,30 @@ namespace HA {
 
 	}
 
+	static bool CheckInstanceExtensionSupport(const char* extensionName) {
+		uint32_t extensionCount = 0;
+		vkEnumerateInstanceExtensionProperties(nullptr, &extensionCount, nullptr);
+		std::vector<VkExtensionProperties> availableExtensions(extensionCount);
+		vkEnumerateInstanceExtensionProperties(nullptr, &extensionCount, availableExtensions.data());
+		for (const auto& extension : availableExtensions) {
+			if (strcmp(extensionName, extension.extensionName) == 0)
+				return true;
+		}
+		return false;
+	}
+
+	static bool CheckDeviceExtensionSupport(VkPhysicalDevice physicalDevice, const char* extensionName) {
+		uint32_t extensionCount = 0;
+		vkEnumerateDeviceExtensionProperties(physicalDevice, nullptr, &extensionCount, nullptr);
+		std::vector<VkExtensionProperties> availableExtensions(extensionCount);
+		vkEnumerateDeviceExtensionProperties(physicalDevice, nullptr, &extensionCount, availableExtensions.data());
+		for (const auto& extension : availableExtensions) {
+			if (strcmp(extensionName, extension.extensionName) == 0)
+				return true;
+		}
+		return false;
+	}
+
 	static VKAPI_ATTR VkBool32 VKAPI_CALL HA_VulkanValidation_DebugCallback(
 		VkDebugUtilsMessageSeverityFlagBitsEXT messageSeverity,
 		VkDebugUtilsMessageTypeFlagsEXT messageType,
@@ -1,7 +1,11 @@
 #pragma once
 #include <vector>
+#include <string>
 #include <cstdint>
 #include "GPGPUMemory.hpp"
+#include "MemoryAllocator.hpp"
+#include "ComputeShader.hpp"
+#include "TaskGraph.hpp"
 
 namespace HA {
 
@@ -23,6 +27,85 @@ namespace HA {
 		CONSOLE
 	};
 
+	/// <summary>
+	/// Device time of a profiled region, see AccelerationEngine::EnableProfiling().
+	/// Labels ending in " (host)" measure the time spent recording the region on the CPU.
+	/// </summary>
+	struct ProfileStats {
+		std::string Label;
+		uint64_t Count;
+		double MinNs;
+		double AvgNs;
+		/// <summary>
+		/// Over the most recent 16384 samples
+		/// </summary>
+		double P99Ns;
+	};
+
+	/// <summary>
+	/// Live GPBuffer and GPImage allocations of one GPGPUMemoryType, see AccelerationEngine::GetMemoryStats().
+	/// </summary>
+	struct MemoryTypeStats {
+		uint64_t LiveBytes;
+		/// <summary>
+		/// Highest LiveBytes since the engine was created or ResetMemoryPeaks() was called
+		/// </summary>
+		uint64_t PeakBytes;
+		uint64_t BufferCount;
+		uint64_t ImageCount;
+	};
+
+	/// <summary>
+	/// One Vulkan memory heap. Usage and Budget include other processes when the device supports
+	/// VK_EXT_memory_budget, otherwise Usage only counts this engine and Budget is an estimate.
+	/// </summary>
+	struct HeapBudget {
+		uint64_t Size;
+		uint64_t Usage;
+		uint64_t Budget;
+		/// <summary>
+		/// Device memory blocks this engine allocated from the heap, and the bytes used inside them
+		/// </summary>
+		uint64_t BlockBytes;
+		uint64_t AllocationBytes;
+		bool DeviceLocal;
+	};
+
+	struct MemoryStats {
+		/// <summary>
+		/// Indexed by GPGPUMemoryType
+		/// </summary>
+		MemoryTypeStats MemoryTypes[3];
+		std::vector<HeapBudget> Heaps;
+		/// <summary>
+		/// True if Heaps come from VK_EXT_memory_budget
+		/// </summary>
+		bool BudgetExtension;
+		uint64_t BlockBytes;
+		uint64_t AllocationBytes;
+		uint32_t BlockCount;
+		uint32_t AllocationCount;
+		/// <summary>
+		/// 0 if the free memory inside blocks is one contiguous range, towards 1 the more it is scattered
+		/// </summary>
+		double Fragmentation;
+	};
+
+	/// <summary>
+	/// Result of AccelerationEngine::Defragment().
+	/// </summary>
+	struct DefragmentationStats {
+		uint64_t BytesMoved;
+		uint64_t BytesFreed;
+		uint32_t AllocationsMoved;
+		uint32_t BlocksFreed;
+		uint32_t Passes;
+		/// <summary>
+		/// False if maxPasses stopped it before everything that can be moved was moved
+		/// </summary>
+		bool Complete;
+	};
+
 	/// <summary>
 	/// Describes the properties of the graphics card.
 	/// </summary>
@@ -70,11 +153,90 @@ namespace HA {
 		/// <returns>True if the device is supported, false then use a different device.</returns>
 		bool UseDevice(const HardwareDevice& device);
 
+		/// <summary>
+		/// Directory where compiled shaders and the pipeline cache are kept between runs,
+		/// "HACache" by default. Must be called before UseDevice, nullptr or "" disables the cache.
+		/// </summary>
+		void SetCacheDirectory(const char* path);
+
+		/// <summary>
+		/// Runs copies through a second CommandThread even if the device has a single queue. It shares
+		/// the compute queue and acts like a transfer only family, so the hand-off between the two
+		/// threads can be tested on any device. Must be called before UseDevice.
+		/// </summary>
+		void SetForceTransferThread(bool force);
+
 		/// <summary>
 		/// Performs all the WriteAsync calls
 		/// </summary>
 		void CommitMemory();
 
+		/// <summary>
+		/// Submits all the WriteAsync calls without waiting for them, so the next
+		/// batch can be recorded while this one executes.
+		/// </summary>
+		/// <returns>Ticket to pass to Wait() or Poll()</returns>
+		CommandTicket CommitMemoryAsync();
+
+		/// <summary>
+		/// Blocks until the submission identified by ticket has completed.
+		/// </summary>
+		void Wait(CommandTicket ticket);
+
+		/// <summary>
+		/// Returns true if the submission identified by ticket has completed.
+		/// </summary>
+		bool Poll(CommandTicket ticket);
+
+		/// <summary>
+		/// Blocks until every submitted command buffer has completed.
+		/// Pending WriteAsync calls are not submitted, use CommitMemory() for those.
+		/// </summary>
+		void WaitIdle();
+
+		/// <summary>
+		/// Wraps uploads, image copies, readbacks and dispatches in GPU timestamp queries.
+		/// Results are collected when their submission retires, so they never block.
+		/// Has no effect if the queue does not support timestamps.
+		/// </summary>
+		void EnableProfiling(bool enable);
+
+		/// <summary>
+		/// Per label statistics of every retired profiled region.
+		/// </summary>
+		std::vector<ProfileStats> GetProfileStats();
+
+		void ResetProfileStats();
+
+		/// <summary>
+		/// Writes the profiled regions in the Chrome trace event format (chrome://tracing, Perfetto).
+		/// </summary>
+		/// <returns>False if the file could not be written</returns>
+		bool ExportChromeTrace(const char* path);
+
+		/// <summary>
+		/// Heap budgets and the engine's live allocations, cheap enough to poll every batch.
+		/// </summary>
+		MemoryStats GetMemoryStats();
+
+		void ResetMemoryPeaks();
+
+		/// <summary>
+		/// Writes VMA's detailed JSON dump of every block and allocation.
+		/// </summary>
+		/// <returns>False if the file could not be written</returns>
+		bool ExportMemoryJson(const char* path);
+
+		/// <summary>
+		/// Compacts device memory by moving GPBuffer and GPImage allocations with GPU copies and
+		/// releasing the blocks that become empty. Existing GPBuffer and GPImage objects stay valid.
+		/// Submits pending WriteAsync calls and waits for the device to go idle, so call it between batches.
+		/// Buffers from a MemoryAllocator and mapped Stream or Host buffers are not moved.
+		/// </summary>
+		/// <param name="maxBytesPerPass">Bytes copied per pass, each pass waits for its copies</param>
+		/// <param name="maxPasses">Spreads the work over several calls, 0 runs until done</param>
+		DefragmentationStats Defragment(uint64_t maxBytesPerPass = 64ull * 1024 * 1024, uint32_t maxPasses = 0);
+
 		static bool CheckVulkanSupport();
 
 	public:
@@ -89,13 +251,15 @@ namespace HA {
 		/// <summary>
 		/// Internal Use Only by the API. The user should not require this object.
 		/// </summary>
-		ImplementationContext* ImplementationContext;
+		HA::ImplementationContext* ImplementationContext;
 
 	private:
 		/// <summary>
 		/// Internal Use Only by the API. Manages info/warning/error logging.
 		/// </summary>
 		Logger* _Logger;
+		std::string CacheDirectory;
+		bool ForceTransferThread;
 	};
 
 }
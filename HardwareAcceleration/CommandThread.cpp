@@ -1,81 +1,623 @@
 #include "CommandThread.hpp"
+#include <cassert>
+#include <thread>
 
-HA::CommandThread::CommandThread(VkDevice device, VkQueue queue, uint32_t queueFamilyIndex, VkAllocationCallbacks* Callbacks)
-	:Device(device), Queue(queue), AllocationCallbacks(Callbacks)
+// Ids are never reused, so a recorder cached for a destroyed CommandThread is never matched again.
+static std::atomic<uint64_t> NextThreadId(1);
+
+HA::CommandThread::CommandThread(VkDevice device, VkQueue queue, uint32_t queueFamilyIndex, VkAllocationCallbacks* Callbacks, uint32_t InFlightCount,
+	CommandTicket FirstTicket)
+	:Id(NextThreadId++), Device(device), Queue(queue), QueueFamilyIndex(queueFamilyIndex), AllocationCallbacks(Callbacks), RingHead(0),
+	FirstTicket(FirstTicket), NextTicket(FirstTicket), Pending(nullptr), Draining(false), QueueLock(&SubmitLock), Partner(nullptr), FollowPartner(false)
 {
-	Fence = GenFence();
-	VkCommandPoolCreateInfo createInfo{ VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO };
-	createInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
-	createInfo.queueFamilyIndex = queueFamilyIndex;
-	vkCreateCommandPool(device, &createInfo, AllocationCallbacks, &Pool);
-	SharedCmd = GenCmd();
+	Ring.resize(InFlightCount > 0 ? InFlightCount : 1);
+	for (auto& slot : Ring) {
+		VkFenceCreateInfo fenceInfo{ VK_STRUCTURE_TYPE_FENCE_CREATE_INFO };
+		vkCreateFence(Device, &fenceInfo, AllocationCallbacks, &slot.Fence);
+		slot.Cmd = VK_NULL_HANDLE;
+		slot.Owner = nullptr;
+		slot.Shared = false;
+		slot.FenceUsed = false;
+		slot.State = SlotState::Free;
+		slot.Ticket = 0;
+		slot.Waiters = 0;
+	}
 }
 
 HA::CommandThread::~CommandThread()
 {
-	ReleaseFence(Fence);
-	vkDestroyCommandPool(Device, Pool, AllocationCallbacks);
+	// The partner may already be gone, the engine idles both before deleting either.
+	Drain();
+	WaitRing();
+	PostFunctionList postFunctions;
+	for (uint32_t i = 0; i < Ring.size(); i++) {
+		// Recorded but never submitted, only the post functions need to run.
+		if (Ring[i].State == SlotState::Recording)
+			Retire(i, postFunctions);
+		vkDestroyFence(Device, Ring[i].Fence, AllocationCallbacks);
+	}
+	Run(postFunctions);
+	for (auto semaphore : Semaphores)
+		vkDestroySemaphore(Device, semaphore, AllocationCallbacks);
+	// Destroying the pools frees their command buffers
+	for (auto recorder : Recorders) {
+		vkDestroyCommandPool(Device, recorder->Pool, AllocationCallbacks);
+		vkDestroyCommandPool(Device, recorder->SharedPool, AllocationCallbacks);
+		delete recorder;
+	}
 }
 
-VkFence HA::CommandThread::GenFence()
+HA::CommandThread::Batch::Batch(CommandThread* thread)
+	: Cmd(VK_NULL_HANDLE), Ticket(0), Owner(thread->GetRecorder())
 {
-	VkFence fence;
-	VkFenceCreateInfo createInfo{ VK_STRUCTURE_TYPE_FENCE_CREATE_INFO };
-	vkCreateFence(Device, &createInfo, AllocationCallbacks, &fence);
-	return fence;
+	Owner->SharedLock.lock();
+	if (Owner->SharedSlot < 0) {
+		Owner->SharedSlot = (int32_t)thread->AcquireSlot(Owner, true, Cmd, Ticket, PostFunctions);
+		return;
+	}
+	std::lock_guard<std::mutex> guard(thread->Lock);
+	Cmd = thread->Ring[Owner->SharedSlot].Cmd;
+	Ticket = thread->Ring[Owner->SharedSlot].Ticket;
 }
 
-void HA::CommandThread::ReleaseFence(VkFence fence)
+HA::CommandThread::Batch::~Batch()
 {
-	vkDestroyFence(Device, fence, AllocationCallbacks);
+	Owner->SharedLock.unlock();
+	Run(PostFunctions);
 }
 
-VkCommandBuffer HA::CommandThread::GetCmd()
+VkCommandBuffer HA::CommandThread::GenCmd()
 {
-	return SharedCmd;
+	VkCommandBuffer cmd;
+	CommandTicket ticket;
+	PostFunctionList postFunctions;
+	AcquireSlot(GetRecorder(), false, cmd, ticket, postFunctions);
+	Run(postFunctions);
+	return cmd;
 }
 
-VkCommandBuffer HA::CommandThread::GenCmd()
+HA::CommandTicket HA::CommandThread::GetTicket(VkCommandBuffer cmd)
 {
-	VkCommandBuffer cmd;
-	VkCommandBufferAllocateInfo allocInfo{ VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO };
-	allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-	allocInfo.commandPool = Pool;
-	allocInfo.commandBufferCount = 1;
-	vkAllocateCommandBuffers(Device, &allocInfo, &cmd);
+	{
+		std::lock_guard<std::mutex> guard(Lock);
+		int32_t slot = FindSlot(cmd);
+		if (slot >= 0)
+			return Ring[slot].Ticket;
+	}
+	assert(Partner && Partner->Owns(cmd) && "Command buffer was not created by this CommandThread");
+	return Partner->GetTicket(cmd);
+}
+
+HA::CommandTicket HA::CommandThread::Submit()
+{
+	std::vector<CommandTicket> tickets;
+	SubmitShared(tickets);
+	return tickets.size() ? tickets.back() : 0;
+}
+
+HA::CommandTicket HA::CommandThread::SubmitCurrent()
+{
+	return SubmitShared(GetRecorder());
+}
+
+HA::CommandTicket HA::CommandThread::Submit(VkCommandBuffer cmd)
+{
+	Recorder* owner;
+	bool shared;
+	uint32_t slot;
+	{
+		std::lock_guard<std::mutex> guard(Lock);
+		int32_t found = FindSlot(cmd);
+		assert(found >= 0 && Ring[found].State == SlotState::Recording);
+		slot = (uint32_t)found;
+		owner = Ring[slot].Owner;
+		shared = Ring[slot].Shared;
+	}
+	if (shared)
+		return SubmitShared(owner);
+	SubmitShared(owner);
+	return SubmitSlot(slot);
+}
+
+void HA::CommandThread::SubmitShared(std::vector<CommandTicket>& tickets)
+{
+	std::vector<Recorder*> recorders;
+	{
+		std::lock_guard<std::mutex> guard(Lock);
+		recorders = Recorders;
+	}
+	for (auto recorder : recorders) {
+		CommandTicket ticket = SubmitShared(recorder);
+		if (ticket)
+			tickets.push_back(ticket);
+	}
+	// Batched copies may only have been recorded on the followed partner
+	if (tickets.empty() && FollowPartner) {
+		CommandTicket ticket = Partner->Submit();
+		if (ticket)
+			tickets.push_back(ticket);
+	}
+}
+
+HA::CommandTicket HA::CommandThread::SubmitShared(Recorder* recorder)
+{
+	std::lock_guard<std::recursive_mutex> guard(recorder->SharedLock);
+	if (recorder->SharedSlot < 0)
+		return 0;
+	uint32_t slot = (uint32_t)recorder->SharedSlot;
+	recorder->SharedSlot = -1;
+	return SubmitSlot(slot);
+}
+
+HA::CommandTicket HA::CommandThread::SubmitSlot(uint32_t slot)
+{
+	PendingSubmit* pending = new PendingSubmit{};
+	if (FollowPartner) {
+		VkSemaphore semaphore = Partner->Signal();
+		if (semaphore)
+			pending->Waits.push_back({ semaphore, Partner });
+	}
+	CommandTicket ticket;
+	Recorder* owner;
+	{
+		std::lock_guard<std::mutex> guard(Lock);
+		pending->Cmd = Ring[slot].Cmd;
+		pending->Fence = Ring[slot].Fence;
+		pending->Slot = slot;
+		ticket = Ring[slot].Ticket;
+		owner = Ring[slot].Owner;
+	}
+	{
+		// Waits the recording thread asked for through WaitFor()
+		std::lock_guard<std::mutex> guard(WaitLock);
+		pending->Waits.insert(pending->Waits.end(), owner->Waits.begin(), owner->Waits.end());
+		owner->Waits.clear();
+	}
+	vkEndCommandBuffer(pending->Cmd);
+	{
+		std::lock_guard<std::mutex> guard(Lock);
+		Ring[slot].State = SlotState::InFlight;
+	}
+	Push(pending);
+	Drain();
+	return ticket;
+}
+
+void HA::CommandThread::Push(PendingSubmit* pending)
+{
+	PendingSubmit* head = Pending.load();
+	do {
+		pending->Next = head;
+	} while (!Pending.compare_exchange_weak(head, pending));
+}
+
+void HA::CommandThread::Drain()
+{
+	// Whoever holds the queue submits everything pushed so far, everyone else returns right away.
+	// The holder checks the list again after letting go, so nothing pushed meanwhile is left behind.
+	while (Pending.load()) {
+		bool expected = false;
+		if (!Draining.compare_exchange_strong(expected, true))
+			return;
+		PendingSubmit* ordered = nullptr;
+		for (PendingSubmit* pending = Pending.exchange(nullptr); pending;) {
+			PendingSubmit* next = pending->Next;
+			pending->Next = ordered;
+			ordered = pending;
+			pending = next;
+		}
+		while (ordered) {
+			PendingSubmit* pending = ordered;
+			ordered = pending->Next;
+
+			VkSubmitInfo submitInfo{ VK_STRUCTURE_TYPE_SUBMIT_INFO };
+			std::vector<VkSemaphore> waitSemaphores;
+			std::vector<VkPipelineStageFlags> waitStages;
+			if (pending->Cmd) {
+				if (pending->Waits.size()) {
+					// Waited on and unsignaled again once this submission has executed
+					std::lock_guard<std::mutex> guard(Lock);
+					for (auto& wait : pending->Waits) {
+						CommandThread* signaler = wait.Signaler;
+						VkSemaphore semaphore = wait.Semaphore;
+						Ring[pending->Slot].PostFunctions.push_back([signaler, semaphore]() {
+							signaler->ReleaseSemaphore(semaphore);
+						});
+						waitSemaphores.push_back(semaphore);
+						waitStages.push_back(VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
+					}
+				}
+				submitInfo.waitSemaphoreCount = (uint32_t)waitSemaphores.size();
+				submitInfo.pWaitSemaphores = waitSemaphores.data();
+				submitInfo.pWaitDstStageMask = waitStages.data();
+				submitInfo.commandBufferCount = 1;
+				submitInfo.pCommandBuffers = &pending->Cmd;
+			}
+			if (pending->Signal) {
+				submitInfo.signalSemaphoreCount = 1;
+				submitInfo.pSignalSemaphores = &pending->Signal;
+			}
+			{
+				std::lock_guard<std::mutex> guard(*QueueLock);
+				vkQueueSubmit(Queue, 1, &submitInfo, pending->Fence);
+			}
+			if (pending->Submitted)
+				pending->Submitted->store(true);
+			delete pending;
+		}
+		Draining.store(false);
+	}
+}
+
+bool HA::CommandThread::Poll(CommandTicket ticket)
+{
+	if (ticket && Partner && Partner->Owns(ticket))
+		return Partner->Poll(ticket);
+	PostFunctionList postFunctions;
+	{
+		std::lock_guard<std::mutex> guard(Lock);
+		int32_t slot = FindSlot(ticket);
+		if (slot < 0)
+			return true;
+		if (Ring[slot].State != SlotState::InFlight)
+			return false;
+		if (vkGetFenceStatus(Device, Ring[slot].Fence) != VK_SUCCESS)
+			return false;
+		Retire(slot, postFunctions);
+	}
+	Run(postFunctions);
+	return true;
+}
+
+void HA::CommandThread::PollAll()
+{
+	PollRing();
+	if (Partner)
+		Partner->PollRing();
+}
+
+void HA::CommandThread::PollRing()
+{
+	PostFunctionList postFunctions;
+	{
+		std::lock_guard<std::mutex> guard(Lock);
+		for (uint32_t i = 0; i < Ring.size(); i++) {
+			if (Ring[i].State == SlotState::InFlight && vkGetFenceStatus(Device, Ring[i].Fence) == VK_SUCCESS)
+				Retire(i, postFunctions);
+		}
+	}
+	Run(postFunctions);
+}
+
+void HA::CommandThread::Wait(CommandTicket ticket)
+{
+	if (ticket && Partner && Partner->Owns(ticket)) {
+		Partner->Wait(ticket);
+		return;
+	}
+	PostFunctionList postFunctions;
+	std::unique_lock<std::mutex> lock(Lock);
+	int32_t slot = FindSlot(ticket);
+	if (slot < 0)
+		return;
+	if (Ring[slot].State == SlotState::Recording) {
+		assert(Ring[slot].Shared && "Cannot wait on a command buffer that was never submitted");
+		Recorder* owner = Ring[slot].Owner;
+		lock.unlock();
+		SubmitShared(owner);
+		lock.lock();
+		slot = FindSlot(ticket);
+	}
+	if (slot >= 0 && Ring[slot].State == SlotState::InFlight)
+		WaitSlot(lock, slot, postFunctions);
+	lock.unlock();
+	Run(postFunctions);
+}
+
+void HA::CommandThread::Flush(CommandTicket ticket)
+{
+	if (ticket && Partner && Partner->Owns(ticket)) {
+		Partner->Flush(ticket);
+		return;
+	}
+	Recorder* owner;
+	{
+		std::lock_guard<std::mutex> guard(Lock);
+		int32_t slot = FindSlot(ticket);
+		if (slot < 0 || Ring[slot].State != SlotState::Recording || !Ring[slot].Shared)
+			return;
+		owner = Ring[slot].Owner;
+	}
+	if (owner != GetRecorder())
+		SubmitShared(owner);
+}
+
+void HA::CommandThread::WaitIdle()
+{
+	WaitRing();
+	if (Partner)
+		Partner->WaitRing();
+}
+
+void HA::CommandThread::WaitRing()
+{
+	PostFunctionList postFunctions;
+	std::unique_lock<std::mutex> lock(Lock);
+	for (uint32_t i = 0; i < Ring.size(); i++) {
+		if (Ring[i].State == SlotState::InFlight)
+			WaitSlot(lock, i, postFunctions);
+	}
+	lock.unlock();
+	Run(postFunctions);
+}
+
+void HA::CommandThread::WaitSlot(std::unique_lock<std::mutex>& lock, uint32_t slot, PostFunctionList& postFunctions)
+{
+	// The fence is not reset while anyone waits on it, see AcquireSlot
+	CommandTicket ticket = Ring[slot].Ticket;
+	VkFence fence = Ring[slot].Fence;
+	Ring[slot].Waiters++;
+	lock.unlock();
+	vkWaitForFences(Device, 1, &fence, true, UINT64_MAX);
+	lock.lock();
+	Ring[slot].Waiters--;
+	if (Ring[slot].State == SlotState::InFlight && Ring[slot].Ticket == ticket)
+		Retire(slot, postFunctions);
+}
+
+void HA::CommandThread::Execute()
+{
+	std::vector<CommandTicket> tickets;
+	SubmitShared(tickets);
+	for (auto ticket : tickets)
+		Wait(ticket);
+}
+
+void HA::CommandThread::Execute(VkCommandBuffer cmd)
+{
+	Wait(Submit(cmd));
+}
+
+void HA::CommandThread::AddPostExectute(std::function<void()>& postExec)
+{
+	Batch batch(this);
+	AddPostExectute(batch.Cmd, postExec);
+}
+
+void HA::CommandThread::AddPostExectute(VkCommandBuffer cmd, const std::function<void()>& postExec)
+{
+	{
+		std::lock_guard<std::mutex> guard(Lock);
+		int32_t slot = FindSlot(cmd);
+		if (slot >= 0) {
+			assert(Ring[slot].State == SlotState::Recording);
+			Ring[slot].PostFunctions.push_back(postExec);
+			return;
+		}
+	}
+	assert(Partner && Partner->Owns(cmd) && "Command buffer was not created by this CommandThread");
+	Partner->AddPostExectute(cmd, postExec);
+}
+
+void HA::CommandThread::SetPartner(CommandThread* partner, bool followPartner)
+{
+	Partner = partner;
+	FollowPartner = partner && followPartner;
+	// The queue is externally synchronized, the following thread takes the other one's lock
+	QueueLock = partner && followPartner && partner->Queue == Queue ? &partner->SubmitLock : &SubmitLock;
+}
+
+void HA::CommandThread::WaitFor(CommandThread* other)
+{
+	VkSemaphore semaphore = other->Signal();
+	if (!semaphore)
+		return;
+	Recorder* recorder = GetRecorder();
+	std::lock_guard<std::mutex> guard(WaitLock);
+	recorder->Waits.push_back({ semaphore, other });
+}
+
+VkSemaphore HA::CommandThread::Signal()
+{
+	Submit();
+	{
+		// Nothing to wait for once everything submitted so far has executed
+		std::lock_guard<std::mutex> guard(Lock);
+		bool busy = false;
+		for (auto& slot : Ring) {
+			if (slot.State == SlotState::InFlight && vkGetFenceStatus(Device, slot.Fence) != VK_SUCCESS)
+				busy = true;
+		}
+		if (!busy)
+			return VK_NULL_HANDLE;
+	}
+	// An empty submission signals once everything submitted before it has executed, every
+	// dependent submission gets its own. It has to reach the queue before anything waits on it.
+	std::atomic<bool> submitted(false);
+	PendingSubmit* pending = new PendingSubmit{};
+	{
+		std::lock_guard<std::mutex> guard(SignalLock);
+		pending->Signal = AcquireSemaphore();
+	}
+	pending->Submitted = &submitted;
+	VkSemaphore semaphore = pending->Signal;
+	Push(pending);
+	while (!submitted.load()) {
+		Drain();
+		std::this_thread::yield();
+	}
+	return semaphore;
+}
+
+bool HA::CommandThread::Owns(CommandTicket ticket) const
+{
+	return ticket >= FirstTicket && ticket < NextTicket.load();
+}
+
+bool HA::CommandThread::Owns(VkCommandBuffer cmd)
+{
+	std::lock_guard<std::mutex> guard(Lock);
+	return FindSlot(cmd) >= 0;
+}
+
+VkSemaphore HA::CommandThread::AcquireSemaphore()
+{
+	if (FreeSemaphores.size() > 0) {
+		VkSemaphore semaphore = FreeSemaphores.back();
+		FreeSemaphores.pop_back();
+		return semaphore;
+	}
+	VkSemaphoreCreateInfo createInfo{ VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO };
+	VkSemaphore semaphore;
+	vkCreateSemaphore(Device, &createInfo, AllocationCallbacks, &semaphore);
+	Semaphores.push_back(semaphore);
+	return semaphore;
+}
+
+void HA::CommandThread::ReleaseSemaphore(VkSemaphore semaphore)
+{
+	std::lock_guard<std::mutex> guard(SignalLock);
+	FreeSemaphores.push_back(semaphore);
+}
+
+HA::CommandThread::Recorder* HA::CommandThread::GetRecorder()
+{
+	thread_local std::vector<std::pair<uint64_t, Recorder*>> recorders;
+	for (auto& [id, recorder] : recorders) {
+		if (id == Id)
+			return recorder;
+	}
+
+	Recorder* recorder = new Recorder();
+	VkCommandPoolCreateInfo createInfo{ VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO };
+	createInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+	createInfo.queueFamilyIndex = QueueFamilyIndex;
+	vkCreateCommandPool(Device, &createInfo, AllocationCallbacks, &recorder->Pool);
+	vkCreateCommandPool(Device, &createInfo, AllocationCallbacks, &recorder->SharedPool);
+	recorder->SharedSlot = -1;
+	{
+		std::lock_guard<std::mutex> guard(Lock);
+		Recorders.push_back(recorder);
+	}
+	recorders.push_back({ Id, recorder });
+	return recorder;
+}
+
+uint32_t HA::CommandThread::AcquireSlot(Recorder* recorder, bool shared, VkCommandBuffer& cmd, CommandTicket& ticket, PostFunctionList& postFunctions)
+{
+	std::unique_lock<std::mutex> lock(Lock);
+	int32_t slot = -1;
+	while (slot < 0) {
+		for (uint32_t i = 0; i < Ring.size() && slot < 0; i++) {
+			uint32_t index = (RingHead + i) % Ring.size();
+			if (Ring[index].State == SlotState::Free && Ring[index].Waiters == 0)
+				slot = index;
+		}
+		// Reuse whatever has already finished before blocking on the oldest submission.
+		for (uint32_t i = 0; i < Ring.size() && slot < 0; i++) {
+			if (Ring[i].State == SlotState::InFlight && vkGetFenceStatus(Device, Ring[i].Fence) == VK_SUCCESS) {
+				Retire(i, postFunctions);
+				if (Ring[i].Waiters == 0)
+					slot = i;
+			}
+		}
+		if (slot >= 0)
+			break;
+		int32_t oldest = -1;
+		for (uint32_t i = 0; i < Ring.size(); i++) {
+			if (Ring[i].State == SlotState::InFlight && (oldest < 0 || Ring[i].Ticket < Ring[oldest].Ticket))
+				oldest = i;
+		}
+		// Every slot is being recorded, grow the ring.
+		if (oldest < 0) {
+			Submission submission{};
+			VkFenceCreateInfo fenceInfo{ VK_STRUCTURE_TYPE_FENCE_CREATE_INFO };
+			vkCreateFence(Device, &fenceInfo, AllocationCallbacks, &submission.Fence);
+			submission.State = SlotState::Free;
+			Ring.push_back(submission);
+			slot = (int32_t)Ring.size() - 1;
+			break;
+		}
+		// Another thread may take the slot meanwhile, then look again
+		WaitSlot(lock, oldest, postFunctions);
+	}
+
+	auto& submission = Ring[slot];
+	submission.State = SlotState::Recording;
+	submission.Ticket = NextTicket++;
+	submission.Owner = recorder;
+	submission.Shared = shared;
+	if (submission.FenceUsed)
+		vkResetFences(Device, 1, &submission.Fence);
+	submission.FenceUsed = false;
+	RingHead = (slot + 1) % Ring.size();
+
+	// The pool is only used by the recording thread, or under SharedLock for shared command buffers
+	auto& freeCmds = shared ? recorder->FreeSharedCmds : recorder->FreeCmds;
+	if (freeCmds.size() > 0) {
+		submission.Cmd = freeCmds.back();
+		freeCmds.pop_back();
+	}
+	else {
+		VkCommandBufferAllocateInfo allocInfo{ VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO };
+		allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+		allocInfo.commandPool = shared ? recorder->SharedPool : recorder->Pool;
+		allocInfo.commandBufferCount = 1;
+		vkAllocateCommandBuffers(Device, &allocInfo, &submission.Cmd);
+	}
+	cmd = submission.Cmd;
+	ticket = submission.Ticket;
+	lock.unlock();
+
+	vkResetCommandBuffer(cmd, 0);
 	VkCommandBufferBeginInfo beginInfo{ VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO };
 	beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+	// Submissions may overlap on the device, every command records the barriers
+	// against earlier ones it needs through BarrierBatch.
 	vkBeginCommandBuffer(cmd, &beginInfo);
-	return cmd;
+	return (uint32_t)slot;
 }
 
-void HA::CommandThread::Execute()
+int32_t HA::CommandThread::FindSlot(VkCommandBuffer cmd)
 {
-	Execute(SharedCmd, Fence, false);
-	for (const auto& postExec : PostFunctions)
-		postExec();
+	for (uint32_t i = 0; i < Ring.size(); i++) {
+		if (Ring[i].State != SlotState::Free && Ring[i].Cmd == cmd)
+			return i;
 	}
+	return -1;
+}
 
-void HA::CommandThread::Execute(VkCommandBuffer cmd, VkFence fence, bool FreeCmd)
+int32_t HA::CommandThread::FindSlot(CommandTicket ticket)
 {
-	vkEndCommandBuffer(cmd);
-	VkSubmitInfo submitInfo{ VK_STRUCTURE_TYPE_SUBMIT_INFO };
-	submitInfo.commandBufferCount = 1;
-	submitInfo.pCommandBuffers = &cmd;
-	vkQueueSubmit(Queue, 1, &submitInfo, fence);
-	vkWaitForFences(Device, 1, &fence, true, UINT64_MAX);
-	if (FreeCmd)
-		vkFreeCommandBuffers(Device, Pool, 1, &cmd);
-	else {
-		vkResetCommandBuffer(SharedCmd, VK_COMMAND_BUFFER_RESET_RELEASE_RESOURCES_BIT);
-		VkCommandBufferBeginInfo beginInfo{VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO};
-		beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
-		vkBeginCommandBuffer(cmd, &beginInfo);
+	if (ticket == 0)
+		return -1;
+	for (uint32_t i = 0; i < Ring.size(); i++) {
+		if (Ring[i].State != SlotState::Free && Ring[i].Ticket == ticket)
+			return i;
 	}
+	return -1;
+}
 
+void HA::CommandThread::Retire(uint32_t slot, PostFunctionList& postFunctions)
+{
+	// Post functions may submit more work, they are run by the caller once it let go of the lock.
+	auto& submission = Ring[slot];
+	for (auto& postExec : submission.PostFunctions)
+		postFunctions.push_back(std::move(postExec));
+	submission.PostFunctions.clear();
+	if (submission.Cmd)
+		(submission.Shared ? submission.Owner->FreeSharedCmds : submission.Owner->FreeCmds).push_back(submission.Cmd);
+	if (submission.State == SlotState::InFlight)
+		submission.FenceUsed = true;
+	submission.Cmd = VK_NULL_HANDLE;
+	submission.Owner = nullptr;
+	submission.State = SlotState::Free;
+	submission.Ticket = 0;
 }
 
-void HA::CommandThread::AddPostExectute(std::function<void()>& postExec)
+void HA::CommandThread::Run(PostFunctionList& postFunctions)
 {
-	PostFunctions.push_back(postExec);
+	for (const auto& postExec : postFunctions)
+		postExec();
+	postFunctions.clear();
 }
@@ -1,36 +1,277 @@
 #pragma once
 #include <vulkan/vulkan_core.h>
+#include <atomic>
 #include <functional>
+#include <mutex>
 #include <vector>
+#include <cstdint>
 
 namespace HA {
 
+	/// <summary>
+	/// Identifies a submission made through a CommandThread.
+	/// Tickets are never reused, 0 means "no submission" and is always complete.
+	/// </summary>
+	typedef uint64_t CommandTicket;
+
+	/// <summary>
+	/// Records and submits the command buffers of one queue, from any number of threads.
+	/// Every thread records into command buffers of its own pools, created on first use.
+	/// Submissions are pushed onto a lock free list that whichever thread currently holds
+	/// the queue drains, so no thread blocks on another thread's vkQueueSubmit.
+	/// A command buffer from GenCmd() must be recorded and submitted by the thread that created it.
+	/// </summary>
 	class CommandThread {
+		struct Recorder;
+
 	public:
-		CommandThread(VkDevice device, VkQueue queue, uint32_t queueFamilyIndex, VkAllocationCallbacks* Callbacks);
+		/// <summary>
+		/// Holds the calling thread's shared command buffer while it is recorded, so no other
+		/// thread submits it meanwhile. Recording into it must stay on the thread.
+		/// </summary>
+		class Batch {
+		public:
+			Batch(CommandThread* thread);
+			~Batch();
+			Batch(const Batch& copy) = delete;
+			Batch(const Batch&& move) = delete;
+
+			VkCommandBuffer Cmd;
+			/// <summary>
+			/// Completes once the shared command buffer has executed.
+			/// </summary>
+			CommandTicket Ticket;
+
+		private:
+			Recorder* Owner;
+			std::vector<std::function<void()>> PostFunctions;
+		};
+
+		/// <summary>
+		/// FirstTicket keeps the tickets of several threads apart, the transfer thread starts at 2^63.
+		/// </summary>
+		CommandThread(VkDevice device, VkQueue queue, uint32_t queueFamilyIndex, VkAllocationCallbacks* Callbacks, uint32_t InFlightCount = 8,
+			CommandTicket FirstTicket = 1);
 		~CommandThread();
 		CommandThread(const CommandThread& copy) = delete;
 		CommandThread(const CommandThread&& move) = delete;
 
-		VkFence GenFence();
-		void ReleaseFence(VkFence fence);
-
-		VkCommandBuffer GetCmd();
+		/// <summary>
+		/// Begins recording into a free slot of the submission ring.
+		/// If every slot is in flight the oldest submission is waited on first.
+		/// </summary>
 		VkCommandBuffer GenCmd();
 
+		/// <summary>
+		/// Ticket that will complete once cmd (from GetCmd() or GenCmd()) has executed.
+		/// </summary>
+		CommandTicket GetTicket(VkCommandBuffer cmd);
+
+		/// <summary>
+		/// Submits the shared command buffers of all threads without waiting.
+		/// Returns the ticket of the last one, 0 if nothing was recorded.
+		/// </summary>
+		CommandTicket Submit();
+
+		/// <summary>
+		/// Submits only the calling thread's shared command buffer without waiting.
+		/// Returns its ticket, 0 if the thread recorded nothing.
+		/// </summary>
+		CommandTicket SubmitCurrent();
+
+		/// <summary>
+		/// Submits a command buffer from GenCmd() without waiting.
+		/// Anything the calling thread recorded into its shared command buffer is submitted first to preserve ordering.
+		/// </summary>
+		CommandTicket Submit(VkCommandBuffer cmd);
+
+		/// <summary>
+		/// Returns true if the submission has completed, post execute functions are run when it has.
+		/// </summary>
+		bool Poll(CommandTicket ticket);
+
+		/// <summary>
+		/// Runs the post execute functions of every submission that has completed, without blocking.
+		/// Includes the partner's submissions.
+		/// </summary>
+		void PollAll();
+
+		/// <summary>
+		/// Blocks until the submission has completed and runs its post execute functions.
+		/// </summary>
+		void Wait(CommandTicket ticket);
+
+		/// <summary>
+		/// Submits the shared command buffer of another thread if ticket belongs to it, so work the
+		/// calling thread submits afterwards is ordered after it. The calling thread's own shared
+		/// command buffer is left open, it is submitted ahead of the thread's next submission anyway.
+		/// </summary>
+		void Flush(CommandTicket ticket);
+
+		/// <summary>
+		/// Waits for every in flight submission, including the partner's.
+		/// </summary>
+		void WaitIdle();
+
+		/// <summary>
+		/// Submits the shared command buffers of all threads and waits for them.
+		/// </summary>
 		void Execute();
-		void Execute(VkCommandBuffer cmd, VkFence fence, bool FreeCmd);
+		void Execute(VkCommandBuffer cmd);
 
+		/// <summary>
+		/// Runs postExec once the calling thread's shared command buffer has executed.
+		/// </summary>
 		void AddPostExectute(std::function<void()>& postExec);
 
+		/// <summary>
+		/// Runs postExec once cmd has executed.
+		/// </summary>
+		void AddPostExectute(VkCommandBuffer cmd, const std::function<void()>& postExec);
+
+		/// <summary>
+		/// Links the thread of a second queue. Tickets and command buffers of the partner are
+		/// forwarded to it, PollAll() and WaitIdle() cover both threads.
+		/// If followPartner is set, every submission first submits the partner's shared command
+		/// buffer and waits on a semaphore for everything the partner submitted before it.
+		/// Threads on the same queue serialize their vkQueueSubmit calls.
+		/// </summary>
+		void SetPartner(CommandThread* partner, bool followPartner);
+
+		/// <summary>
+		/// The calling thread's next submission waits on a semaphore for everything submitted to other so far,
+		/// other's shared command buffer is submitted first.
+		/// </summary>
+		void WaitFor(CommandThread* other);
+
+		/// <summary>
+		/// True if ticket or cmd was handed out by this thread, not by its partner.
+		/// </summary>
+		bool Owns(CommandTicket ticket) const;
+		bool Owns(VkCommandBuffer cmd);
+
+	private:
+		enum class SlotState {
+			Free,
+			Recording,
+			InFlight
+		};
+
+		struct Submission {
+			VkCommandBuffer Cmd;
+			Recorder* Owner;
+			bool Shared;
+			VkFence Fence;
+			bool FenceUsed;
+			SlotState State;
+			CommandTicket Ticket;
+			/// <summary>
+			/// Threads blocked on the fence, the slot is not reused until they leave.
+			/// </summary>
+			uint32_t Waiters;
+			std::vector<std::function<void()>> PostFunctions;
+		};
+
+		struct SemaphoreWait {
+			VkSemaphore Semaphore;
+			CommandThread* Signaler;
+		};
+
+		/// <summary>
+		/// Command pools of one thread. Pool is only touched by its thread, SharedPool only under SharedLock.
+		/// </summary>
+		struct Recorder {
+			VkCommandPool Pool;
+			VkCommandPool SharedPool;
+			std::recursive_mutex SharedLock;
+			int32_t SharedSlot;
+			/// <summary>
+			/// Retired command buffers, guarded by the ring lock.
+			/// </summary>
+			std::vector<VkCommandBuffer> FreeCmds;
+			std::vector<VkCommandBuffer> FreeSharedCmds;
+			/// <summary>
+			/// Semaphores the thread's next submission waits on, guarded by WaitLock.
+			/// </summary>
+			std::vector<SemaphoreWait> Waits;
+		};
+
+		/// <summary>
+		/// Entry of the lock free list of submissions that were not handed to the queue yet.
+		/// </summary>
+		struct PendingSubmit {
+			VkCommandBuffer Cmd;
+			VkFence Fence;
+			uint32_t Slot;
+			VkSemaphore Signal;
+			/// <summary>
+			/// Taken when the submission is created, so they stay with it whichever thread drains it.
+			/// </summary>
+			std::vector<SemaphoreWait> Waits;
+			std::atomic<bool>* Submitted;
+			PendingSubmit* Next;
+		};
+
+		typedef std::vector<std::function<void()>> PostFunctionList;
+
+		Recorder* GetRecorder();
+		uint32_t AcquireSlot(Recorder* recorder, bool shared, VkCommandBuffer& cmd, CommandTicket& ticket, PostFunctionList& postFunctions);
+		CommandTicket SubmitShared(Recorder* recorder);
+		void SubmitShared(std::vector<CommandTicket>& tickets);
+		CommandTicket SubmitSlot(uint32_t slot);
+		void Push(PendingSubmit* pending);
+		void Drain();
+		VkSemaphore Signal();
+		void WaitSlot(std::unique_lock<std::mutex>& lock, uint32_t slot, PostFunctionList& postFunctions);
+		void WaitRing();
+		void PollRing();
+		VkSemaphore AcquireSemaphore();
+		void ReleaseSemaphore(VkSemaphore semaphore);
+		int32_t FindSlot(VkCommandBuffer cmd);
+		int32_t FindSlot(CommandTicket ticket);
+		void Retire(uint32_t slot, PostFunctionList& postFunctions);
+		static void Run(PostFunctionList& postFunctions);
+
 	private:
+		/// <summary>
+		/// Tells this thread apart in the per thread recorder caches.
+		/// </summary>
+		const uint64_t Id;
 		VkDevice Device;
 		VkQueue Queue;
+		uint32_t QueueFamilyIndex;
 		VkAllocationCallbacks* AllocationCallbacks;
-		VkCommandPool Pool;
-		VkCommandBuffer SharedCmd;
-		VkFence Fence;
-		std::vector<std::function<void()>> PostFunctions;
+		/// <summary>
+		/// Guards the ring, the tickets and the recorder list.
+		/// </summary>
+		std::mutex Lock;
+		std::vector<Submission> Ring;
+		std::vector<Recorder*> Recorders;
+		uint32_t RingHead;
+		const CommandTicket FirstTicket;
+		std::atomic<CommandTicket> NextTicket;
+		std::atomic<PendingSubmit*> Pending;
+		/// <summary>
+		/// Set by the thread that currently drains Pending into the queue.
+		/// </summary>
+		std::atomic<bool> Draining;
+		/// <summary>
+		/// Held around vkQueueSubmit. Points to the partner's lock when both share the queue.
+		/// </summary>
+		std::mutex SubmitLock;
+		std::mutex* QueueLock;
+		CommandThread* Partner;
+		bool FollowPartner;
+		/// <summary>
+		/// Guards FreeSemaphores and Semaphores.
+		/// </summary>
+		std::mutex SignalLock;
+		/// <summary>
+		/// Guards the Waits of every recorder. Waited semaphores are handed back to their signaler once the submission executed.
+		/// </summary>
+		std::mutex WaitLock;
+		std::vector<VkSemaphore> FreeSemaphores;
+		std::vector<VkSemaphore> Semaphores;
 	};
 
-}
\ No newline at end of file
+}
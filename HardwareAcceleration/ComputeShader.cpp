@@ -1,16 +1,51 @@
 #define _CRT_SECURE_NO_WARNINGS
 #include "ComputeShader.hpp"
+#include "AccelerationEngine.hpp"
+#include "DescriptorAllocator.hpp"
+#include "ImplementationContext.hpp"
+#include "ImplementionManagedTypes.hpp"
+#include "Profiler.hpp"
+#include "ResourceTracker.hpp"
+#include "ShaderCache.hpp"
+#include "ShaderReflection.hpp"
 #include <stdio.h>
+#include <cstring>
 #include <stdexcept>
+#include <string>
 #include <vulkan/vulkan_core.h>
 #include <shaderc/shaderc.hpp>
 
+static uint64_t GetBindingKey(uint32_t set, uint32_t binding)
+{
+	return ((uint64_t)set << 32) | binding;
+}
+
+// Storage bindings are taken as written, the reflection does not know NonWritable
+static VkAccessFlags GetAccess(VkDescriptorType type)
+{
+	switch (type) {
+	case VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER:
+	case VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC:
+		return VK_ACCESS_UNIFORM_READ_BIT;
+	case VK_DESCRIPTOR_TYPE_STORAGE_BUFFER:
+	case VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC:
+	case VK_DESCRIPTOR_TYPE_STORAGE_IMAGE:
+		return VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+	default:
+		return VK_ACCESS_SHADER_READ_BIT;
+	}
+}
+
 HA::ComputeShader::ComputeShader(AccelerationEngine* engine, void* sourceCode, uint32_t length)
+	: ComputeModule(nullptr), Context(engine->ImplementationContext), Reflection(nullptr), Sampler(VK_NULL_HANDLE),
+	PipelineLayout(VK_NULL_HANDLE), Pipeline(VK_NULL_HANDLE), LastSubmission(0)
 {
 	this->Load(engine, sourceCode, length);
 }
 
 HA::ComputeShader::ComputeShader(AccelerationEngine* engine, const char* path)
+	: ComputeModule(nullptr), Context(engine->ImplementationContext), Reflection(nullptr), Sampler(VK_NULL_HANDLE),
+	PipelineLayout(VK_NULL_HANDLE), Pipeline(VK_NULL_HANDLE), LastSubmission(0)
 {
 	FILE* io = fopen(path, "r");
 	if (!io)
@@ -20,20 +55,410 @@ HA::ComputeShader::ComputeShader(AccelerationEngine* engine, const char* path)
 	fseek(io, 0, SEEK_SET);
 	char* buffer = new char[length];
 	length = (uint32_t)fread(buffer, 1, length, io);
-	this->Load(engine, buffer, length);
+	fclose(io);
+	try {
+		this->Load(engine, buffer, length);
+	}
+	catch (...) {
+		delete[] buffer;
+		throw;
+	}
 	delete[] buffer;
 }
 
 HA::ComputeShader::~ComputeShader()
 {
+	if (LastSubmission)
+		Context->_CommandThread->Wait(LastSubmission);
+	Release();
+}
+
+void HA::ComputeShader::Release()
+{
+	for (auto& [key, pipeline] : Variants)
+		vkDestroyPipeline(Context->Device, pipeline, Context->AllocationCallbacks);
+	if (PipelineLayout)
+		vkDestroyPipelineLayout(Context->Device, PipelineLayout, Context->AllocationCallbacks);
+	for (auto layout : SetLayouts) {
+		if (!layout)
+			continue;
+		Context->_DescriptorAllocator->Invalidate((uint64_t)layout);
+		vkDestroyDescriptorSetLayout(Context->Device, layout, Context->AllocationCallbacks);
+	}
+	if (Sampler)
+		vkDestroySampler(Context->Device, Sampler, Context->AllocationCallbacks);
+	if (ComputeModule)
+		vkDestroyShaderModule(Context->Device, (VkShaderModule)ComputeModule, Context->AllocationCallbacks);
+	delete Reflection;
+}
+
+void HA::ComputeShader::SetBuffer(uint32_t binding, GPBuffer* buffer)
+{
+	auto& resource = GetBufferBinding(0, binding, nullptr);
+	resource.Buffer = buffer;
+	resource.Offset = 0;
+	resource.Range = VK_WHOLE_SIZE;
+}
+
+void HA::ComputeShader::SetBuffer(uint32_t binding, const GPArenaAllocation& allocation)
+{
+	auto& resource = GetBufferBinding(0, binding, nullptr);
+	resource.Buffer = allocation.Buffer;
+	resource.Offset = allocation.Offset;
+	resource.Range = allocation.Size;
+}
+
+void HA::ComputeShader::SetImage(uint32_t binding, GPImage* image)
+{
+	auto& resource = GetBinding(0, binding, nullptr);
+	if (resource.Type != VK_DESCRIPTOR_TYPE_STORAGE_IMAGE && resource.Type != VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE &&
+		resource.Type != VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER)
+		throw std::runtime_error("HA::ComputeShader Binding " + std::to_string(binding) + " is not an image.");
+	resource.Image = image;
+}
+
+void HA::ComputeShader::Bind(const char* name, GPBuffer* buffer)
+{
+	auto& resource = GetBufferBinding(name);
+	resource.Buffer = buffer;
+	resource.Offset = 0;
+	resource.Range = VK_WHOLE_SIZE;
+}
+
+void HA::ComputeShader::Bind(const char* name, const GPArenaAllocation& allocation)
+{
+	auto& resource = GetBufferBinding(name);
+	resource.Buffer = allocation.Buffer;
+	resource.Offset = allocation.Offset;
+	resource.Range = allocation.Size;
+}
+
+void HA::ComputeShader::Bind(const char* name, GPImage* image)
+{
+	auto reflected = Reflection->Find(name);
+	if (!reflected)
+		throw std::runtime_error(std::string("HA::ComputeShader The shader has no binding named '") + name + "'.");
+	auto& resource = GetBinding(reflected->Set, reflected->Binding, name);
+	if (resource.Type != VK_DESCRIPTOR_TYPE_STORAGE_IMAGE && resource.Type != VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE &&
+		resource.Type != VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER)
+		throw std::runtime_error(std::string("HA::ComputeShader Binding '") + name + "' is not an image.");
+	resource.Image = image;
+}
+
+void HA::ComputeShader::SetPushConstants(const void* data, uint32_t size)
+{
+	if (size > Reflection->PushConstantSize)
+		throw std::runtime_error("HA::ComputeShader Push constants are larger than the push constant block of the shader.");
+	PushConstants.assign(Reflection->PushConstantSize, 0);
+	memcpy(PushConstants.data(), data, size);
+}
+
+void HA::ComputeShader::Specialize(const std::vector<SpecializationConstant>& constants)
+{
+	std::map<uint32_t, uint32_t> values;
+	for (auto& constant : constants) {
+		const ReflectedConstant* reflected = nullptr;
+		for (auto& candidate : Reflection->SpecializationConstants) {
+			if (candidate.Id == constant.Id)
+				reflected = &candidate;
+		}
+		if (!reflected)
+			throw std::runtime_error("HA::ComputeShader The shader has no specialization constant " + std::to_string(constant.Id) + ".");
+		if (reflected->Size != sizeof(uint32_t))
+			throw std::runtime_error("HA::ComputeShader Specialization constant " + std::to_string(constant.Id) + " is not 32 bit.");
+		if (constant.Value != reflected->DefaultValue)
+			values[constant.Id] = constant.Value;
+		else
+			values.erase(constant.Id);
+	}
+	Constants.assign(values.begin(), values.end());
+	auto variant = Variants.find(Constants);
+	Pipeline = variant != Variants.end() ? variant->second : VK_NULL_HANDLE;
+
+	for (int i = 0; i < 3; i++) {
+		int32_t id = Reflection->WorkgroupSizeSpecIds[i];
+		WorkgroupSize[i] = id >= 0 && values.count(id) ? values[id] : Reflection->WorkgroupSize[i];
+	}
+}
+
+void HA::ComputeShader::Dispatch(uint32_t x, uint32_t y, uint32_t z)
+{
+	Prepare();
+	// Writes to the bound resources that another thread still records are submitted first
+	for (auto& [key, resource] : Bindings)
+		Context->_CommandThread->Flush(resource.Buffer ? resource.Buffer->LastSubmission : resource.Image->LastSubmission);
+	CommandThread::Batch batch(Context->_CommandThread);
+	auto cmd = batch.Cmd;
+	uint32_t scope = Context->_Profiler->Begin(cmd, "ComputeShader::Dispatch");
+
+	// Each resource is accessed once with the union of its bindings, only what an earlier
+	// command wrote or still reads gets a barrier.
+	auto layouts = GetImageLayouts();
+	std::map<GPBuffer*, VkAccessFlags> bufferAccess;
+	std::map<GPImage*, VkAccessFlags> imageAccess;
+	for (auto& [key, resource] : Bindings) {
+		VkAccessFlags access = GetAccess(resource.Type);
+		if (resource.Buffer)
+			bufferAccess[resource.Buffer] |= access;
+		else
+			imageAccess[resource.Image] |= access;
+	}
+	BarrierBatch barriers(Context, cmd);
+	for (auto& [buffer, access] : bufferAccess)
+		barriers.Access(buffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, access);
+	for (auto& [image, access] : imageAccess)
+		barriers.Access(image, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, access, layouts[image]);
+	barriers.Record();
+
+	Record(cmd, batch.Ticket, layouts, x, y, z);
+
+	// Host visible buffers are read by the host after Wait(), device reads get their barrier when recorded
+	for (auto& [buffer, access] : bufferAccess) {
+		if ((access & VK_ACCESS_SHADER_WRITE_BIT) && buffer->MemoryType != GPGPUMemoryType::Static)
+			barriers.Access(buffer, VK_PIPELINE_STAGE_HOST_BIT, VK_ACCESS_HOST_READ_BIT);
+	}
+	barriers.Record();
+	Context->_Profiler->End(cmd, scope);
+}
+
+void HA::ComputeShader::Prepare()
+{
+	for (auto& [key, resource] : Bindings) {
+		if (!resource.Buffer && !resource.Image)
+			throw std::runtime_error("HA::ComputeShader Set " + std::to_string(resource.Set) + " binding " +
+				std::to_string(resource.Binding) + " is not bound.");
+	}
+	if (!Pipeline)
+		CreatePipeline();
+}
+
+std::map<HA::GPImage*, VkImageLayout> HA::ComputeShader::GetImageLayouts() const
+{
+	// Images written by the shader need GENERAL, the rest can be read only.
+	std::map<GPImage*, VkImageLayout> layouts;
+	for (auto& [key, resource] : Bindings) {
+		if (!resource.Image)
+			continue;
+		if (resource.Type == VK_DESCRIPTOR_TYPE_STORAGE_IMAGE)
+			layouts[resource.Image] = VK_IMAGE_LAYOUT_GENERAL;
+		else if (layouts.count(resource.Image) == 0)
+			layouts[resource.Image] = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+	}
+	return layouts;
+}
+
+void HA::ComputeShader::Record(VkCommandBuffer cmd, CommandTicket ticket, const std::map<GPImage*, VkImageLayout>& layouts,
+	uint32_t x, uint32_t y, uint32_t z)
+{
+	// Sets are cached by the bound resources, a repeated dispatch reuses the same set.
+	LastSubmission = ticket;
+	std::vector<std::vector<DescriptorResource>> resources(SetLayouts.size());
+	for (auto& [key, resource] : Bindings) {
+		DescriptorResource descriptor{};
+		descriptor.Binding = resource.Binding;
+		descriptor.Type = resource.Type;
+		if (resource.Buffer)
+			descriptor.Buffer = { resource.Buffer->Buffer->Buffer, resource.Offset, resource.Range };
+		else
+			descriptor.Image = { Sampler, resource.Image->Image->View, layouts.at(resource.Image) };
+		resources[resource.Set].push_back(descriptor);
+	}
+	std::vector<VkDescriptorSet> sets(SetLayouts.size());
+	for (size_t set = 0; set < SetLayouts.size(); set++)
+		sets[set] = Context->_DescriptorAllocator->Acquire(SetLayouts[set], resources[set], LastSubmission);
+
+	vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, Pipeline);
+	if (sets.size())
+		vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, PipelineLayout, 0, (uint32_t)sets.size(), sets.data(), 0, nullptr);
+	if (Reflection->PushConstantSize) {
+		PushConstants.resize(Reflection->PushConstantSize, 0);
+		vkCmdPushConstants(cmd, PipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, Reflection->PushConstantSize, PushConstants.data());
+	}
+	vkCmdDispatch(cmd, x, y, z);
+
+	for (auto& [key, resource] : Bindings) {
+		if (resource.Buffer)
+			resource.Buffer->LastSubmission = LastSubmission;
+		else
+			resource.Image->LastSubmission = LastSubmission;
+	}
+}
+
+void HA::ComputeShader::DispatchInvocations(uint32_t x, uint32_t y, uint32_t z)
+{
+	auto size = WorkgroupSize;
+	Dispatch((x + size[0] - 1) / size[0], (y + size[1] - 1) / size[1], (z + size[2] - 1) / size[2]);
+}
+
+void HA::ComputeShader::GetWorkgroupSize(uint32_t size[3]) const
+{
+	memcpy(size, WorkgroupSize, sizeof(WorkgroupSize));
 }
 
 void HA::ComputeShader::Load(AccelerationEngine* engine, void* sourceCode, uint32_t length)
 {
-	// 1) Compile Shader
-	shaderc::Compiler comp;
-	comp.CompileGlslToSpv((char*)sourceCode, length, shaderc_shader_kind::shaderc_compute_shader, "main.comp");
+	// 1) Compile Shader, unless an earlier run already did
+	std::vector<uint32_t> spirv;
+	if (!Context->_ShaderCache->LoadSpirv(sourceCode, length, spirv)) {
+		shaderc::Compiler comp;
+		shaderc::CompileOptions options;
+		options.SetOptimizationLevel(shaderc_optimization_level_performance);
+		auto result = comp.CompileGlslToSpv((char*)sourceCode, length, shaderc_shader_kind::shaderc_compute_shader, "main.comp", options);
+		if (result.GetCompilationStatus() != shaderc_compilation_status_success) {
+			std::string message = "HA::ComputeShader Could not compile shader.\n" + result.GetErrorMessage();
+			if (Context->Logger)
+				Context->Logger->Print(message.c_str(), true, "red");
+			throw std::runtime_error(message);
+		}
+		spirv.assign(result.cbegin(), result.cend());
+		Context->_ShaderCache->StoreSpirv(sourceCode, length, spirv);
+	}
+	// The destructor does not run if the constructor throws, whatever was created is released here
+	try {
+		Reflection = new ShaderReflection(spirv.data(), spirv.size());
+		memcpy(WorkgroupSize, Reflection->WorkgroupSize, sizeof(WorkgroupSize));
 
-	// 2) Create Shader Module
-	//VkShaderModuleCreateInfo createInfo;
+		// 2) Create Shader Module
+		VkShaderModuleCreateInfo createInfo{ VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO };
+		createInfo.codeSize = spirv.size() * sizeof(uint32_t);
+		createInfo.pCode = spirv.data();
+		VkShaderModule module;
+		VkResult vkResult = vkCreateShaderModule(Context->Device, &createInfo, Context->AllocationCallbacks, &module);
+		if (vkResult != VK_SUCCESS)
+			throw std::runtime_error("HA::ComputeShader Could not create shader module. " + GetStringFromResult(vkResult));
+		ComputeModule = module;
+
+		CreateLayouts();
+	}
+	catch (...) {
+		Release();
+		throw;
+	}
+}
+
+void HA::ComputeShader::CreateLayouts()
+{
+	// 3) Descriptor set layouts and pipeline layout from the reflected bindings
+	uint32_t setCount = 0;
+	bool needsSampler = false;
+	for (auto& reflected : Reflection->Bindings) {
+		if (reflected.Set + 1 > setCount)
+			setCount = reflected.Set + 1;
+		needsSampler |= reflected.Type == VK_DESCRIPTOR_TYPE_SAMPLER || reflected.Type == VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+	}
+	VkResult result;
+	if (needsSampler) {
+		VkSamplerCreateInfo samplerInfo{ VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO };
+		samplerInfo.magFilter = VK_FILTER_LINEAR;
+		samplerInfo.minFilter = VK_FILTER_LINEAR;
+		samplerInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_LINEAR;
+		samplerInfo.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+		samplerInfo.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+		samplerInfo.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+		samplerInfo.maxLod = VK_LOD_CLAMP_NONE;
+		result = vkCreateSampler(Context->Device, &samplerInfo, Context->AllocationCallbacks, &Sampler);
+		if (result != VK_SUCCESS)
+			throw std::runtime_error("HA::ComputeShader Could not create sampler. " + GetStringFromResult(result));
+	}
+
+	std::vector<std::vector<VkDescriptorSetLayoutBinding>> layoutBindings(setCount);
+	std::vector<std::vector<VkSampler>> immutableSamplers;
+	immutableSamplers.reserve(Reflection->Bindings.size());
+	for (auto& reflected : Reflection->Bindings) {
+		VkDescriptorSetLayoutBinding layoutBinding{};
+		layoutBinding.binding = reflected.Binding;
+		layoutBinding.descriptorType = reflected.Type;
+		layoutBinding.descriptorCount = reflected.Count;
+		layoutBinding.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+		if (reflected.Type == VK_DESCRIPTOR_TYPE_SAMPLER || reflected.Type == VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER) {
+			immutableSamplers.emplace_back(reflected.Count, Sampler);
+			layoutBinding.pImmutableSamplers = immutableSamplers.back().data();
+		}
+		layoutBindings[reflected.Set].push_back(layoutBinding);
+
+		// Immutable samplers have nothing to bind
+		if (reflected.Type != VK_DESCRIPTOR_TYPE_SAMPLER)
+			Bindings[GetBindingKey(reflected.Set, reflected.Binding)] = { reflected.Type, reflected.Set, reflected.Binding, nullptr, nullptr, 0, VK_WHOLE_SIZE };
+	}
+
+	SetLayouts.resize(setCount, VK_NULL_HANDLE);
+	for (uint32_t set = 0; set < setCount; set++) {
+		VkDescriptorSetLayoutCreateInfo setLayoutInfo{ VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO };
+		setLayoutInfo.bindingCount = (uint32_t)layoutBindings[set].size();
+		setLayoutInfo.pBindings = layoutBindings[set].data();
+		result = vkCreateDescriptorSetLayout(Context->Device, &setLayoutInfo, Context->AllocationCallbacks, &SetLayouts[set]);
+		if (result != VK_SUCCESS)
+			throw std::runtime_error("HA::ComputeShader Could not create descriptor set layout. " + GetStringFromResult(result));
+	}
+
+	VkPushConstantRange range{};
+	range.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+	range.offset = 0;
+	range.size = Reflection->PushConstantSize;
+	VkPipelineLayoutCreateInfo pipelineLayoutInfo{ VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO };
+	pipelineLayoutInfo.setLayoutCount = (uint32_t)SetLayouts.size();
+	pipelineLayoutInfo.pSetLayouts = SetLayouts.data();
+	pipelineLayoutInfo.pushConstantRangeCount = range.size ? 1 : 0;
+	pipelineLayoutInfo.pPushConstantRanges = &range;
+	result = vkCreatePipelineLayout(Context->Device, &pipelineLayoutInfo, Context->AllocationCallbacks, &PipelineLayout);
+	if (result != VK_SUCCESS)
+		throw std::runtime_error("HA::ComputeShader Could not create pipeline layout. " + GetStringFromResult(result));
+}
+
+void HA::ComputeShader::CreatePipeline()
+{
+	// 4) Compute pipeline for the current variant
+	std::vector<VkSpecializationMapEntry> entries;
+	std::vector<uint32_t> data;
+	for (auto& [id, value] : Constants) {
+		entries.push_back({ id, (uint32_t)(data.size() * sizeof(uint32_t)), sizeof(uint32_t) });
+		data.push_back(value);
+	}
+	VkSpecializationInfo specialization{};
+	specialization.mapEntryCount = (uint32_t)entries.size();
+	specialization.pMapEntries = entries.data();
+	specialization.dataSize = data.size() * sizeof(uint32_t);
+	specialization.pData = data.data();
+
+	VkComputePipelineCreateInfo createInfo{ VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO };
+	createInfo.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+	createInfo.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+	createInfo.stage.module = (VkShaderModule)ComputeModule;
+	createInfo.stage.pName = "main";
+	createInfo.stage.pSpecializationInfo = entries.size() ? &specialization : nullptr;
+	createInfo.layout = PipelineLayout;
+	VkResult result = vkCreateComputePipelines(Context->Device, Context->_ShaderCache->PipelineCache, 1, &createInfo, Context->AllocationCallbacks, &Pipeline);
+	if (result != VK_SUCCESS)
+		throw std::runtime_error("HA::ComputeShader Could not create compute pipeline. " + GetStringFromResult(result));
+	Variants[Constants] = Pipeline;
+}
+
+HA::ComputeShader::ShaderBinding& HA::ComputeShader::GetBinding(uint32_t set, uint32_t binding, const char* name)
+{
+	auto it = Bindings.find(GetBindingKey(set, binding));
+	if (it == Bindings.end()) {
+		if (name)
+			throw std::runtime_error(std::string("HA::ComputeShader The shader has no binding named '") + name + "'.");
+		throw std::runtime_error("HA::ComputeShader The shader has no set " + std::to_string(set) + " binding " + std::to_string(binding) + ".");
+	}
+	return it->second;
+}
+
+HA::ComputeShader::ShaderBinding& HA::ComputeShader::GetBufferBinding(uint32_t set, uint32_t binding, const char* name)
+{
+	auto& resource = GetBinding(set, binding, name);
+	if (resource.Type != VK_DESCRIPTOR_TYPE_STORAGE_BUFFER && resource.Type != VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER) {
+		if (name)
+			throw std::runtime_error(std::string("HA::ComputeShader Binding '") + name + "' is not a buffer.");
+		throw std::runtime_error("HA::ComputeShader Binding " + std::to_string(binding) + " is not a buffer.");
+	}
+	return resource;
+}
+
+HA::ComputeShader::ShaderBinding& HA::ComputeShader::GetBufferBinding(const char* name)
+{
+	auto reflected = Reflection->Find(name);
+	if (!reflected)
+		throw std::runtime_error(std::string("HA::ComputeShader The shader has no binding named '") + name + "'.");
+	return GetBufferBinding(reflected->Set, reflected->Binding, name);
 }
@@ -1,16 +1,107 @@
 #pragma once
 #include <cstdint>
+#include <map>
+#include <vector>
+#include <vulkan/vulkan_core.h>
+#include "CommandThread.hpp"
 
 namespace HA {
 
 	class AccelerationEngine;
+	class GPBuffer;
+	class GPImage;
+	struct GPArenaAllocation;
+	class ShaderReflection;
+	struct ImplementationContext;
+
+	struct SpecializationConstant {
+		/// <summary>
+		/// constant_id in the shader
+		/// </summary>
+		uint32_t Id;
+		/// <summary>
+		/// 32 bit pattern of the value, booleans are 0 or 1 and floats are passed by their bits.
+		/// </summary>
+		uint32_t Value;
+	};
 
 	class ComputeShader {
 
 	public:
+		/// <summary>
+		/// Compiles the GLSL source and reflects its descriptor bindings, push constant
+		/// block and workgroup size. The descriptor set layouts are created right away.
+		/// Texel buffers (imageBuffer, samplerBuffer) are not supported and throw.
+		/// </summary>
 		ComputeShader(AccelerationEngine* engine, void* sourceCode, uint32_t length);
 		ComputeShader(AccelerationEngine* engine, const char* path);
 		~ComputeShader();
+		ComputeShader(const ComputeShader& copy) = delete;
+		ComputeShader(const ComputeShader&& move) = delete;
+
+		/// <summary>
+		/// Binds buffer to a storage or uniform buffer binding in set 0.
+		/// </summary>
+		void SetBuffer(uint32_t binding, GPBuffer* buffer);
+		/// <summary>
+		/// Binds the range of a GPArena allocation to a storage or uniform buffer binding in set 0.
+		/// </summary>
+		void SetBuffer(uint32_t binding, const GPArenaAllocation& allocation);
+
+		/// <summary>
+		/// Binds image to a storage, sampled or combined image sampler binding in set 0.
+		/// Storage images are moved to VK_IMAGE_LAYOUT_GENERAL before every dispatch,
+		/// sampled images to VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL.
+		/// Samplers are linear with clamp to edge addressing.
+		/// </summary>
+		void SetImage(uint32_t binding, GPImage* image);
+
+		/// <summary>
+		/// Binds buffer by variable name, or by block name for anonymous blocks.
+		/// For arrays of descriptors only the first element is bound.
+		/// </summary>
+		void Bind(const char* name, GPBuffer* buffer);
+		/// <summary>
+		/// Binds the range of a GPArena allocation by name.
+		/// </summary>
+		void Bind(const char* name, const GPArenaAllocation& allocation);
+
+		/// <summary>
+		/// Binds image by variable name.
+		/// For arrays of descriptors only the first element is bound.
+		/// </summary>
+		void Bind(const char* name, GPImage* image);
+
+		/// <summary>
+		/// Data is copied, bytes past size up to the shader's push constant block are zero.
+		/// </summary>
+		/// <param name="size">Must not exceed the push constant block of the shader</param>
+		void SetPushConstants(const void* data, uint32_t size);
+
+		/// <summary>
+		/// Selects the variant used by the following dispatches, constants that are not listed
+		/// keep their default value and an empty list selects the unspecialized shader.
+		/// Each variant's pipeline is created on its first dispatch and reused afterwards.
+		/// </summary>
+		void Specialize(const std::vector<SpecializationConstant>& constants);
+
+		/// <summary>
+		/// Records a dispatch of x * y * z workgroups with the current bindings into the shared
+		/// command buffer. It executes with the WriteAsync calls on AccelerationEngine::CommitMemory().
+		/// Every binding the shader declares must be bound.
+		/// </summary>
+		void Dispatch(uint32_t x, uint32_t y, uint32_t z);
+
+		/// <summary>
+		/// Same as Dispatch() but takes the number of invocations and rounds up to whole workgroups.
+		/// </summary>
+		void DispatchInvocations(uint32_t x, uint32_t y, uint32_t z);
+
+		/// <summary>
+		/// Reflected local_size_x/y/z of the shader, including specialized sizes of the current variant.
+		/// </summary>
+		void GetWorkgroupSize(uint32_t size[3]) const;
+
 	public:
 		/// <summary>
 		/// VkShaderModule
@@ -18,8 +109,55 @@ namespace HA {
 		void* ComputeModule;
 
 	private:
+		struct ShaderBinding {
+			VkDescriptorType Type;
+			uint32_t Set;
+			uint32_t Binding;
+			GPBuffer* Buffer;
+			GPImage* Image;
+			// Bound range of Buffer
+			uint64_t Offset;
+			uint64_t Range;
+		};
+
+		friend class GPTaskGraph;
+		/// <summary>
+		/// Throws if a binding is not bound, creates the pipeline of the current variant.
+		/// </summary>
+		void Prepare();
+		std::map<GPImage*, VkImageLayout> GetImageLayouts() const;
+		/// <summary>
+		/// Records the dispatch without barriers, the caller records them before.
+		/// </summary>
+		void Record(VkCommandBuffer cmd, CommandTicket ticket, const std::map<GPImage*, VkImageLayout>& layouts, uint32_t x, uint32_t y, uint32_t z);
 		void Load(AccelerationEngine* engine, void* sourceCode, uint32_t length);
+		/// <summary>
+		/// Destroys everything Load() and the dispatches created, skipping what was not created yet.
+		/// </summary>
+		void Release();
+		void CreateLayouts();
+		void CreatePipeline();
+		ShaderBinding& GetBinding(uint32_t set, uint32_t binding, const char* name);
+		ShaderBinding& GetBufferBinding(uint32_t set, uint32_t binding, const char* name);
+		ShaderBinding& GetBufferBinding(const char* name);
+
+		// Sorted by id, constants equal to their default are left out so they share a variant.
+		typedef std::vector<std::pair<uint32_t, uint32_t>> VariantKey;
 
+	private:
+		const ImplementationContext* Context;
+		ShaderReflection* Reflection;
+		// Keyed by set << 32 | binding
+		std::map<uint64_t, ShaderBinding> Bindings;
+		std::vector<uint8_t> PushConstants;
+		std::vector<VkDescriptorSetLayout> SetLayouts;
+		VkSampler Sampler;
+		VkPipelineLayout PipelineLayout;
+		std::map<VariantKey, VkPipeline> Variants;
+		VariantKey Constants;
+		VkPipeline Pipeline;
+		uint32_t WorkgroupSize[3];
+		CommandTicket LastSubmission;
 	};
 
 }
@@ -0,0 +1,190 @@
+#include "Defragmenter.hpp"
+#include "DescriptorAllocator.hpp"
+#include "ImplementationContext.hpp"
+#include "ImplementionManagedTypes.hpp"
+#include "Profiler.hpp"
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+
+HA::Defragmenter::Defragmenter(const ImplementationContext* Context)
+	: Context(Context)
+{}
+
+HA::DefragmentationStats HA::Defragmenter::Run(uint64_t maxBytesPerPass, uint32_t maxPasses)
+{
+	// Recorded but unsubmitted commands still reference the current handles
+	Context->_CommandThread->Submit();
+	Context->_CommandThread->WaitIdle();
+
+	VmaDefragmentationInfo info{};
+	info.flags = VMA_DEFRAGMENTATION_FLAG_ALGORITHM_BALANCED_BIT;
+	info.maxBytesPerPass = maxBytesPerPass;
+	VmaDefragmentationContext defragmentation;
+	VkResult result = vmaBeginDefragmentation(Context->Allocator, &info, &defragmentation);
+	if (result != VK_SUCCESS)
+		throw std::runtime_error("HA::Defragmenter Could not begin defragmentation. " + GetStringFromResult(result));
+
+	DefragmentationStats stats{};
+	std::vector<Replacement> replacements;
+	while (maxPasses == 0 || stats.Passes < maxPasses) {
+		VmaDefragmentationPassMoveInfo pass;
+		result = vmaBeginDefragmentationPass(Context->Allocator, defragmentation, &pass);
+		if (result == VK_SUCCESS) {
+			stats.Complete = true;
+			break;
+		}
+		stats.Passes++;
+
+		replacements.assign(pass.moveCount, {});
+		auto cmd = Context->_CommandThread->GenCmd();
+		uint32_t scope = Context->_Profiler->Begin(cmd, "AccelerationEngine::Defragment");
+		BarrierBatch barriers(Context, cmd);
+		for (uint32_t i = 0; i < pass.moveCount; i++) {
+			if (!RecordMove(barriers, pass.pMoves[i], replacements[i]))
+				pass.pMoves[i].operation = VMA_DEFRAGMENTATION_MOVE_OPERATION_IGNORE;
+		}
+		barriers.Record();
+		for (auto& replacement : replacements) {
+			if (replacement.Owner)
+				RecordCopy(cmd, replacement);
+		}
+		Context->_Profiler->End(cmd, scope);
+		Context->_CommandThread->Execute(cmd);
+
+		for (uint32_t i = 0; i < pass.moveCount; i++) {
+			if (pass.pMoves[i].operation == VMA_DEFRAGMENTATION_MOVE_OPERATION_COPY)
+				FinishMove(replacements[i]);
+		}
+		result = vmaEndDefragmentationPass(Context->Allocator, defragmentation, &pass);
+		// The moved allocations now describe their new place
+		for (auto& replacement : replacements) {
+			if (!replacement.Owner)
+				continue;
+			if (replacement.Owner->Buffer) {
+				auto managed = const_cast<ImplementationManagedBuffer*>(replacement.Owner->Buffer->Buffer);
+				vmaGetAllocationInfo(Context->Allocator, managed->Allocation, &managed->AllocationInfo);
+			}
+			else {
+				auto managed = const_cast<ImplementationManagedImage*>(replacement.Owner->Image->Image);
+				vmaGetAllocationInfo(Context->Allocator, managed->Allocation, &managed->AllocationInfo);
+			}
+		}
+		if (result == VK_SUCCESS) {
+			stats.Complete = true;
+			break;
+		}
+	}
+
+	VmaDefragmentationStats vmaStats{};
+	vmaEndDefragmentation(Context->Allocator, defragmentation, &vmaStats);
+	stats.BytesMoved = vmaStats.bytesMoved;
+	stats.BytesFreed = vmaStats.bytesFreed;
+	stats.AllocationsMoved = vmaStats.allocationsMoved;
+	stats.BlocksFreed = vmaStats.deviceMemoryBlocksFreed;
+	if (Context->Logger && stats.AllocationsMoved) {
+		Context->Logger->Print(("Defragmentation moved " + std::to_string(stats.AllocationsMoved) + " allocations and freed " +
+			std::to_string(stats.BytesFreed / 1024) + " KB.\n").c_str());
+	}
+	return stats;
+}
+
+bool HA::Defragmenter::RecordMove(BarrierBatch& barriers, const VmaDefragmentationMove& move, Replacement& replacement)
+{
+	VmaAllocationInfo allocationInfo;
+	vmaGetAllocationInfo(Context->Allocator, move.srcAllocation, &allocationInfo);
+	auto owner = (ImplementationAllocationOwner*)allocationInfo.pUserData;
+	if (!owner)
+		return false;
+
+	if (owner->Buffer) {
+		GPBuffer* buffer = owner->Buffer;
+		// The mapped pointer of Stream and Host buffers would move with the memory
+		if (buffer->MappedMemory && buffer->MemoryType != GPGPUMemoryType::Static)
+			return false;
+		VkBufferCreateInfo createInfo;
+		VmaAllocationCreateInfo unused;
+		GetBufferCreateInfo(Context, buffer->MemoryType, buffer->Size, createInfo, unused);
+		if (vkCreateBuffer(Context->Device, &createInfo, Context->AllocationCallbacks, &replacement.Buffer) != VK_SUCCESS)
+			return false;
+		if (vmaBindBufferMemory(Context->Allocator, move.dstTmpAllocation, replacement.Buffer) != VK_SUCCESS) {
+			vkDestroyBuffer(Context->Device, replacement.Buffer, Context->AllocationCallbacks);
+			return false;
+		}
+		barriers.Access(buffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_READ_BIT);
+		barriers.Access(replacement.Buffer, replacement.State, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT);
+	}
+	else {
+		GPImage* image = owner->Image;
+		VkImageCreateInfo createInfo;
+		GetImageCreateInfo(Context, image->Format, image->ImageType, image->Size, image->Mipcount, createInfo);
+		if (vkCreateImage(Context->Device, &createInfo, Context->AllocationCallbacks, &replacement.Image) != VK_SUCCESS)
+			return false;
+		if (vmaBindImageMemory(Context->Allocator, move.dstTmpAllocation, replacement.Image) != VK_SUCCESS ||
+			CreateImageView(Context, replacement.Image, image->Format, image->ImageType, image->Mipcount, &replacement.View) != VK_SUCCESS) {
+			vkDestroyImage(Context->Device, replacement.Image, Context->AllocationCallbacks);
+			return false;
+		}
+		// Contents of an image that was never written are undefined anyway, its replacement stays unused
+		replacement.LevelStates.resize(image->Mipcount);
+		auto& levels = image->Image->LevelStates;
+		bool written = std::any_of(levels.begin(), levels.end(), [](const ResourceState& level) {
+			return level.Layout != VK_IMAGE_LAYOUT_UNDEFINED;
+		});
+		if (written) {
+			barriers.Access(image, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_READ_BIT, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL);
+			barriers.Access(replacement.Image, replacement.LevelStates.data(), 0, image->Mipcount, VK_PIPELINE_STAGE_TRANSFER_BIT,
+				VK_ACCESS_TRANSFER_WRITE_BIT, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+		}
+	}
+	replacement.Owner = owner;
+	return true;
+}
+
+void HA::Defragmenter::RecordCopy(VkCommandBuffer cmd, const Replacement& replacement)
+{
+	if (replacement.Owner->Buffer) {
+		GPBuffer* buffer = replacement.Owner->Buffer;
+		VkBufferCopy region{};
+		region.size = buffer->Size;
+		vkCmdCopyBuffer(cmd, buffer->Buffer->Buffer, replacement.Buffer, 1, &region);
+		return;
+	}
+	GPImage* image = replacement.Owner->Image;
+	if (replacement.LevelStates[0].Layout == VK_IMAGE_LAYOUT_UNDEFINED)
+		return;
+	std::vector<VkImageCopy> regions(image->Mipcount);
+	for (uint32_t level = 0; level < (uint32_t)image->Mipcount; level++) {
+		auto& region = regions[level];
+		region = {};
+		region.srcSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, level, 0, 1 };
+		region.dstSubresource = region.srcSubresource;
+		region.extent = { std::max(image->Size.width >> level, 1u), std::max(image->Size.height >> level, 1u),
+			std::max(image->Size.depth >> level, 1u) };
+	}
+	vkCmdCopyImage(cmd, image->Image->Image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, replacement.Image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+		(uint32_t)regions.size(), regions.data());
+}
+
+void HA::Defragmenter::FinishMove(const Replacement& replacement)
+{
+	if (replacement.Owner->Buffer) {
+		auto managed = const_cast<ImplementationManagedBuffer*>(replacement.Owner->Buffer->Buffer);
+		Context->_DescriptorAllocator->Invalidate((uint64_t)managed->Buffer);
+		vkDestroyBuffer(Context->Device, managed->Buffer, Context->AllocationCallbacks);
+		managed->Buffer = replacement.Buffer;
+		managed->State = replacement.State;
+	}
+	else {
+		auto managed = const_cast<ImplementationManagedImage*>(replacement.Owner->Image->Image);
+		Context->_DescriptorAllocator->Invalidate((uint64_t)managed->View);
+		vkDestroyImageView(Context->Device, managed->View, Context->AllocationCallbacks);
+		// Level views of the old image are recreated by the next GenerateMipmap()
+		DestroyLevelViews(Context, managed);
+		vkDestroyImage(Context->Device, managed->Image, Context->AllocationCallbacks);
+		managed->Image = replacement.Image;
+		managed->View = replacement.View;
+		// The next use waits for the copy and moves every level to the layout it needs
+		managed->LevelStates = replacement.LevelStates;
+	}
+}
@@ -0,0 +1,58 @@
+#pragma once
+// This file is only for internal use by the api
+#include "AccelerationEngine.hpp"
+#include "ResourceTracker.hpp"
+#include <vk_mem_alloc.h>
+#include <cstdint>
+#include <vector>
+
+namespace HA {
+
+	struct ImplementationContext;
+	struct ImplementationAllocationOwner;
+
+	/// <summary>
+	/// Compacts the engine wide allocator with VMA's defragmentation. Every pass copies the
+	/// moved allocations into new buffers and images on the GPU, waits for the copies and then
+	/// swaps the handles inside the ImplementationManagedBuffer/Image of their owners, so
+	/// GPBuffer and GPImage pointers stay valid. Mapped Stream and Host buffers are not moved.
+	/// </summary>
+	class Defragmenter {
+
+	public:
+		Defragmenter(const ImplementationContext* Context);
+		Defragmenter(const Defragmenter& copy) = delete;
+		Defragmenter(const Defragmenter&& move) = delete;
+
+		/// <summary>
+		/// Must not run while any submission is in flight, Run() submits and waits first.
+		/// </summary>
+		/// <param name="maxPasses">0 runs until nothing is left to move</param>
+		DefragmentationStats Run(uint64_t maxBytesPerPass, uint32_t maxPasses);
+
+	private:
+		struct Replacement {
+			ImplementationAllocationOwner* Owner;
+			VkBuffer Buffer;
+			VkImage Image;
+			VkImageView View;
+			/// <summary>
+			/// State of the copy's destination, taken over by the owner.
+			/// </summary>
+			ResourceState State;
+			std::vector<ResourceState> LevelStates;
+		};
+
+		/// <summary>
+		/// Creates the replacement and collects the barriers of its copy, which RecordCopy() records
+		/// once the barriers of all moves of the pass are.
+		/// </summary>
+		bool RecordMove(BarrierBatch& barriers, const VmaDefragmentationMove& move, Replacement& replacement);
+		void RecordCopy(VkCommandBuffer cmd, const Replacement& replacement);
+		void FinishMove(const Replacement& replacement);
+
+	private:
+		const ImplementationContext* Context;
+	};
+
+}
@@ -0,0 +1,195 @@
+#include "DescriptorAllocator.hpp"
+#include "ImplementationContext.hpp"
+#include <algorithm>
+#include <stdexcept>
+#include <type_traits>
+
+// Sets per pool page, a new page is created once every page is full.
+#define PAGE_SET_COUNT (256)
+// Words per resource in a SetKey after the layout.
+#define KEY_STRIDE (7)
+
+template<typename T>
+static uint64_t ToKey(T handle)
+{
+	if constexpr (std::is_pointer_v<T>)
+		return (uint64_t)(uintptr_t)handle;
+	else
+		return (uint64_t)handle;
+}
+
+HA::DescriptorAllocator::DescriptorAllocator(const ImplementationContext* Context, uint32_t MaxCachedSets)
+	: Context(Context), MaxCachedSets(MaxCachedSets), CurrentPage(0)
+{}
+
+HA::DescriptorAllocator::~DescriptorAllocator()
+{
+	// Destroying the pools frees every set
+	for (auto page : Pages)
+		vkDestroyDescriptorPool(Context->Device, page, Context->AllocationCallbacks);
+}
+
+VkDescriptorSet HA::DescriptorAllocator::Acquire(VkDescriptorSetLayout layout, const std::vector<DescriptorResource>& resources, CommandTicket ticket)
+{
+	SetKey key;
+	key.reserve(1 + resources.size() * KEY_STRIDE);
+	key.push_back(ToKey(layout));
+	for (auto& resource : resources) {
+		key.push_back(resource.Binding);
+		key.push_back(resource.Type);
+		key.push_back(resource.Buffer.buffer ? ToKey(resource.Buffer.buffer) : ToKey(resource.Image.imageView));
+		key.push_back(resource.Buffer.offset);
+		key.push_back(resource.Buffer.range);
+		key.push_back(resource.Image.imageLayout);
+		key.push_back(ToKey(resource.Image.sampler));
+	}
+
+	std::lock_guard<std::mutex> guard(Lock);
+	FreeRetired();
+
+	auto cached = Cache.find(key);
+	if (cached != Cache.end()) {
+		cached->second.LastUse = std::max(cached->second.LastUse, ticket);
+		Recent.splice(Recent.begin(), Recent, cached->second.Recent);
+		return cached->second.Set;
+	}
+
+	VkDescriptorPool pool;
+	VkDescriptorSet set = Allocate(layout, &pool);
+	std::vector<VkWriteDescriptorSet> writes;
+	writes.reserve(resources.size());
+	for (auto& resource : resources) {
+		VkWriteDescriptorSet write{ VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET };
+		write.dstSet = set;
+		write.dstBinding = resource.Binding;
+		write.descriptorCount = 1;
+		write.descriptorType = resource.Type;
+		if (resource.Buffer.buffer)
+			write.pBufferInfo = &resource.Buffer;
+		else
+			write.pImageInfo = &resource.Image;
+		writes.push_back(write);
+	}
+	vkUpdateDescriptorSets(Context->Device, (uint32_t)writes.size(), writes.data(), 0, nullptr);
+
+	Recent.push_front(key);
+	Cache[key] = { set, pool, ticket, Recent.begin() };
+	KeysByHandle[key[0]].push_back(key);
+	for (size_t i = 1; i < key.size(); i += KEY_STRIDE) {
+		KeysByHandle[key[i + 2]].push_back(key);
+		if (key[i + 6])
+			KeysByHandle[key[i + 6]].push_back(key);
+	}
+
+	while (Cache.size() > MaxCachedSets)
+		Retire(Recent.back());
+	return set;
+}
+
+void HA::DescriptorAllocator::Invalidate(uint64_t handle)
+{
+	std::lock_guard<std::mutex> guard(Lock);
+	auto it = KeysByHandle.find(handle);
+	if (it == KeysByHandle.end())
+		return;
+	// Retire() edits the index, so work on a copy
+	std::vector<SetKey> keys = it->second;
+	for (auto& key : keys)
+		Retire(key);
+}
+
+VkDescriptorSet HA::DescriptorAllocator::Allocate(VkDescriptorSetLayout layout, VkDescriptorPool* pool)
+{
+	VkDescriptorSetAllocateInfo allocInfo{ VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO };
+	allocInfo.descriptorSetCount = 1;
+	allocInfo.pSetLayouts = &layout;
+	VkDescriptorSet set;
+	for (size_t i = 0; i < Pages.size(); i++) {
+		size_t page = (CurrentPage + i) % Pages.size();
+		allocInfo.descriptorPool = Pages[page];
+		if (vkAllocateDescriptorSets(Context->Device, &allocInfo, &set) == VK_SUCCESS) {
+			CurrentPage = page;
+			*pool = Pages[page];
+			return set;
+		}
+	}
+
+	VkDescriptorPoolSize sizes[] = {
+		{ VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, PAGE_SET_COUNT * 4 },
+		{ VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, PAGE_SET_COUNT },
+		{ VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, PAGE_SET_COUNT * 2 },
+		{ VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE, PAGE_SET_COUNT },
+		{ VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, PAGE_SET_COUNT },
+		{ VK_DESCRIPTOR_TYPE_SAMPLER, PAGE_SET_COUNT / 4 },
+	};
+	VkDescriptorPoolCreateInfo poolInfo{ VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO };
+	poolInfo.flags = VK_DESCRIPTOR_POOL_CREATE_FREE_DESCRIPTOR_SET_BIT;
+	poolInfo.maxSets = PAGE_SET_COUNT;
+	poolInfo.poolSizeCount = sizeof(sizes) / sizeof(sizes[0]);
+	poolInfo.pPoolSizes = sizes;
+	VkDescriptorPool page;
+	VkResult result = vkCreateDescriptorPool(Context->Device, &poolInfo, Context->AllocationCallbacks, &page);
+	if (result != VK_SUCCESS)
+		throw std::runtime_error("HA::DescriptorAllocator Could not create descriptor pool. " + GetStringFromResult(result));
+	Pages.push_back(page);
+	CurrentPage = Pages.size() - 1;
+
+	allocInfo.descriptorPool = page;
+	result = vkAllocateDescriptorSets(Context->Device, &allocInfo, &set);
+	if (result != VK_SUCCESS)
+		throw std::runtime_error("HA::DescriptorAllocator Could not allocate descriptor set. " + GetStringFromResult(result));
+	*pool = page;
+	return set;
+}
+
+void HA::DescriptorAllocator::Retire(const SetKey& recentKey)
+{
+	// recentKey may live in Recent or the index, both are edited below
+	SetKey key = recentKey;
+	auto cached = Cache.find(key);
+	if (cached == Cache.end())
+		return;
+	RetiredSets.push_back({ cached->second.Set, cached->second.Pool, cached->second.LastUse });
+	Recent.erase(cached->second.Recent);
+
+	auto unindex = [this, &key](uint64_t handle) {
+		auto it = KeysByHandle.find(handle);
+		if (it == KeysByHandle.end())
+			return;
+		auto& keys = it->second;
+		keys.erase(std::remove(keys.begin(), keys.end(), key), keys.end());
+		if (keys.empty())
+			KeysByHandle.erase(it);
+	};
+	Cache.erase(cached);
+	unindex(key[0]);
+	for (size_t i = 1; i < key.size(); i += KEY_STRIDE) {
+		unindex(key[i + 2]);
+		if (key[i + 6])
+			unindex(key[i + 6]);
+	}
+}
+
+void HA::DescriptorAllocator::FreeRetired()
+{
+	for (auto it = RetiredSets.begin(); it != RetiredSets.end();) {
+		if (Context->_CommandThread->Poll(it->LastUse)) {
+			vkFreeDescriptorSets(Context->Device, it->Pool, 1, &it->Set);
+			it = RetiredSets.erase(it);
+		}
+		else {
+			it++;
+		}
+	}
+}
+
+size_t HA::DescriptorAllocator::KeyHash::operator()(const SetKey& key) const
+{
+	// 64 bit FNV-1a over the words
+	uint64_t hash = 14695981039346656037ull;
+	for (auto word : key) {
+		hash ^= word;
+		hash *= 1099511628211ull;
+	}
+	return (size_t)hash;
+}
@@ -0,0 +1,88 @@
+#pragma once
+// This file is only for internal use by the api
+#include "CommandThread.hpp"
+#include <cstdint>
+#include <deque>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include <vulkan/vulkan_core.h>
+
+namespace HA {
+
+	struct ImplementationContext;
+
+	struct DescriptorResource {
+		uint32_t Binding;
+		VkDescriptorType Type;
+		VkDescriptorBufferInfo Buffer;
+		VkDescriptorImageInfo Image;
+	};
+
+	/// <summary>
+	/// Engine wide descriptor set allocator. Sets are allocated from growable pool pages
+	/// and cached by layout and bound resources, so repeated dispatches over the same
+	/// resources reuse the same set without calling vkUpdateDescriptorSets.
+	/// Sets that are evicted or invalidated are freed once their last submission retired.
+	/// </summary>
+	class DescriptorAllocator {
+
+	public:
+		DescriptorAllocator(const ImplementationContext* Context, uint32_t MaxCachedSets = 4096);
+		~DescriptorAllocator();
+		DescriptorAllocator(const DescriptorAllocator& copy) = delete;
+		DescriptorAllocator(const DescriptorAllocator&& move) = delete;
+
+		/// <summary>
+		/// Returns a set of layout with resources written to it.
+		/// </summary>
+		/// <param name="ticket">Submission that uses the set, it is not freed before it retires</param>
+		VkDescriptorSet Acquire(VkDescriptorSetLayout layout, const std::vector<DescriptorResource>& resources, CommandTicket ticket);
+
+		/// <summary>
+		/// Drops every cached set that references handle (VkBuffer, VkImageView, VkSampler or VkDescriptorSetLayout).
+		/// Must be called before the handle is destroyed.
+		/// </summary>
+		void Invalidate(uint64_t handle);
+
+	public:
+		const ImplementationContext* Context;
+		const uint32_t MaxCachedSets;
+
+	private:
+		typedef std::vector<uint64_t> SetKey;
+
+		struct KeyHash {
+			size_t operator()(const SetKey& key) const;
+		};
+
+		struct CachedSet {
+			VkDescriptorSet Set;
+			VkDescriptorPool Pool;
+			CommandTicket LastUse;
+			std::list<SetKey>::iterator Recent;
+		};
+
+		struct RetiredSet {
+			VkDescriptorSet Set;
+			VkDescriptorPool Pool;
+			CommandTicket LastUse;
+		};
+
+		VkDescriptorSet Allocate(VkDescriptorSetLayout layout, VkDescriptorPool* pool);
+		void Retire(const SetKey& recentKey);
+		void FreeRetired();
+
+	private:
+		std::vector<VkDescriptorPool> Pages;
+		size_t CurrentPage;
+		std::unordered_map<SetKey, CachedSet, KeyHash> Cache;
+		// Most recently used first
+		std::list<SetKey> Recent;
+		std::unordered_map<uint64_t, std::vector<SetKey>> KeysByHandle;
+		std::deque<RetiredSet> RetiredSets;
+		std::mutex Lock;
+	};
+
+}
@@ -0,0 +1,207 @@
+#include "DirtyPageTracker.hpp"
+#include <algorithm>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+#ifdef __linux__
+#include <signal.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+// Page size of manual tracking, automatic tracking uses the system page size.
+#define MANUAL_PAGE_SIZE (4096)
+// Shadows that can be tracked automatically at the same time
+#define MAX_AUTOMATIC_SHADOWS (256)
+
+#ifdef __linux__
+// The fault handler cannot take locks, shadows are published through atomic slots.
+static std::atomic<HA::DirtyPageTracker*> AutomaticShadows[MAX_AUTOMATIC_SHADOWS];
+static struct sigaction PreviousHandler;
+static std::once_flag HandlerInstalled;
+
+static void SegvHandler(int signal, siginfo_t* info, void* context);
+#endif
+
+static uint64_t GetPageSize(bool automatic)
+{
+#ifdef __linux__
+	if (automatic)
+		return (uint64_t)sysconf(_SC_PAGESIZE);
+#endif
+	return MANUAL_PAGE_SIZE;
+}
+
+HA::DirtyPageTracker::DirtyPageTracker(uint64_t Size, bool Automatic)
+	: Size(Size), PageSize(GetPageSize(Automatic && SupportsAutomatic())),
+	Automatic(Automatic && SupportsAutomatic()), Data(AllocateShadow(Size, this->Automatic, PageSize)),
+	PageCount((Size + PageSize - 1) / PageSize), DirtyBits(new std::atomic<uint64_t>[(PageCount + 63) / 64]), Slot(-1)
+{
+	for (uint64_t i = 0; i < (PageCount + 63) / 64; i++)
+		DirtyBits[i].store(0, std::memory_order_relaxed);
+	if (!this->Automatic)
+		return;
+#ifdef __linux__
+	std::call_once(HandlerInstalled, []() {
+		struct sigaction action {};
+		action.sa_sigaction = SegvHandler;
+		action.sa_flags = SA_SIGINFO | SA_RESTART;
+		sigemptyset(&action.sa_mask);
+		sigaction(SIGSEGV, &action, &PreviousHandler);
+	});
+	for (int32_t i = 0; i < MAX_AUTOMATIC_SHADOWS; i++) {
+		DirtyPageTracker* expected = nullptr;
+		if (AutomaticShadows[i].compare_exchange_strong(expected, this)) {
+			Slot = i;
+			break;
+		}
+	}
+	if (Slot < 0) {
+		munmap(Data, PageCount * PageSize);
+		throw std::runtime_error("HA::DirtyPageTracker Too many automatically tracked buffers are mapped.");
+	}
+	Protect(0, PageCount, false);
+#endif
+}
+
+HA::DirtyPageTracker::~DirtyPageTracker()
+{
+#ifdef __linux__
+	if (Automatic) {
+		AutomaticShadows[Slot].store(nullptr);
+		munmap(Data, PageCount * PageSize);
+		return;
+	}
+#endif
+	delete[] Data;
+}
+
+void HA::DirtyPageTracker::MarkDirty(uint64_t offset, uint64_t size)
+{
+	if (size == 0 || offset >= Size)
+		return;
+	uint64_t last = std::min(offset + size, Size) - 1;
+	for (uint64_t page = offset / PageSize; page <= last / PageSize; page++)
+		DirtyBits[page / 64].fetch_or(1ull << (page % 64));
+}
+
+void HA::DirtyPageTracker::CollectDirty(uint64_t offset, uint64_t size, std::vector<std::pair<uint64_t, uint64_t>>& ranges)
+{
+	uint64_t end = std::min(offset + size, Size);
+	if (offset >= end)
+		return;
+	for (uint64_t page = offset / PageSize; page * PageSize < end; page++) {
+		if (!IsDirty(page))
+			continue;
+		uint64_t begin = std::max(page * PageSize, offset);
+		uint64_t pageEnd = std::min((page + 1) * PageSize, end);
+		// Only pages fully covered by the range are clean after the sync
+		if (page * PageSize >= offset && ((page + 1) * PageSize <= end || pageEnd == Size))
+			Clean(page);
+		if (!ranges.empty() && ranges.back().second == begin)
+			ranges.back().second = pageEnd;
+		else
+			ranges.push_back({ begin, pageEnd });
+	}
+}
+
+void HA::DirtyPageTracker::Overwrite(uint64_t offset, const void* data, uint64_t size)
+{
+	uint64_t end = std::min(offset + size, Size);
+	if (offset >= end)
+		return;
+	uint64_t firstPage = offset / PageSize;
+	uint64_t lastPage = (end + PageSize - 1) / PageSize;
+	if (Automatic)
+		Protect(firstPage, lastPage, true);
+	memcpy(Data + offset, data, end - offset);
+	for (uint64_t page = firstPage; page < lastPage; page++) {
+		bool covered = page * PageSize >= offset && ((page + 1) * PageSize <= end || end == Size);
+		if (covered)
+			Clean(page);
+		else if (Automatic && !IsDirty(page))
+			Protect(page, page + 1, false);
+	}
+}
+
+bool HA::DirtyPageTracker::SupportsAutomatic()
+{
+#ifdef __linux__
+	return true;
+#else
+	return false;
+#endif
+}
+
+void HA::DirtyPageTracker::Protect(uint64_t firstPage, uint64_t lastPage, bool writable)
+{
+#ifdef __linux__
+	mprotect(Data + firstPage * PageSize, (lastPage - firstPage) * PageSize, writable ? PROT_READ | PROT_WRITE : PROT_READ);
+#endif
+}
+
+bool HA::DirtyPageTracker::IsDirty(uint64_t page) const
+{
+	return DirtyBits[page / 64].load() & (1ull << (page % 64));
+}
+
+void HA::DirtyPageTracker::Clean(uint64_t page)
+{
+	// Cleared before protecting, a write in between is still picked up by the copy that follows
+	DirtyBits[page / 64].fetch_and(~(1ull << (page % 64)));
+	if (Automatic)
+		Protect(page, page + 1, false);
+}
+
+char* HA::DirtyPageTracker::AllocateShadow(uint64_t size, bool automatic, uint64_t pageSize)
+{
+#ifdef __linux__
+	if (automatic) {
+		uint64_t length = (size + pageSize - 1) / pageSize * pageSize;
+		void* memory = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (memory == MAP_FAILED)
+			throw std::runtime_error("HA::DirtyPageTracker Could not allocate shadow memory.");
+		return (char*)memory;
+	}
+#endif
+	return new char[size];
+}
+
+bool HA::DirtyPageTracker::OnFault(void* address)
+{
+#ifdef __linux__
+	char* target = (char*)address;
+	for (auto& slot : AutomaticShadows) {
+		DirtyPageTracker* tracker = slot.load(std::memory_order_acquire);
+		if (!tracker || target < tracker->Data || target >= tracker->Data + tracker->Size)
+			continue;
+		uint64_t page = (uint64_t)(target - tracker->Data) / tracker->PageSize;
+		tracker->DirtyBits[page / 64].fetch_or(1ull << (page % 64));
+		tracker->Protect(page, page + 1, true);
+		return true;
+	}
+#endif
+	return false;
+}
+
+#ifdef __linux__
+static void SegvHandler(int signal, siginfo_t* info, void* context)
+{
+	if (HA::DirtyPageTracker::OnFault(info->si_addr))
+		return;
+	// Not a tracked shadow, hand the fault to whoever was installed before
+	if (PreviousHandler.sa_flags & SA_SIGINFO) {
+		PreviousHandler.sa_sigaction(signal, info, context);
+	}
+	else if (PreviousHandler.sa_handler != SIG_DFL && PreviousHandler.sa_handler != SIG_IGN) {
+		PreviousHandler.sa_handler(signal);
+	}
+	else {
+		// Restore the default action, the faulting instruction runs again and terminates
+		struct sigaction action {};
+		action.sa_handler = SIG_DFL;
+		sigemptyset(&action.sa_mask);
+		sigaction(SIGSEGV, &action, nullptr);
+	}
+}
+#endif
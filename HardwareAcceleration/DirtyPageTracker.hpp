@@ -0,0 +1,68 @@
+#pragma once
+// This file is only for internal use by the api
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace HA {
+
+	/// <summary>
+	/// Shadow memory of a mapped Static buffer with a dirty bit per page, so syncs
+	/// only transfer the pages the CPU modified. Pages are marked with MarkDirty(), in
+	/// automatic mode the shadow is write-protected and the first write to each page
+	/// marks it from a SIGSEGV handler (Linux only).
+	/// </summary>
+	class DirtyPageTracker {
+
+	public:
+		DirtyPageTracker(uint64_t Size, bool Automatic);
+		~DirtyPageTracker();
+		DirtyPageTracker(const DirtyPageTracker& copy) = delete;
+		DirtyPageTracker(const DirtyPageTracker&& move) = delete;
+
+		void MarkDirty(uint64_t offset, uint64_t size);
+
+		/// <summary>
+		/// Appends the dirty ranges inside [offset, offset + size) as (begin, end) pairs and
+		/// marks the pages that are fully inside the range clean again.
+		/// </summary>
+		void CollectDirty(uint64_t offset, uint64_t size, std::vector<std::pair<uint64_t, uint64_t>>& ranges);
+
+		/// <summary>
+		/// Copies data into the shadow on behalf of the api (a readback), the written
+		/// pages are clean afterwards.
+		/// </summary>
+		void Overwrite(uint64_t offset, const void* data, uint64_t size);
+
+		/// <summary>
+		/// True if automatic tracking was requested and is supported on this platform.
+		/// </summary>
+		static bool SupportsAutomatic();
+
+		/// <summary>
+		/// Called by the fault handler, marks the page and lifts its write protection.
+		/// </summary>
+		/// <returns>False if address is not inside an automatically tracked shadow</returns>
+		static bool OnFault(void* address);
+
+	public:
+		const uint64_t Size;
+		const uint64_t PageSize;
+		const bool Automatic;
+		char* const Data;
+
+	private:
+		void Protect(uint64_t firstPage, uint64_t lastPage, bool writable);
+		bool IsDirty(uint64_t page) const;
+		void Clean(uint64_t page);
+		static char* AllocateShadow(uint64_t size, bool automatic, uint64_t pageSize);
+
+	private:
+		const uint64_t PageCount;
+		std::unique_ptr<std::atomic<uint64_t>[]> DirtyBits;
+		// Slot in the fault handler registry, -1 if not registered
+		int32_t Slot;
+	};
+
+}
@@ -1,13 +1,33 @@
 #define _CRT_SECURE_NO_WARNINGS
 #include "GPGPUMemory.hpp"
+#include "DescriptorAllocator.hpp"
+#include "DirtyPageTracker.hpp"
 #include "ImplementionManagedTypes.hpp"
 #include "ImplementationContext.hpp"
-#include <vma/vk_mem_alloc.h>
+#include "MappedFile.hpp"
+#include "MemoryAllocator.hpp"
+#include "MemoryStatistics.hpp"
+#include "MipGenerator.hpp"
+#include "Profiler.hpp"
+#include "ResourceTracker.hpp"
+#include "StagingPool.hpp"
+#include <vk_mem_alloc.h>
+#include <algorithm>
 #include <cassert>
+#include <cstring>
+#include <initializer_list>
+#include <numeric>
 #include <stdexcept>
 
 #pragma region GPU Buffer
 
+#define BUFFER_USAGE (VK_BUFFER_USAGE_TRANSFER_SRC_BIT | \
+	VK_BUFFER_USAGE_TRANSFER_DST_BIT | \
+	VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT | \
+	VK_BUFFER_USAGE_STORAGE_BUFFER_BIT)
+// Chunk size of file streaming, each of the two staging buffers holds one chunk
+#define STREAM_CHUNK_SIZE (32ull * 1024 * 1024)
+
 static VkMemoryPropertyFlags GetPreferredFlags(HA::GPGPUMemoryType memoryType) {
 	switch (memoryType) {
 	case HA::GPGPUMemoryType::Static:
@@ -21,43 +41,207 @@ static VkMemoryPropertyFlags GetPreferredFlags(HA::GPGPUMemoryType memoryType) {
 	}
 }
 
-HA::GPBuffer::GPBuffer(const ImplementationContext* Context, const GPGPUMemoryType memoryType, const uint64_t size)
-	: Context(Context), MemoryType(memoryType), Size(size), MappedMemory(nullptr) {
+// Shared by the compute and the transfer queue family, so no ownership transfers are needed
+template<typename CreateInfo>
+static void SetSharingMode(const HA::ImplementationContext* Context, CreateInfo& createInfo)
+{
+	bool concurrent = Context->QueueFamilies[0] != Context->QueueFamilies[1];
+	createInfo.sharingMode = concurrent ? VK_SHARING_MODE_CONCURRENT : VK_SHARING_MODE_EXCLUSIVE;
+	createInfo.queueFamilyIndexCount = concurrent ? 2 : 0;
+	createInfo.pQueueFamilyIndices = concurrent ? Context->QueueFamilies : nullptr;
+}
 
-	VkBufferCreateInfo createInfo{ VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO };
-	createInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+// Immediate copies run on the transfer queue if there is one. If compute work that uses
+// one of the resources has not executed yet, the copy waits on a semaphore for it.
+static HA::CommandThread* GetCopyThread(const HA::ImplementationContext* Context, std::initializer_list<HA::CommandTicket> tickets)
+{
+	// Writes still recorded by another thread are submitted first
+	for (auto ticket : tickets)
+		Context->_CommandThread->Flush(ticket);
+	if (!Context->_TransferThread)
+		return Context->_CommandThread;
+	for (auto ticket : tickets) {
+		if (Context->_CommandThread->Owns(ticket) && !Context->_CommandThread->Poll(ticket)) {
+			Context->_TransferThread->WaitFor(Context->_CommandThread);
+			break;
+		}
+	}
+	return Context->_TransferThread;
+}
+
+// Batched copies are recorded into the transfer queue's shared command buffer, which the next
+// compute submission submits and waits for. A resource used by compute work that has not
+// executed yet keeps its copies on the compute queue, in order with that work.
+static HA::CommandThread* GetBatchThread(const HA::ImplementationContext* Context, HA::CommandTicket ticket)
+{
+	Context->_CommandThread->Flush(ticket);
+	if (!Context->_TransferThread || (Context->_CommandThread->Owns(ticket) && !Context->_CommandThread->Poll(ticket)))
+		return Context->_CommandThread;
+	return Context->_TransferThread;
+}
+
+void HA::GetBufferCreateInfo(const ImplementationContext* Context, GPGPUMemoryType memoryType, uint64_t size, VkBufferCreateInfo& createInfo,
+	VmaAllocationCreateInfo& allocationInfo)
+{
+	createInfo = { VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO };
+	SetSharingMode(Context, createInfo);
 	createInfo.size = size;
-	createInfo.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT |
-		VK_BUFFER_USAGE_TRANSFER_DST_BIT |
-		VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
-
-	VmaAllocationCreateInfo acreateInfo{};
-	acreateInfo.usage = VMA_MEMORY_USAGE_AUTO;
-	acreateInfo.preferredFlags = GetPreferredFlags(memoryType);
-	acreateInfo.flags = VMA_ALLOCATION_CREATE_STRATEGY_BEST_FIT_BIT |
+	createInfo.usage = BUFFER_USAGE;
+
+	allocationInfo = {};
+	allocationInfo.usage = VMA_MEMORY_USAGE_AUTO;
+	allocationInfo.preferredFlags = GetPreferredFlags(memoryType);
+	allocationInfo.flags = VMA_ALLOCATION_CREATE_STRATEGY_BEST_FIT_BIT |
 		(memoryType == GPGPUMemoryType::Static ? 0 : VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT);
+}
+
+HA::GPBuffer::GPBuffer(const ImplementationContext* Context, const GPGPUMemoryType memoryType, const uint64_t size, MemoryAllocator* allocator)
+	: Context(Context), MemoryType(memoryType), Size(size), MappedMemory(nullptr), DirtyTracking(GPDirtyTracking::Disabled),
+	Dirty(nullptr), Allocator(allocator), LastSubmission(0) {
+
+	VkBufferCreateInfo createInfo;
+	VmaAllocationCreateInfo acreateInfo;
+	GetBufferCreateInfo(Context, memoryType, size, createInfo, acreateInfo);
+	if (allocator)
+		acreateInfo.pool = allocator->GetPool(memoryType);
 	VkBuffer buffer;
 	VmaAllocation allocation;
 	VmaAllocationInfo allocationInfo;
-	vmaCreateBuffer(Context->Allocator, &createInfo, &acreateInfo, &buffer, &allocation, &allocationInfo);
-	ImplementationManagedBuffer* managedBuffer = new HA::ImplementationManagedBuffer;
+	VkResult result = vmaCreateBuffer(Context->Allocator, &createInfo, &acreateInfo, &buffer, &allocation, &allocationInfo);
+	if (result != VK_SUCCESS && acreateInfo.pool) {
+		if (Context->Logger)
+			Context->Logger->Print("MemoryAllocator is full, the buffer is allocated outside of it.\n");
+		acreateInfo.pool = nullptr;
+		result = vmaCreateBuffer(Context->Allocator, &createInfo, &acreateInfo, &buffer, &allocation, &allocationInfo);
+	}
+	if (result != VK_SUCCESS)
+		throw std::runtime_error("HA::GPBuffer Could not create buffer. " + GetStringFromResult(result));
+	ImplementationManagedBuffer* managedBuffer = new HA::ImplementationManagedBuffer{};
 	managedBuffer->Buffer = buffer;
 	managedBuffer->Allocation = allocation;
 	managedBuffer->AllocationInfo = allocationInfo;
+	managedBuffer->Owner.Buffer = this;
+	vmaSetAllocationUserData(Context->Allocator, allocation, &managedBuffer->Owner);
 	Buffer = managedBuffer;
+	Context->_MemoryStatistics->Add(memoryType, false, allocationInfo.size);
+}
+
+HA::GPBuffer::GPBuffer(const ImplementationContext* Context, const ImplementationManagedBuffer* external, const GPGPUMemoryType memoryType,
+	const uint64_t size)
+	: Context(Context), MemoryType(memoryType), Size(size), Buffer(external), MappedMemory(nullptr),
+	DirtyTracking(GPDirtyTracking::Disabled), Dirty(nullptr), Allocator(nullptr), LastSubmission(0)
+{
+	if (external->ImportedMemory)
+		Context->_MemoryStatistics->Add(MemoryType, false, size);
+}
+
+static HA::ImplementationManagedBuffer* ImportHostMemory(const HA::ImplementationContext* Context, void* hostMemory, uint64_t size)
+{
+	if (!Context->ExternalMemoryHost)
+		return nullptr;
+	uint64_t alignment = Context->MinImportedHostPointerAlignment;
+	if ((uintptr_t)hostMemory % alignment || size % alignment)
+		return nullptr;
+	VkMemoryHostPointerPropertiesEXT pointerProperties{ VK_STRUCTURE_TYPE_MEMORY_HOST_POINTER_PROPERTIES_EXT };
+	VkResult result = Context->GetMemoryHostPointerProperties(Context->Device, VK_EXTERNAL_MEMORY_HANDLE_TYPE_HOST_ALLOCATION_BIT_EXT,
+		hostMemory, &pointerProperties);
+	if (result != VK_SUCCESS)
+		return nullptr;
+
+	VkExternalMemoryBufferCreateInfo externalInfo{ VK_STRUCTURE_TYPE_EXTERNAL_MEMORY_BUFFER_CREATE_INFO_KHR };
+	externalInfo.handleTypes = VK_EXTERNAL_MEMORY_HANDLE_TYPE_HOST_ALLOCATION_BIT_EXT;
+	VkBufferCreateInfo createInfo{ VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO };
+	createInfo.pNext = &externalInfo;
+	SetSharingMode(Context, createInfo);
+	createInfo.size = size;
+	createInfo.usage = BUFFER_USAGE;
+	VkBuffer buffer;
+	if (vkCreateBuffer(Context->Device, &createInfo, Context->AllocationCallbacks, &buffer) != VK_SUCCESS)
+		return nullptr;
+
+	// Coherent memory only, so the wrapped memory never has to be flushed
+	VkMemoryRequirements requirements;
+	vkGetBufferMemoryRequirements(Context->Device, buffer, &requirements);
+	uint32_t typeBits = requirements.memoryTypeBits & pointerProperties.memoryTypeBits;
+	uint32_t typeIndex = UINT32_MAX;
+	for (uint32_t i = 0; i < Context->Properties.memoryTypeCount; i++) {
+		if ((typeBits & (1u << i)) && (Context->Properties.memoryTypes[i].propertyFlags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT)) {
+			typeIndex = i;
+			break;
+		}
+	}
+	if (typeIndex == UINT32_MAX || requirements.size > size) {
+		vkDestroyBuffer(Context->Device, buffer, Context->AllocationCallbacks);
+		return nullptr;
+	}
+
+	VkImportMemoryHostPointerInfoEXT importInfo{ VK_STRUCTURE_TYPE_IMPORT_MEMORY_HOST_POINTER_INFO_EXT };
+	importInfo.handleType = VK_EXTERNAL_MEMORY_HANDLE_TYPE_HOST_ALLOCATION_BIT_EXT;
+	importInfo.pHostPointer = hostMemory;
+	VkMemoryAllocateInfo allocateInfo{ VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO };
+	allocateInfo.pNext = &importInfo;
+	allocateInfo.allocationSize = size;
+	allocateInfo.memoryTypeIndex = typeIndex;
+	VkDeviceMemory memory;
+	if (vkAllocateMemory(Context->Device, &allocateInfo, Context->AllocationCallbacks, &memory) != VK_SUCCESS) {
+		vkDestroyBuffer(Context->Device, buffer, Context->AllocationCallbacks);
+		return nullptr;
+	}
+	if (vkBindBufferMemory(Context->Device, buffer, memory, 0) != VK_SUCCESS) {
+		vkFreeMemory(Context->Device, memory, Context->AllocationCallbacks);
+		vkDestroyBuffer(Context->Device, buffer, Context->AllocationCallbacks);
+		return nullptr;
+	}
+
+	auto managedBuffer = new HA::ImplementationManagedBuffer{};
+	managedBuffer->Buffer = buffer;
+	managedBuffer->ImportedMemory = memory;
+	managedBuffer->HostPointer = hostMemory;
+	return managedBuffer;
+}
+
+HA::GPBuffer* HA::GPBuffer::WrapHostMemory(const ImplementationContext* Context, void* hostMemory, uint64_t size)
+{
+	auto imported = ImportHostMemory(Context, hostMemory, size);
+	if (imported)
+		return new GPBuffer(Context, imported, GPGPUMemoryType::Host, size);
+	if (Context->Logger)
+		Context->Logger->Print("Host memory could not be imported, it is copied into a Host buffer instead.\n");
+	auto buffer = new GPBuffer(Context, GPGPUMemoryType::Host, size);
+	buffer->Write(hostMemory, 0, size);
+	return buffer;
+}
+
+bool HA::GPBuffer::IsHostMemoryImported() const
+{
+	return Buffer->ImportedMemory != VK_NULL_HANDLE;
 }
 
 HA::GPBuffer::~GPBuffer()
 {
+	if (LastSubmission)
+		Context->_CommandThread->Wait(LastSubmission);
+	Context->_DescriptorAllocator->Invalidate((uint64_t)Buffer->Buffer);
 	if (MappedMemory)
 		UnmapBuffer();
-	vmaDestroyBuffer(Context->Allocator, Buffer->Buffer, Buffer->Allocation);
+	if (Buffer->ImportedMemory) {
+		vkDestroyBuffer(Context->Device, Buffer->Buffer, Context->AllocationCallbacks);
+		vkFreeMemory(Context->Device, Buffer->ImportedMemory, Context->AllocationCallbacks);
+		Context->_MemoryStatistics->Remove(MemoryType, false, Size);
+	}
+	else if (Buffer->Allocation) {
+		vmaDestroyBuffer(Context->Allocator, Buffer->Buffer, Buffer->Allocation);
+		Context->_MemoryStatistics->Remove(MemoryType, false, Buffer->AllocationInfo.size);
+	}
+	else {
+		vkDestroyBuffer(Context->Device, Buffer->Buffer, Context->AllocationCallbacks);
+	}
 	delete Buffer;
 }
 
 HA::GPBuffer* HA::GPBuffer::Clone(HA::GPGPUMemoryType memoryType)
 {
-	return new GPBuffer(Context, memoryType, Size);
+	return new GPBuffer(Context, memoryType, Size, Allocator);
 }
 
 HA::GPBuffer* HA::GPBuffer::Copy(HA::GPGPUMemoryType memoryType)
@@ -76,8 +260,16 @@ void* HA::GPBuffer::MapBuffer() {
 	if (MappedMemory)
 		return MappedMemory;
 	if (MemoryType == GPGPUMemoryType::Static) {
-		if (!MappedMemory)
+		if (DirtyTracking != GPDirtyTracking::Disabled) {
+			Dirty = new DirtyPageTracker(Size, DirtyTracking == GPDirtyTracking::Automatic);
+			MappedMemory = Dirty->Data;
+		}
+		else {
 			MappedMemory = new char[Size];
+		}
+	}
+	else if (Buffer->ImportedMemory) {
+		MappedMemory = Buffer->HostPointer;
 	}
 	else {
 		vmaMapMemory(Context->Allocator, Buffer->Allocation, &MappedMemory);
@@ -88,9 +280,15 @@ void* HA::GPBuffer::MapBuffer() {
 void HA::GPBuffer::UnmapBuffer()
 {
 	if (MemoryType == GPGPUMemoryType::Static) {
-		delete[] MappedMemory;
+		if (Dirty) {
+			delete Dirty;
+			Dirty = nullptr;
+		}
+		else {
+			delete[] (char*)MappedMemory;
+		}
 	}
-	else {
+	else if (!Buffer->ImportedMemory) {
 		vmaUnmapMemory(Context->Allocator, Buffer->Allocation);
 	}
 	MappedMemory = nullptr;
@@ -100,6 +298,7 @@ void HA::GPBuffer::Write(void* Data, uint64_t offset, uint64_t size)
 {
 	assert((offset + size) <= Size);
 	if (MemoryType != GPGPUMemoryType::Static) {
+		Context->_CommandThread->Wait(LastSubmission);
 		bool unmap = !MappedMemory;
 		if (!MappedMemory)
 			MapBuffer();
@@ -107,75 +306,301 @@ void HA::GPBuffer::Write(void* Data, uint64_t offset, uint64_t size)
 			throw std::runtime_error("Error Mapping Buffer.");
 		}
 		memcpy(((char*)MappedMemory) + offset, Data, size);
-		vmaFlushAllocation(Context->Allocator, Buffer->Allocation, offset, size);
+		FlushMapped(offset, size);
 		if (unmap)
 			UnmapBuffer();
 	}
 	else {
-		//assert(0);
-		auto cmd = Context->_CommandThread->GenCmd();
-		auto fence = Context->_CommandThread->GenFence();
+		auto thread = GetCopyThread(Context, { LastSubmission });
+		auto cmd = thread->GenCmd();
+		uint32_t scope = Context->_Profiler->Begin(cmd, "GPBuffer::Write");
 		VkBufferCopy copy{};
 		copy.dstOffset = offset;
 		copy.size = size;
-		auto stage = new GPBuffer(Context, GPGPUMemoryType::Host, size);
+		auto stage = Context->_StagingPool->Acquire(size);
 		stage->Write(Data, 0, size);
+		BarrierBatch barriers(Context, cmd);
+		barriers.Access(this, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT);
+		barriers.Record();
 		vkCmdCopyBuffer(cmd, stage->Buffer->Buffer, Buffer->Buffer, 1, &copy);
-		Context->_CommandThread->Execute(cmd, fence, true);
-		Context->_CommandThread->ReleaseFence(fence);
-		delete stage;
+		Context->_Profiler->End(cmd, scope);
+		Context->_StagingPool->Release(cmd, stage);
+		LastSubmission = thread->Submit(cmd);
 	}
 }
 
 void HA::GPBuffer::WriteAsync(void* Data, uint64_t offset, uint64_t size) {
 	if (MemoryType != GPGPUMemoryType::Static) {
+		Context->_CommandThread->Wait(LastSubmission);
 		bool unmap = !MappedMemory;
 		MapBuffer();
 		assert(MappedMemory);
 		memcpy((char*)MappedMemory + offset, Data, size);
-		vmaFlushAllocation(Context->Allocator, Buffer->Allocation, offset, size);
+		FlushMapped(offset, size);
 		if (unmap)
 			UnmapBuffer();
 	}
 	else {
-		auto cmd = Context->_CommandThread->GetCmd();
-		auto stage = new GPBuffer(Context, GPGPUMemoryType::Host, size);
-		char* stagemem = (char*)stage->MapBuffer();
-		memcpy(stagemem, Data, size);
+		auto stage = Context->_StagingPool->Acquire(size);
+		stage->Write(Data, 0, size);
+		CommandThread::Batch batch(GetBatchThread(Context, LastSubmission));
+		auto cmd = batch.Cmd;
+		uint32_t scope = Context->_Profiler->Begin(cmd, "GPBuffer::WriteAsync");
 		VkBufferCopy region{};
 		region.dstOffset = offset;
 		region.size = size;
+		BarrierBatch barriers(Context, cmd);
+		barriers.Access(this, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT);
+		barriers.Record();
 		vkCmdCopyBuffer(cmd, stage->Buffer->Buffer, Buffer->Buffer, 1, &region);
-		std::function<void()> func = [stage]() {
-			delete stage;
-		};
-		Context->_CommandThread->AddPostExectute(func);
+		Context->_Profiler->End(cmd, scope);
+		Context->_StagingPool->Release(cmd, stage);
+		LastSubmission = batch.Ticket;
 	}
 }
 
-void HA::GPBuffer::StoreToDisk(const char* FileName)
+void HA::GPBuffer::WriteAsync(const std::vector<GPBufferRegion>& regions)
 {
-	bool unmapFlag = !MappedMemory;
-	if (MappedMemory)
+	if (MemoryType != GPGPUMemoryType::Static) {
+		Context->_CommandThread->Wait(LastSubmission);
+		bool unmap = !MappedMemory;
 		MapBuffer();
-	SyncRead();
-	if (!MappedMemory) {
+		assert(MappedMemory);
+		for (auto& region : regions) {
+			assert((region.Offset + region.Size) <= Size);
+			if (region.Size == 0)
+				continue;
+			memcpy((char*)MappedMemory + region.Offset, region.Data, region.Size);
+			FlushMapped(region.Offset, region.Size);
+		}
+		if (unmap)
+			UnmapBuffer();
 		return;
 	}
-	FILE* io = fopen(FileName, "wb");
-	assert(io);
-	fwrite(MappedMemory, 1, Size, io);
-	fclose(io);
-	if (unmapFlag)
-		UnmapBuffer();
 
+	CommandThread::Batch batch(GetBatchThread(Context, LastSubmission));
+	auto cmd = batch.Cmd;
+	uint32_t scope = Context->_Profiler->Begin(cmd, "GPBuffer::WriteAsync");
+	RecordWrite(cmd, regions);
+	Context->_Profiler->End(cmd, scope);
+	LastSubmission = batch.Ticket;
+}
+
+void HA::GPBuffer::RecordWrite(VkCommandBuffer cmd, const std::vector<GPBufferRegion>& regions)
+{
+	// Merge overlapping and adjacent writes into spans, each span is one copy region
+	struct Span {
+		uint64_t Begin;
+		uint64_t End;
+		uint64_t StageOffset;
+	};
+	std::vector<uint32_t> order(regions.size());
+	std::iota(order.begin(), order.end(), 0);
+	std::sort(order.begin(), order.end(), [&regions](uint32_t a, uint32_t b) {
+		return regions[a].Offset < regions[b].Offset;
+	});
+	std::vector<Span> spans;
+	std::vector<size_t> spanOf(regions.size());
+	for (auto i : order) {
+		auto& region = regions[i];
+		assert((region.Offset + region.Size) <= Size);
+		if (region.Size == 0)
+			continue;
+		if (spans.empty() || region.Offset > spans.back().End)
+			spans.push_back({ region.Offset, region.Offset + region.Size, 0 });
+		else
+			spans.back().End = std::max(spans.back().End, region.Offset + region.Size);
+		spanOf[i] = spans.size() - 1;
+	}
+	if (spans.empty())
+		return;
+	uint64_t stageSize = 0;
+	for (auto& span : spans) {
+		span.StageOffset = stageSize;
+		stageSize += span.End - span.Begin;
+	}
+
+	auto stage = Context->_StagingPool->Acquire(stageSize);
+	char* staging = (char*)stage->MapBuffer();
+	// In list order so later regions overwrite earlier ones
+	for (size_t i = 0; i < regions.size(); i++) {
+		if (regions[i].Size == 0)
+			continue;
+		auto& span = spans[spanOf[i]];
+		memcpy(staging + span.StageOffset + (regions[i].Offset - span.Begin), regions[i].Data, regions[i].Size);
+	}
+	stage->SyncWrite(0, stageSize);
+	std::vector<VkBufferCopy> copies;
+	copies.reserve(spans.size());
+	for (auto& span : spans)
+		copies.push_back({ span.StageOffset, span.Begin, span.End - span.Begin });
+	BarrierBatch barriers(Context, cmd);
+	barriers.Access(this, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT);
+	barriers.Record();
+	vkCmdCopyBuffer(cmd, stage->Buffer->Buffer, Buffer->Buffer, (uint32_t)copies.size(), copies.data());
+	Context->_StagingPool->Release(cmd, stage);
+}
+
+void HA::GPBuffer::FlushMapped(uint64_t offset, uint64_t size)
+{
+	// Imported host memory is always coherent
+	if (!Buffer->ImportedMemory)
+		vmaFlushAllocation(Context->Allocator, Buffer->Allocation, offset, size);
+}
+
+void HA::GPBuffer::InvalidateMapped(uint64_t offset, uint64_t size)
+{
+	if (!Buffer->ImportedMemory)
+		vmaInvalidateAllocation(Context->Allocator, Buffer->Allocation, offset, size);
+}
+
+void HA::GPBuffer::StoreToDisk(const char* FileName)
+{
+	StoreToFile(FileName);
+}
+
+bool HA::GPBuffer::LoadFromFile(const char* FileName, uint64_t offset)
+{
+	assert(offset <= Size);
+	MappedFile file(FileName, false);
+	if (!file.IsOpen())
+		return false;
+	uint64_t size = std::min(file.Size, Size - offset);
+	if (size == 0)
+		return true;
+
+	if (MemoryType != GPGPUMemoryType::Static) {
+		Context->_CommandThread->Wait(LastSubmission);
+		bool unmap = !MappedMemory;
+		MapBuffer();
+		if (!MappedMemory)
+			throw std::runtime_error("Error Mapping Buffer.");
+		memcpy((char*)MappedMemory + offset, file.Data, size);
+		FlushMapped(offset, size);
+		if (unmap)
+			UnmapBuffer();
+		return true;
+	}
+
+	// Chunk k is copied on the GPU while chunk k + 1 is read into the other staging buffer
+	auto thread = GetCopyThread(Context, { LastSubmission });
+	GPBuffer* stages[2] = {};
+	CommandTicket tickets[2] = {};
+	for (uint64_t done = 0, k = 0; done < size; done += STREAM_CHUNK_SIZE, k++) {
+		uint32_t slot = k % 2;
+		uint64_t chunk = std::min<uint64_t>(STREAM_CHUNK_SIZE, size - done);
+		if (stages[slot])
+			Context->_CommandThread->Wait(tickets[slot]);
+		else
+			stages[slot] = Context->_StagingPool->Acquire(std::min<uint64_t>(STREAM_CHUNK_SIZE, size));
+		memcpy(stages[slot]->MapBuffer(), file.Data + done, chunk);
+		stages[slot]->SyncWrite(0, chunk);
+
+		auto cmd = thread->GenCmd();
+		uint32_t scope = Context->_Profiler->Begin(cmd, "GPBuffer::LoadFromFile");
+		VkBufferCopy region{};
+		region.dstOffset = offset + done;
+		region.size = chunk;
+		BarrierBatch barriers(Context, cmd);
+		barriers.Access(this, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT);
+		barriers.Record();
+		vkCmdCopyBuffer(cmd, stages[slot]->Buffer->Buffer, Buffer->Buffer, 1, &region);
+		Context->_Profiler->End(cmd, scope);
+		tickets[slot] = thread->Submit(cmd);
+		LastSubmission = tickets[slot];
+	}
+	for (uint32_t slot = 0; slot < 2; slot++) {
+		if (!stages[slot])
+			continue;
+		Context->_CommandThread->Wait(tickets[slot]);
+		Context->_StagingPool->Release(stages[slot]);
+	}
+	return true;
+}
+
+bool HA::GPBuffer::StoreToFile(const char* FileName)
+{
+	MappedFile file(FileName, true, Size);
+	if (!file.IsOpen())
+		return false;
+	if (Size == 0)
+		return true;
+
+	if (MemoryType != GPGPUMemoryType::Static) {
+		Context->_CommandThread->Wait(LastSubmission);
+		bool unmap = !MappedMemory;
+		MapBuffer();
+		if (!MappedMemory)
+			throw std::runtime_error("Error Mapping Buffer.");
+		InvalidateMapped(0, Size);
+		memcpy(file.Data, MappedMemory, Size);
+		if (unmap)
+			UnmapBuffer();
+		return true;
+	}
+
+	auto thread = GetCopyThread(Context, { LastSubmission });
+	GPBuffer* stages[2] = {};
+	CommandTicket tickets[2] = {};
+	auto download = [&](uint32_t slot, uint64_t begin) {
+		if (!stages[slot])
+			stages[slot] = Context->_StagingPool->Acquire(std::min<uint64_t>(STREAM_CHUNK_SIZE, Size));
+		auto cmd = thread->GenCmd();
+		uint32_t scope = Context->_Profiler->Begin(cmd, "GPBuffer::StoreToFile");
+		VkBufferCopy region{};
+		region.srcOffset = begin;
+		region.size = std::min<uint64_t>(STREAM_CHUNK_SIZE, Size - begin);
+		BarrierBatch barriers(Context, cmd);
+		barriers.Access(this, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_READ_BIT);
+		barriers.Access(stages[slot], VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT);
+		barriers.Record();
+		vkCmdCopyBuffer(cmd, Buffer->Buffer, stages[slot]->Buffer->Buffer, 1, &region);
+		barriers.Access(stages[slot], VK_PIPELINE_STAGE_HOST_BIT, VK_ACCESS_HOST_READ_BIT);
+		barriers.Record();
+		Context->_Profiler->End(cmd, scope);
+		tickets[slot] = thread->Submit(cmd);
+	};
+	// Chunk k + 1 is copied on the GPU while chunk k is written to the file
+	download(0, 0);
+	for (uint64_t done = 0, k = 0; done < Size; done += STREAM_CHUNK_SIZE, k++) {
+		uint32_t slot = k % 2;
+		uint64_t chunk = std::min<uint64_t>(STREAM_CHUNK_SIZE, Size - done);
+		if (done + chunk < Size)
+			download(1 - slot, done + chunk);
+		Context->_CommandThread->Wait(tickets[slot]);
+		stages[slot]->SyncRead(0, chunk);
+		memcpy(file.Data + done, stages[slot]->MapBuffer(), chunk);
+	}
+	for (auto stage : stages) {
+		if (stage)
+			Context->_StagingPool->Release(stage);
+	}
+	return true;
 }
 
 void HA::GPBuffer::SyncWrite(uint64_t offset, uint64_t size)
 {
-	size = size == 0 ? Size : size;
+	// Same range as SyncRead(), so Sync() covers both directions alike
+	size = size == 0 ? Size - offset : size;
+	assert((offset + size) <= Size);
 	if (MemoryType != GPGPUMemoryType::Static) {
-		vmaFlushAllocation(Context->Allocator, Buffer->Allocation, offset, size);
+		FlushMapped(offset, size);
+	}
+	else if (Dirty) {
+		std::vector<std::pair<uint64_t, uint64_t>> ranges;
+		Dirty->CollectDirty(offset, size, ranges);
+		if (ranges.empty())
+			return;
+		std::vector<GPBufferRegion> regions;
+		regions.reserve(ranges.size());
+		for (auto& [begin, end] : ranges)
+			regions.push_back({ (char*)MappedMemory + begin, begin, end - begin });
+		auto thread = GetCopyThread(Context, { LastSubmission });
+		auto cmd = thread->GenCmd();
+		uint32_t scope = Context->_Profiler->Begin(cmd, "GPBuffer::SyncWrite");
+		RecordWrite(cmd, regions);
+		Context->_Profiler->End(cmd, scope);
+		LastSubmission = thread->Submit(cmd);
 	}
 	else {
 		Write(((char*)MappedMemory) + offset, offset, size);
@@ -183,57 +608,369 @@ void HA::GPBuffer::SyncWrite(uint64_t offset, uint64_t size)
 }
 
 void HA::GPBuffer::SyncRead()
+{
+	SyncRead(0, 0);
+}
+
+void HA::GPBuffer::SyncRead(uint64_t offset, uint64_t size)
 {
 	assert(MappedMemory && "Buffer must be mapped to perform SyncRead()");
+	size = size == 0 ? Size - offset : size;
+	assert((offset + size) <= Size);
 	if (MemoryType != GPGPUMemoryType::Static) {
-		vmaInvalidateAllocation(Context->Allocator, Buffer->Allocation, 0, Size);
+		Context->_CommandThread->Wait(LastSubmission);
+		InvalidateMapped(offset, size);
 	}
 	else {
-		auto cmd = Context->_CommandThread->GenCmd();
-		auto fence = Context->_CommandThread->GenFence();
-		auto stage = new GPBuffer(Context, GPGPUMemoryType::Host, Size);
+		auto thread = GetCopyThread(Context, { LastSubmission });
+		auto cmd = thread->GenCmd();
+		uint32_t scope = Context->_Profiler->Begin(cmd, "GPBuffer::SyncRead");
+		auto stage = Context->_StagingPool->Acquire(size);
 		VkBufferCopy region{};
-		region.size = Size;
+		region.srcOffset = offset;
+		region.size = size;
+		BarrierBatch barriers(Context, cmd);
+		barriers.Access(this, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_READ_BIT);
+		barriers.Access(stage, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT);
+		barriers.Record();
 		vkCmdCopyBuffer(cmd, Buffer->Buffer, stage->Buffer->Buffer, 1, &region);
-		Context->_CommandThread->Execute(cmd, fence, true);
-		Context->_CommandThread->ReleaseFence(fence);
-		auto ptr = stage->MapBuffer();
-		memcpy(MappedMemory, ptr, Size);
-		stage->UnmapBuffer();
-		delete stage;
+		barriers.Access(stage, VK_PIPELINE_STAGE_HOST_BIT, VK_ACCESS_HOST_READ_BIT);
+		barriers.Record();
+		Context->_Profiler->End(cmd, scope);
+		thread->Execute(cmd);
+		stage->SyncRead();
+		if (Dirty)
+			Dirty->Overwrite(offset, stage->MapBuffer(), size);
+		else
+			memcpy((char*)MappedMemory + offset, stage->MapBuffer(), size);
+		Context->_StagingPool->Release(stage);
 	}
 }
 
 void HA::GPBuffer::Sync(uint64_t offset, uint64_t size)
 {
 	if (MemoryType != GPGPUMemoryType::Static) {
-		vmaFlushAllocation(Context->Allocator, Buffer->Allocation, 0, Size);
-		vmaInvalidateAllocation(Context->Allocator, Buffer->Allocation, 0, Size);
+		FlushMapped(0, Size);
+		InvalidateMapped(0, Size);
 	}
 	else {
 		SyncWrite(offset, size);
-		SyncRead();
+		SyncRead(offset, size);
 	}
 }
 
+void HA::GPBuffer::SetDirtyTracking(GPDirtyTracking mode)
+{
+	if (mode == DirtyTracking)
+		return;
+	DirtyTracking = mode;
+	if (MemoryType != GPGPUMemoryType::Static || !MappedMemory)
+		return;
+
+	// Move the mapped shadow over, pages of an untracked shadow all count as dirty
+	std::vector<std::pair<uint64_t, uint64_t>> ranges;
+	if (Dirty)
+		Dirty->CollectDirty(0, Size, ranges);
+	else
+		ranges.push_back({ 0, Size });
+	DirtyPageTracker* previous = Dirty;
+	void* previousMemory = MappedMemory;
+	Dirty = nullptr;
+	MappedMemory = nullptr;
+	MapBuffer();
+	if (Dirty) {
+		Dirty->Overwrite(0, previousMemory, Size);
+		for (auto& [begin, end] : ranges)
+			Dirty->MarkDirty(begin, end - begin);
+	}
+	else {
+		memcpy(MappedMemory, previousMemory, Size);
+	}
+	if (previous)
+		delete previous;
+	else
+		delete[] (char*)previousMemory;
+}
+
+void HA::GPBuffer::MarkDirty(uint64_t offset, uint64_t size)
+{
+	if (Dirty)
+		Dirty->MarkDirty(offset, size);
+}
+
+#pragma endregion
+
+#pragma region GPU Ring Buffer
+
+HA::GPRingBuffer::GPRingBuffer(const ImplementationContext* Context, const uint64_t size, const GPGPUMemoryType memoryType)
+	: Context(Context), Size(size), Buffer(new GPBuffer(Context, memoryType, size)), Head(0), Tail(0), FencedHead(0)
+{
+	if (memoryType == GPGPUMemoryType::Static) {
+		delete Buffer;
+		throw std::runtime_error("GPRingBuffer requires Stream or Host memory.");
+	}
+	MappedMemory = (char*)Buffer->MapBuffer();
+	if (!MappedMemory) {
+		delete Buffer;
+		throw std::runtime_error("Error Mapping Buffer.");
+	}
+}
+
+HA::GPRingBuffer::~GPRingBuffer()
+{
+	for (auto& region : Regions)
+		Context->_CommandThread->Wait(region.Ticket);
+	delete Buffer;
+}
+
+HA::GPRingAllocation HA::GPRingBuffer::Allocate(uint64_t size, uint64_t align)
+{
+	assert(size <= Size && "Allocation is larger than the ring buffer");
+	assert(align > 0 && (align & (align - 1)) == 0);
+	uint64_t offset = Head % Size;
+	uint64_t aligned = (offset + align - 1) & ~(align - 1);
+	// Never split an allocation across the end of the buffer, skip to the start instead.
+	uint64_t begin = aligned + size > Size ? Head - offset + Size : Head + (aligned - offset);
+	uint64_t end = begin + size;
+
+	// Reclaim whatever has already completed without blocking.
+	while (Regions.size() > 0 && Context->_CommandThread->Poll(Regions.front().Ticket)) {
+		Tail = Regions.front().End;
+		Regions.pop_front();
+	}
+	while (end - Tail > Size) {
+		if (Tail == Head) {
+			// Nothing is in use, the skipped bytes do not need to be reclaimed.
+			Tail = begin;
+			break;
+		}
+		if (Regions.size() == 0)
+			throw std::runtime_error("GPRingBuffer is full, call Fence() after submitting the work that uses it.");
+		Context->_CommandThread->Wait(Regions.front().Ticket);
+		Tail = Regions.front().End;
+		Regions.pop_front();
+	}
+
+	Head = end;
+	GPRingAllocation allocation{};
+	allocation.CpuPtr = MappedMemory + (begin % Size);
+	allocation.GpuOffset = begin % Size;
+	allocation.Size = size;
+	return allocation;
+}
+
+void HA::GPRingBuffer::Fence(CommandTicket ticket)
+{
+	if (Head == FencedHead)
+		return;
+	Flush(FencedHead, Head);
+	Regions.push_back({ ticket, Head });
+	FencedHead = Head;
+}
+
+void HA::GPRingBuffer::Flush(uint64_t begin, uint64_t end)
+{
+	uint64_t first = begin % Size;
+	if (end - begin >= Size) {
+		vmaFlushAllocation(Context->Allocator, Buffer->Buffer->Allocation, 0, Size);
+	}
+	else if (first + (end - begin) > Size) {
+		vmaFlushAllocation(Context->Allocator, Buffer->Buffer->Allocation, first, Size - first);
+		vmaFlushAllocation(Context->Allocator, Buffer->Buffer->Allocation, 0, end % Size);
+	}
+	else {
+		vmaFlushAllocation(Context->Allocator, Buffer->Buffer->Allocation, first, end - begin);
+	}
+}
+
+HA::GPArena::GPArena(const ImplementationContext* Context, const uint64_t blockSize, const GPGPUMemoryType memoryType)
+	: Context(Context), BlockSize(blockSize), MemoryType(memoryType), Offset(0)
+{
+	VkPhysicalDeviceProperties properties;
+	vkGetPhysicalDeviceProperties(Context->PhysicalDevice, &properties);
+	Alignment = std::max<uint64_t>({ 16, properties.limits.minStorageBufferOffsetAlignment, properties.limits.minUniformBufferOffsetAlignment });
+}
+
+HA::GPArena::~GPArena()
+{
+	for (auto& retired : Retired) {
+		Context->_CommandThread->Wait(retired.Ticket);
+		delete retired.Block;
+	}
+	for (auto block : Pending)
+		delete block;
+	for (auto block : Free)
+		delete block;
+}
+
+HA::GPArenaAllocation HA::GPArena::Allocate(uint64_t size)
+{
+	if (size > BlockSize)
+		throw std::runtime_error("HA::GPArena Allocation is larger than the block size.");
+	uint64_t aligned = (Offset + Alignment - 1) / Alignment * Alignment;
+	if (Pending.empty() || aligned + size > BlockSize) {
+		NextBlock();
+		aligned = 0;
+	}
+	Offset = aligned + size;
+	return { Pending.back(), aligned, size };
+}
+
+void HA::GPArena::Release(CommandTicket ticket)
+{
+	for (auto block : Pending)
+		Retired.push_back({ ticket, block });
+	Pending.clear();
+	Offset = 0;
+}
+
+void HA::GPArena::NextBlock()
+{
+	// Reclaim blocks of completed batches without blocking, they retire in order
+	while (Retired.size() > 0 && Context->_CommandThread->Poll(Retired.front().Ticket)) {
+		Free.push_back(Retired.front().Block);
+		Retired.pop_front();
+	}
+	if (Free.size() > 0) {
+		Pending.push_back(Free.back());
+		Free.pop_back();
+	}
+	else {
+		Pending.push_back(new GPBuffer(Context, MemoryType, BlockSize));
+	}
+	Offset = 0;
+}
+
 #pragma endregion
 
 #pragma region GPU Image
 #define IMAGE_ASPECT (VK_IMAGE_ASPECT_COLOR_BIT)
 
+// Bytes per texel of the uncompressed color formats, 0 for the rest
+static uint32_t GetTexelSize(VkFormat format)
+{
+	switch (format) {
+	case VK_FORMAT_R8_UNORM: case VK_FORMAT_R8_SNORM: case VK_FORMAT_R8_UINT: case VK_FORMAT_R8_SINT: case VK_FORMAT_R8_SRGB:
+		return 1;
+	case VK_FORMAT_R8G8_UNORM: case VK_FORMAT_R8G8_SNORM: case VK_FORMAT_R8G8_UINT: case VK_FORMAT_R8G8_SINT: case VK_FORMAT_R8G8_SRGB:
+	case VK_FORMAT_R16_UNORM: case VK_FORMAT_R16_SNORM: case VK_FORMAT_R16_UINT: case VK_FORMAT_R16_SINT: case VK_FORMAT_R16_SFLOAT:
+		return 2;
+	case VK_FORMAT_R8G8B8_UNORM: case VK_FORMAT_R8G8B8_SRGB: case VK_FORMAT_B8G8R8_UNORM: case VK_FORMAT_B8G8R8_SRGB:
+		return 3;
+	case VK_FORMAT_R8G8B8A8_UNORM: case VK_FORMAT_R8G8B8A8_SNORM: case VK_FORMAT_R8G8B8A8_UINT: case VK_FORMAT_R8G8B8A8_SINT:
+	case VK_FORMAT_R8G8B8A8_SRGB: case VK_FORMAT_B8G8R8A8_UNORM: case VK_FORMAT_B8G8R8A8_SRGB:
+	case VK_FORMAT_R16G16_UNORM: case VK_FORMAT_R16G16_SNORM: case VK_FORMAT_R16G16_UINT: case VK_FORMAT_R16G16_SINT: case VK_FORMAT_R16G16_SFLOAT:
+	case VK_FORMAT_R32_UINT: case VK_FORMAT_R32_SINT: case VK_FORMAT_R32_SFLOAT:
+	case VK_FORMAT_B10G11R11_UFLOAT_PACK32: case VK_FORMAT_A2B10G10R10_UNORM_PACK32: case VK_FORMAT_A2R10G10B10_UNORM_PACK32:
+		return 4;
+	case VK_FORMAT_R16G16B16_UNORM: case VK_FORMAT_R16G16B16_SFLOAT:
+		return 6;
+	case VK_FORMAT_R16G16B16A16_UNORM: case VK_FORMAT_R16G16B16A16_SNORM: case VK_FORMAT_R16G16B16A16_UINT: case VK_FORMAT_R16G16B16A16_SINT:
+	case VK_FORMAT_R16G16B16A16_SFLOAT: case VK_FORMAT_R32G32_UINT: case VK_FORMAT_R32G32_SINT: case VK_FORMAT_R32G32_SFLOAT:
+		return 8;
+	case VK_FORMAT_R32G32B32_UINT: case VK_FORMAT_R32G32B32_SINT: case VK_FORMAT_R32G32B32_SFLOAT:
+		return 12;
+	case VK_FORMAT_R32G32B32A32_UINT: case VK_FORMAT_R32G32B32A32_SINT: case VK_FORMAT_R32G32B32A32_SFLOAT:
+		return 16;
+	default:
+		return 0;
+	}
+}
+
 void HA::GPImage::Write(uint32_t SizeInBytes, uint8_t* PixelData)
 {
-	GPBuffer* stage = new GPBuffer(Context, GPGPUMemoryType::Host, SizeInBytes);
+	GPBuffer* stage = Context->_StagingPool->Acquire(SizeInBytes);
 	stage->Write(PixelData, 0, SizeInBytes);
-	Write(stage);
-	delete stage;
+	auto thread = GetCopyThread(Context, { LastSubmission });
+	auto cmd = thread->GenCmd();
+	uint32_t scope = Context->_Profiler->Begin(cmd, "GPImage::Write");
+	RecordWrite(cmd, stage);
+	Context->_Profiler->End(cmd, scope);
+	Context->_StagingPool->Release(cmd, stage);
+	LastSubmission = thread->Submit(cmd);
 }
 
 void HA::GPImage::Write(GPBuffer* buffer)
 {
-	auto cmd = Context->_CommandThread->GenCmd();
-	auto fence = Context->_CommandThread->GenFence();
-	TransitionImage(cmd, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+	auto thread = GetCopyThread(Context, { LastSubmission, buffer->LastSubmission });
+	auto cmd = thread->GenCmd();
+	uint32_t scope = Context->_Profiler->Begin(cmd, "GPImage::Write");
+	RecordWrite(cmd, buffer);
+	Context->_Profiler->End(cmd, scope);
+	LastSubmission = thread->Submit(cmd);
+	buffer->LastSubmission = LastSubmission;
+}
+
+void HA::GPImage::Write(const std::vector<GPImageRegion>& regions)
+{
+	if (regions.empty())
+		return;
+	// Rows may be padded, so the texel size comes from the format and not from BufferRowLength
+	uint32_t pixelSize = GetTexelSize(Format);
+	if (pixelSize == 0)
+		throw std::runtime_error("HA::GPImage Region writes do not support format " + std::to_string(Format) + ".");
+	// bufferOffset must be a multiple of both the texel size and 4
+	uint64_t align = pixelSize * 4;
+	std::vector<VkBufferImageCopy> copies;
+	copies.reserve(regions.size());
+	uint64_t stageSize = 0;
+	for (auto& region : regions) {
+		assert(region.Offset.x + region.Extent.width <= Size.width);
+		assert(region.Offset.y + region.Extent.height <= Size.height);
+		assert(region.Offset.z + region.Extent.depth <= Size.depth);
+		stageSize = (stageSize + align - 1) / align * align;
+		VkBufferImageCopy copy{};
+		copy.bufferOffset = stageSize;
+		copy.imageSubresource.aspectMask = IMAGE_ASPECT;
+		copy.imageSubresource.layerCount = 1;
+		copy.imageOffset = region.Offset;
+		copy.imageExtent = region.Extent;
+		copies.push_back(copy);
+		stageSize += (uint64_t)region.Extent.width * pixelSize * region.Extent.height * region.Extent.depth;
+	}
+
+	GPBuffer* stage = Context->_StagingPool->Acquire(stageSize);
+	char* staging = (char*)stage->MapBuffer();
+	for (size_t i = 0; i < regions.size(); i++) {
+		auto& region = regions[i];
+		uint64_t rowSize = (uint64_t)region.Extent.width * pixelSize;
+		uint64_t pitch = region.RowLengthInBytes ? region.RowLengthInBytes : rowSize;
+		char* dst = staging + copies[i].bufferOffset;
+		const char* src = (const char*)region.Data;
+		if (pitch == rowSize) {
+			memcpy(dst, src, rowSize * region.Extent.height * region.Extent.depth);
+			continue;
+		}
+		for (uint64_t row = 0; row < (uint64_t)region.Extent.height * region.Extent.depth; row++)
+			memcpy(dst + row * rowSize, src + row * pitch, rowSize);
+	}
+	stage->SyncWrite(0, stageSize);
+
+	// Regions are not aligned to the transfer family's image granularity. Either way writes still
+	// recorded by another thread are submitted first, GetCopyThread() flushes them.
+	auto thread = Context->_CommandThread;
+	if (Context->TransferImageGranularity)
+		thread = GetCopyThread(Context, { LastSubmission });
+	else
+		thread->Flush(LastSubmission);
+	auto cmd = thread->GenCmd();
+	uint32_t scope = Context->_Profiler->Begin(cmd, "GPImage::Write");
+	BarrierBatch barriers(Context, cmd);
+	barriers.Access(this, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 0, 1);
+	barriers.Record();
+	vkCmdCopyBufferToImage(cmd, stage->Buffer->Buffer, Image->Image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+		(uint32_t)copies.size(), copies.data());
+	Context->_Profiler->End(cmd, scope);
+	Context->_StagingPool->Release(cmd, stage);
+	LastSubmission = thread->Submit(cmd);
+}
+
+void HA::GPImage::RecordWrite(VkCommandBuffer cmd, GPBuffer* buffer)
+{
+	BarrierBatch barriers(Context, cmd);
+	barriers.Access(this, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 0, 1);
+	barriers.Access(buffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_READ_BIT);
+	barriers.Record();
 	VkBufferImageCopy region{};
 	region.imageSubresource.aspectMask = IMAGE_ASPECT;
 	region.imageSubresource.baseArrayLayer = 0;
@@ -241,9 +978,6 @@ void HA::GPImage::Write(GPBuffer* buffer)
 	region.imageSubresource.mipLevel = 0;
 	region.imageExtent = Size;
 	vkCmdCopyBufferToImage(cmd, buffer->Buffer->Buffer, Image->Image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
-	TransitionImage(cmd, VK_IMAGE_LAYOUT_GENERAL);
-	Context->_CommandThread->Execute(cmd, fence, true);
-	Context->_CommandThread->ReleaseFence(fence);
 }
 
 void HA::GPImage::ReadBack(GPBuffer** OutBuffer, GPGPUMemoryType MemoryType)
@@ -255,9 +989,36 @@ void HA::GPImage::ReadBack(GPBuffer** OutBuffer, GPGPUMemoryType MemoryType)
 			Context->Logger->Print("Cannot readback image because buffer allocation failed.");
 		}
 	}
-	auto cmd = Context->_CommandThread->GenCmd();
-	auto fence = Context->_CommandThread->GenFence();
-	TransitionImage(cmd, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL);
+	auto thread = GetCopyThread(Context, { LastSubmission });
+	auto cmd = thread->GenCmd();
+	uint32_t scope = Context->_Profiler->Begin(cmd, "GPImage::ReadBack");
+	RecordReadBack(cmd, buffer);
+	Context->_Profiler->End(cmd, scope);
+	thread->Execute(cmd);
+	*OutBuffer = buffer;
+}
+
+HA::CommandTicket HA::GPImage::ReadBackAsync(GPBuffer* buffer)
+{
+	assert(buffer);
+	if (buffer->Size < (uint64_t)BufferRowLength * Size.height)
+		throw std::runtime_error("HA::GPImage Readback buffer is smaller than the image.");
+	auto thread = GetCopyThread(Context, { LastSubmission, buffer->LastSubmission });
+	auto cmd = thread->GenCmd();
+	uint32_t scope = Context->_Profiler->Begin(cmd, "GPImage::ReadBackAsync");
+	RecordReadBack(cmd, buffer);
+	Context->_Profiler->End(cmd, scope);
+	LastSubmission = thread->Submit(cmd);
+	buffer->LastSubmission = LastSubmission;
+	return LastSubmission;
+}
+
+void HA::GPImage::RecordReadBack(VkCommandBuffer cmd, GPBuffer* buffer)
+{
+	BarrierBatch barriers(Context, cmd);
+	barriers.Access(this, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_READ_BIT, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, 0, 1);
+	barriers.Access(buffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT);
+	barriers.Record();
 	VkBufferImageCopy region{};
 	region.imageSubresource.aspectMask = IMAGE_ASPECT;
 	region.imageSubresource.baseArrayLayer = 0;
@@ -265,10 +1026,11 @@ void HA::GPImage::ReadBack(GPBuffer** OutBuffer, GPGPUMemoryType MemoryType)
 	region.imageSubresource.mipLevel = 0;
 	region.imageExtent = Size;
 	vkCmdCopyImageToBuffer(cmd, Image->Image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, buffer->Buffer->Buffer, 1, &region);
-	TransitionImage(cmd, ReadOnly ? VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL : VK_IMAGE_LAYOUT_GENERAL);
-	Context->_CommandThread->Execute(cmd, fence, true);
-	Context->_CommandThread->ReleaseFence(fence);
-	*OutBuffer = buffer;
+	// Host visible buffers are read by the host once the copy retired
+	if (buffer->MemoryType != GPGPUMemoryType::Static) {
+		barriers.Access(buffer, VK_PIPELINE_STAGE_HOST_BIT, VK_ACCESS_HOST_READ_BIT);
+		barriers.Record();
+	}
 }
 
 HA::GPImage* HA::GPImage::Clone(GPGPUMemoryType memoryType)
@@ -301,50 +1063,74 @@ HA::GPImage* HA::GPImage::Copy(GPGPUMemoryType memoryType)
 
 void HA::GPImage::OptimizeShaderAccess(bool ReadOnly)
 {
+	Context->_CommandThread->Flush(LastSubmission);
 	auto cmd = Context->_CommandThread->GenCmd();
-	auto fence = Context->_CommandThread->GenFence();
-	TransitionImage(cmd, ReadOnly ? VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL : VK_IMAGE_LAYOUT_GENERAL);
-	Context->_CommandThread->Execute(cmd, fence, true);
-	Context->_CommandThread->ReleaseFence(fence);
+	BarrierBatch barriers(Context, cmd);
+	barriers.Access(this, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT,
+		ReadOnly ? VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL : VK_IMAGE_LAYOUT_GENERAL);
+	barriers.Record();
+	LastSubmission = Context->_CommandThread->Submit(cmd);
 	this->ReadOnly = ReadOnly;
 }
 
-void HA::GPImage::TransitionImage(VkCommandBuffer cmd, VkImageLayout layout)
+void HA::GPImage::GenerateMipmap(GPMipFilter filter)
 {
-	VkImageMemoryBarrier barrier{ VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER };
-	barrier.srcAccessMask = 0;
-	barrier.dstAccessMask = VK_ACCESS_MEMORY_WRITE_BIT;
-	barrier.oldLayout = CurrentLayout;
-	barrier.newLayout = layout;
-	barrier.srcQueueFamilyIndex = barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-	barrier.image = Image->Image;
-	barrier.subresourceRange.aspectMask = IMAGE_ASPECT;
-	barrier.subresourceRange.baseArrayLayer = 0;
-	barrier.subresourceRange.layerCount = VK_REMAINING_ARRAY_LAYERS;
-	barrier.subresourceRange.baseMipLevel = 0;
-	barrier.subresourceRange.levelCount = VK_REMAINING_MIP_LEVELS;
-	vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_ALL_GRAPHICS_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier);
-	CurrentLayout = layout;
+	if (Mipcount < 2)
+		return;
+	Context->_CommandThread->Flush(LastSubmission);
+	CommandThread::Batch batch(Context->_CommandThread);
+	auto cmd = batch.Cmd;
+	uint32_t scope = Context->_Profiler->Begin(cmd, "GPImage::GenerateMipmap");
+	LastSubmission = batch.Ticket;
+	if (!Context->_MipGenerator->Record(cmd, this, filter, LastSubmission)) {
+		if (filter == GPMipFilter::Kaiser && Context->Logger)
+			Context->Logger->Print("HA::GPImage Kaiser mipmaps need a 2D storage image format, using a linear blit instead.\n");
+		RecordBlitMipmap(cmd);
+	}
+	Context->_Profiler->End(cmd, scope);
 }
 
-HA::GPImage::GPImage(
-	const ImplementationContext* Context,
-	const VkFormat format,
-	const VkImageType type,
-	const VkExtent3D size,
-	const uint32_t RowLengthInBytes,
-	const int Mipcount,
-	const GPGPUMemoryType memoryType)
-	: Context(Context), MemoryType(memoryType), Format(format), ImageType(type),
-	Size(size), BufferRowLength(RowLengthInBytes), Mipcount(Mipcount), CurrentLayout(VK_IMAGE_LAYOUT_UNDEFINED),
-	ReadOnly(false)
+void HA::GPImage::RecordBlitMipmap(VkCommandBuffer cmd)
 {
-	auto image = new ImplementationManagedImage;
-	VkImageCreateInfo createInfo{ VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO };
+	VkFormatProperties properties;
+	vkGetPhysicalDeviceFormatProperties(Context->PhysicalDevice, Format, &properties);
+	const VkFormatFeatureFlags blit = VK_FORMAT_FEATURE_BLIT_SRC_BIT | VK_FORMAT_FEATURE_BLIT_DST_BIT;
+	if ((properties.optimalTilingFeatures & blit) != blit)
+		throw std::runtime_error("HA::GPImage Format can neither be written by compute nor blitted, cannot generate mipmaps.");
+	VkFilter filter = properties.optimalTilingFeatures & VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT ? VK_FILTER_LINEAR : VK_FILTER_NEAREST;
+
+	// Level 0 is the first source, every level written is the source of the next one
+	BarrierBatch barriers(Context, cmd);
+	barriers.Access(this, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_READ_BIT, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, 0, 1);
+	barriers.Access(this, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, Mipcount - 1);
+	auto extent = [this](uint32_t level) {
+		return VkOffset3D{ (int32_t)std::max(Size.width >> level, 1u), (int32_t)std::max(Size.height >> level, 1u), (int32_t)std::max(Size.depth >> level, 1u) };
+	};
+	for (uint32_t level = 1; level < (uint32_t)Mipcount; level++) {
+		if (level > 1)
+			barriers.Access(this, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_READ_BIT, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, level - 1, 1);
+		barriers.Record();
+		VkImageBlit region{};
+		region.srcSubresource = { IMAGE_ASPECT, level - 1, 0, 1 };
+		region.srcOffsets[1] = extent(level - 1);
+		region.dstSubresource = { IMAGE_ASPECT, level, 0, 1 };
+		region.dstOffsets[1] = extent(level);
+		vkCmdBlitImage(cmd, Image->Image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, Image->Image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region, filter);
+	}
+	if (ReadOnly) {
+		barriers.Access(this, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+		barriers.Record();
+	}
+}
+
+void HA::GetImageCreateInfo(const ImplementationContext* Context, VkFormat format, VkImageType type, VkExtent3D size, uint32_t mipCount,
+	VkImageCreateInfo& createInfo)
+{
+	createInfo = { VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO };
 	createInfo.imageType = type;
 	createInfo.format = format;
 	createInfo.extent = size;
-	createInfo.mipLevels = Mipcount;
+	createInfo.mipLevels = mipCount;
 	createInfo.arrayLayers = 1;
 	createInfo.samples = VK_SAMPLE_COUNT_1_BIT;
 	createInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
@@ -353,8 +1139,48 @@ HA::GPImage::GPImage(
 		VK_IMAGE_USAGE_TRANSFER_DST_BIT |
 		VK_IMAGE_USAGE_SAMPLED_BIT |
 		VK_IMAGE_USAGE_STORAGE_BIT;
-	createInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+	SetSharingMode(Context, createInfo);
 	createInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+}
+
+VkResult HA::CreateImageView(const ImplementationContext* Context, VkImage image, VkFormat format, VkImageType type, uint32_t mipCount, VkImageView* view)
+{
+	VkImageViewCreateInfo viewCreateInfo{ VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO };
+	viewCreateInfo.image = image;
+	viewCreateInfo.viewType = type == VK_IMAGE_TYPE_1D ? VK_IMAGE_VIEW_TYPE_1D : (type == VK_IMAGE_TYPE_2D ? VK_IMAGE_VIEW_TYPE_2D : VK_IMAGE_VIEW_TYPE_3D);
+	viewCreateInfo.format = format;
+	viewCreateInfo.subresourceRange.aspectMask = IMAGE_ASPECT;
+	viewCreateInfo.subresourceRange.baseMipLevel = 0;
+	viewCreateInfo.subresourceRange.levelCount = mipCount;
+	viewCreateInfo.subresourceRange.baseArrayLayer = 0;
+	viewCreateInfo.subresourceRange.layerCount = 1;
+	return vkCreateImageView(Context->Device, &viewCreateInfo, Context->AllocationCallbacks, view);
+}
+
+void HA::DestroyLevelViews(const ImplementationContext* Context, ImplementationManagedImage* image)
+{
+	for (auto view : image->LevelViews) {
+		Context->_DescriptorAllocator->Invalidate((uint64_t)view);
+		vkDestroyImageView(Context->Device, view, Context->AllocationCallbacks);
+	}
+	image->LevelViews.clear();
+}
+
+HA::GPImage::GPImage(
+	const ImplementationContext* Context,
+	const VkFormat format,
+	const VkImageType type,
+	const VkExtent3D size,
+	const uint32_t RowLengthInBytes,
+	const int Mipcount,
+	const GPGPUMemoryType memoryType)
+	: Context(Context), MemoryType(memoryType), Format(format), ImageType(type),
+	Size(size), BufferRowLength(RowLengthInBytes), Mipcount(Mipcount), ReadOnly(false), LastSubmission(0)
+{
+	auto image = new ImplementationManagedImage{};
+	image->LevelStates.resize(Mipcount);
+	VkImageCreateInfo createInfo;
+	GetImageCreateInfo(Context, format, type, size, Mipcount, createInfo);
 	VmaAllocationCreateInfo allocCreateInfo{};
 	auto result = vmaCreateImage(Context->Allocator, &createInfo, &allocCreateInfo,
 		&image->Image, &image->Allocation, &image->AllocationInfo);
@@ -362,12 +1188,40 @@ HA::GPImage::GPImage(
 		delete image;
 		throw std::runtime_error("VMA: Encountered error creating image.");
 	}
+
+	result = CreateImageView(Context, image->Image, format, type, Mipcount, &image->View);
+	if (result != VK_SUCCESS) {
+		vmaDestroyImage(Context->Allocator, image->Image, image->Allocation);
+		delete image;
+		throw std::runtime_error("Encountered error creating image view.");
+	}
+	image->Owner.Image = this;
+	vmaSetAllocationUserData(Context->Allocator, image->Allocation, &image->Owner);
 	Image = image;
+	Context->_MemoryStatistics->Add(memoryType, true, image->AllocationInfo.size);
+}
+
+HA::GPImage::GPImage(const ImplementationContext* Context, const ImplementationManagedImage* aliased, const VkFormat format,
+	const VkImageType type, const VkExtent3D size, const int Mipcount)
+	: Context(Context), Image(aliased), MemoryType(GPGPUMemoryType::Static), Format(format), ImageType(type), Size(size),
+	Mipcount(Mipcount), BufferRowLength(0), ReadOnly(false), LastSubmission(0)
+{
 }
 
 HA::GPImage::~GPImage()
 {
-	vmaDestroyImage(Context->Allocator, Image->Image, Image->Allocation);
+	if (LastSubmission)
+		Context->_CommandThread->Wait(LastSubmission);
+	Context->_DescriptorAllocator->Invalidate((uint64_t)Image->View);
+	vkDestroyImageView(Context->Device, Image->View, Context->AllocationCallbacks);
+	DestroyLevelViews(Context, const_cast<ImplementationManagedImage*>(Image));
+	if (Image->Allocation) {
+		vmaDestroyImage(Context->Allocator, Image->Image, Image->Allocation);
+		Context->_MemoryStatistics->Remove(MemoryType, true, Image->AllocationInfo.size);
+	}
+	else {
+		vkDestroyImage(Context->Device, Image->Image, Context->AllocationCallbacks);
+	}
 	delete Image;
 }
 
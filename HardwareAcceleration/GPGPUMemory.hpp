@@ -1,12 +1,17 @@
 #pragma once
 #include <cstdint>
+#include <deque>
+#include <vector>
 #include <vulkan/vulkan_core.h>
+#include "CommandThread.hpp"
 
 namespace HA {
 
 	struct ImplementationManagedBuffer;
 	struct ImplementationManagedImage;
 	struct ImplementationContext;
+	class DirtyPageTracker;
+	class MemoryAllocator;
 
 	enum class GPGPUMemoryType {
 		/// <summary>
@@ -26,6 +31,49 @@ namespace HA {
 		Host
 	};
 
+	/// <summary>
+	/// How the CPU shadow of a mapped Static buffer tracks modified pages.
+	/// </summary>
+	enum class GPDirtyTracking {
+		/// <summary>
+		/// SyncWrite() uploads the whole requested range.
+		/// </summary>
+		Disabled,
+		/// <summary>
+		/// SyncWrite() uploads only the pages passed to MarkDirty().
+		/// </summary>
+		Manual,
+		/// <summary>
+		/// The shadow is write-protected and the first write to a page marks it (Linux only,
+		/// Manual elsewhere). Each first write to a page costs a page fault.
+		/// </summary>
+		Automatic
+	};
+
+	/// <summary>
+	/// One write of a batched GPBuffer::WriteAsync().
+	/// </summary>
+	struct GPBufferRegion {
+		const void* Data;
+		uint64_t Offset;
+		uint64_t Size;
+	};
+
+	/// <summary>
+	/// Sub-rectangle update of a batched GPImage::Write().
+	/// Rows of Data are RowLengthInBytes apart, 0 means tightly packed.
+	/// </summary>
+	struct GPImageRegion {
+		const void* Data;
+		VkOffset3D Offset;
+		VkExtent3D Extent;
+		uint32_t RowLengthInBytes;
+	};
+
+	/// <summary>
+	/// Different buffers may be written and read back from different threads at the same time,
+	/// a single buffer must only be used by one thread at a time.
+	/// </summary>
 	class GPBuffer {
 	public:
 		GPBuffer(const GPBuffer& copy) = delete;
@@ -43,6 +91,20 @@ namespace HA {
 		/// <returns></returns>
 		GPBuffer* Copy(HA::GPGPUMemoryType memoryType);
 
+		/// <summary>
+		/// Wraps existing host memory as a Host buffer without copying it (VK_EXT_external_memory_host).
+		/// hostMemory and size must be multiples of the device's minImportedHostPointerAlignment,
+		/// page aligned mmap memory usually is, and hostMemory must outlive the buffer.
+		/// Falls back to a Host buffer holding a copy if the memory cannot be imported.
+		/// </summary>
+		static GPBuffer* WrapHostMemory(const ImplementationContext* Context, void* hostMemory, uint64_t size);
+
+		/// <summary>
+		/// True if WrapHostMemory() imported the memory instead of copying it.
+		/// MapBuffer() then returns the wrapped pointer.
+		/// </summary>
+		bool IsHostMemoryImported() const;
+
 		/// <summary>
 		/// If your only writing use memcpy() because C++ '=' operator may perform read operation,
 		/// depending on memory type read operation may cause a memory sync from GPU to CPU which may be
@@ -58,25 +120,52 @@ namespace HA {
 		void UnmapBuffer();
 
 		/// <summary>
-		/// Writes data directly 
+		/// Writes data directly. For Static memory the upload is submitted right away
+		/// but not waited on, Data may be freed as soon as this returns.
 		/// </summary>
 		/// <param name="Data"></param>
 		/// <param name="offset"></param>
 		/// <param name="size"></param>
 		void Write(void* Data, uint64_t offset, uint64_t size);
+		/// <summary>
+		/// Same as Write() but Static memory uploads are recorded into the shared
+		/// command buffer and only submitted by AccelerationEngine::CommitMemory()
+		/// </summary>
 		void WriteAsync(void* Data, uint64_t offset, uint64_t size);
+		/// <summary>
+		/// Batched WriteAsync(). Overlapping and adjacent regions are merged, Static memory
+		/// uploads use one staging allocation and a single copy command.
+		/// Where regions overlap the later one in the list wins.
+		/// </summary>
+		void WriteAsync(const std::vector<GPBufferRegion>& regions);
 
 		/// <summary>
-		/// Reads Buffer into memory and then stores to disk as raw .bin file.
-		/// This function uses the C Runtime FILE* API
+		/// Same as StoreToFile(), kept for existing callers.
 		/// </summary>
 		/// <param name="FileName">Path</param>
 		void StoreToDisk(const char* FileName);
 
+		/// <summary>
+		/// Streams a raw file into the buffer at offset. The file is memory mapped and Static
+		/// memory is uploaded in fixed-size chunks through two staging buffers, so the next chunk
+		/// is read from disk while the previous one is copied. Bytes past the end of the buffer
+		/// are ignored. Waits for the upload, a mapped Static buffer needs SyncRead() afterwards.
+		/// </summary>
+		/// <returns>False if the file could not be opened</returns>
+		bool LoadFromFile(const char* FileName, uint64_t offset = 0);
+
+		/// <summary>
+		/// Streams the buffer into a raw .bin file, the counterpart of LoadFromFile().
+		/// Never holds more than two chunks of a Static buffer in host memory.
+		/// </summary>
+		/// <returns>False if the file could not be created</returns>
+		bool StoreToFile(const char* FileName);
+
 		/// <summary>
 		/// Guarantees GPU writes are available to the CPU. Must have memory mapped.
+		/// With dirty tracking only the dirty pages inside the range are uploaded.
 		/// <param name="offset">The starting location of MapMemory()</param>
-		/// <param name="size">The range to update the buffer on the GPU. Size of 0 = Buffer Size</param>
+		/// <param name="size">The range to update the buffer on the GPU. Size of 0 = up to the end of the buffer</param>
 		/// </summary>
 		void SyncWrite(uint64_t offset, uint64_t size);
 
@@ -84,28 +173,209 @@ namespace HA {
 		/// Guarantees CPU writes are available to the GPU. Must have memory mapped.
 		/// </summary>
 		void SyncRead();
+		/// <summary>
+		/// SyncRead() of a range only, GPU writes cannot be tracked so the range is up to the caller.
+		/// <param name="size">Size of 0 = up to the end of the buffer</param>
+		/// </summary>
+		void SyncRead(uint64_t offset, uint64_t size);
 
 		/// <summary>
 		/// SyncRead() and SyncWrite(). Must have memory mapped.
 		/// <param name="offset">The starting location of MapMemory()</param>
-		/// <param name="size">The range to update the buffer on the GPU. Size of 0 = Buffer Size</param>
+		/// <param name="size">The range to update the buffer on the GPU. Size of 0 = up to the end of the buffer</param>
 		/// </summary>
 		void Sync(uint64_t offset, uint64_t size);
 
+		/// <summary>
+		/// Only affects Static memory, takes effect at the next MapBuffer() or right away if mapped.
+		/// Default Value --> Disabled
+		/// </summary>
+		void SetDirtyTracking(GPDirtyTracking mode);
+
+		/// <summary>
+		/// Marks a range of the mapped shadow as modified for GPDirtyTracking::Manual.
+		/// </summary>
+		void MarkDirty(uint64_t offset, uint64_t size);
+
 	public:
 		const GPGPUMemoryType MemoryType;
 		const uint64_t Size;
 		const ImplementationManagedBuffer* Buffer;
 
 	private:
+		friend class GPImage;
+		friend class ComputeShader;
+		friend class Defragmenter;
+		friend class GPTaskGraph;
+		/// <summary>
+		/// Buffer over memory it does not allocate. Imported host memory is freed with the buffer,
+		/// transient memory of a GPTaskGraph (Allocation and ImportedMemory null) by the graph.
+		/// </summary>
+		GPBuffer(const ImplementationContext* Context, const ImplementationManagedBuffer* external, const GPGPUMemoryType memoryType, const uint64_t size);
+		void RecordWrite(VkCommandBuffer cmd, const std::vector<GPBufferRegion>& regions);
+		void FlushMapped(uint64_t offset, uint64_t size);
+		void InvalidateMapped(uint64_t offset, uint64_t size);
+
 		void* MappedMemory;
 		const ImplementationContext* Context;
+		GPDirtyTracking DirtyTracking;
+		/// <summary>
+		/// Owns MappedMemory while a Static buffer with dirty tracking is mapped.
+		/// </summary>
+		DirtyPageTracker* Dirty;
+		/// <summary>
+		/// Pool the buffer was created from, nullptr for the engine wide allocator. Clones use it too.
+		/// </summary>
+		MemoryAllocator* Allocator;
+		/// <summary>
+		/// Last submission that uses this buffer, waited on before the buffer is destroyed.
+		/// </summary>
+		CommandTicket LastSubmission;
 
 	public:
-		GPBuffer(const ImplementationContext* Context, const GPGPUMemoryType memoryType, const uint64_t size);
+		/// <summary>
+		/// allocator sub-allocates the buffer from a MemoryAllocator's pool, nullptr uses the engine wide allocator.
+		/// </summary>
+		GPBuffer(const ImplementationContext* Context, const GPGPUMemoryType memoryType, const uint64_t size, MemoryAllocator* allocator = nullptr);
 		~GPBuffer();
 	};
 
+	/// <summary>
+	/// CPU pointer and buffer offset of a GPRingBuffer allocation.
+	/// </summary>
+	struct GPRingAllocation {
+		void* CpuPtr;
+		uint64_t GpuOffset;
+		uint64_t Size;
+	};
+
+	/// <summary>
+	/// Persistently mapped Stream or Host buffer that is sub-allocated linearly.
+	/// Writes only need a memcpy into CpuPtr, there is no map/unmap per call.
+	/// Allocations made before Fence(ticket) are reclaimed once that submission has completed.
+	/// </summary>
+	class GPRingBuffer {
+	public:
+		GPRingBuffer(const ImplementationContext* Context, const uint64_t size, const GPGPUMemoryType memoryType = GPGPUMemoryType::Stream);
+		~GPRingBuffer();
+		GPRingBuffer(const GPRingBuffer& copy) = delete;
+		GPRingBuffer(const GPRingBuffer&& move) = delete;
+
+		/// <summary>
+		/// Sub-allocates size bytes, waits on the oldest fenced submission if the ring is full.
+		/// Throws if the allocations that have not been fenced yet already fill the ring.
+		/// </summary>
+		/// <param name="size">Must not exceed the size of the ring</param>
+		/// <param name="align">Power of two alignment of GpuOffset</param>
+		GPRingAllocation Allocate(uint64_t size, uint64_t align = 16);
+
+		/// <summary>
+		/// Flushes every allocation made since the previous Fence() and ties them to ticket.
+		/// Call this once the commands reading the allocations have been submitted.
+		/// </summary>
+		void Fence(CommandTicket ticket);
+
+	public:
+		const ImplementationContext* Context;
+		const uint64_t Size;
+		/// <summary>
+		/// The underlying buffer, GpuOffset is relative to it.
+		/// </summary>
+		GPBuffer* const Buffer;
+
+	private:
+		struct FencedRegion {
+			CommandTicket Ticket;
+			uint64_t End;
+		};
+
+		void Flush(uint64_t begin, uint64_t end);
+
+	private:
+		char* MappedMemory;
+		// Head/Tail only ever increase, the physical offset is Head % Size.
+		uint64_t Head;
+		uint64_t Tail;
+		uint64_t FencedHead;
+		std::deque<FencedRegion> Regions;
+	};
+
+	/// <summary>
+	/// Sub-range of a GPArena block. Buffer is the arena's block, so WriteAsync() and
+	/// ComputeShader::Bind() work on the range through it.
+	/// </summary>
+	struct GPArenaAllocation {
+		GPBuffer* Buffer;
+		uint64_t Offset;
+		uint64_t Size;
+	};
+
+	/// <summary>
+	/// Bump allocator for intermediates that live for one batch. Allocations are sub-ranges of a
+	/// few large blocks, there is no GPBuffer or VMA allocation per object and nothing to free
+	/// one by one. Release(ticket) hands every allocation since the previous Release() back at once,
+	/// their blocks are reused once that submission has completed.
+	/// </summary>
+	class GPArena {
+	public:
+		GPArena(const ImplementationContext* Context, const uint64_t blockSize, const GPGPUMemoryType memoryType = GPGPUMemoryType::Static);
+		~GPArena();
+		GPArena(const GPArena& copy) = delete;
+		GPArena(const GPArena&& move) = delete;
+
+		/// <summary>
+		/// Sub-allocates size bytes aligned for storage and uniform buffer bindings.
+		/// Starts a new block if the current one is full, never waits.
+		/// </summary>
+		/// <param name="size">Must not exceed the block size</param>
+		GPArenaAllocation Allocate(uint64_t size);
+
+		/// <summary>
+		/// Releases every allocation made since the previous Release(), ticket is the submission
+		/// that uses them last, usually the one of AccelerationEngine::CommitMemoryAsync().
+		/// </summary>
+		void Release(CommandTicket ticket);
+
+	public:
+		const ImplementationContext* Context;
+		const uint64_t BlockSize;
+		const GPGPUMemoryType MemoryType;
+
+	private:
+		struct RetiredBlock {
+			CommandTicket Ticket;
+			GPBuffer* Block;
+		};
+
+		void NextBlock();
+
+	private:
+		uint64_t Alignment;
+		// Blocks allocated from since the previous Release(), the last one is current
+		std::vector<GPBuffer*> Pending;
+		uint64_t Offset;
+		std::deque<RetiredBlock> Retired;
+		std::vector<GPBuffer*> Free;
+	};
+
+	/// <summary>
+	/// Filter GPImage::GenerateMipmap() reduces each level with.
+	/// </summary>
+	enum class GPMipFilter {
+		/// <summary>
+		/// Average of the 2x2 texels under each output texel.
+		/// </summary>
+		Box,
+		/// <summary>
+		/// Separable 4x4 Kaiser windowed sinc, sharper than Box with less aliasing.
+		/// Falls back to Box on formats that can only be blitted.
+		/// </summary>
+		Kaiser
+	};
+
+	/// <summary>
+	/// Like GPBuffer, different images may be used from different threads at the same time.
+	/// </summary>
 	class GPImage {
 
 	public:
@@ -116,7 +386,20 @@ namespace HA {
 
 		void Write(uint32_t SizeInBytes, uint8_t* PixelData);
 		void Write(GPBuffer* buffer);
+		/// <summary>
+		/// Uploads every region through one staging allocation and a single copy command.
+		/// Regions must not overlap.
+		/// </summary>
+		void Write(const std::vector<GPImageRegion>& regions);
 		void ReadBack(GPBuffer** OutBuffer, GPGPUMemoryType MemoryType);
+		/// <summary>
+		/// Submits a copy of the image into buffer without waiting for it, so buffer can be
+		/// reused every frame. Wait on the ticket (or call SyncRead() on the mapped buffer)
+		/// before reading it on the CPU.
+		/// </summary>
+		/// <param name="buffer">Must hold at least RowLengthInBytes * height bytes</param>
+		/// <returns>Ticket to pass to AccelerationEngine::Wait() or Poll()</returns>
+		CommandTicket ReadBackAsync(GPBuffer* buffer);
 
 		GPImage* Clone(GPGPUMemoryType memoryType);
 		GPImage* Copy(GPGPUMemoryType memoryType);
@@ -130,7 +413,15 @@ namespace HA {
 		/// <param name="ReadOnly"></param>
 		void OptimizeShaderAccess(bool ReadOnly);
 
-		void GenerateMipmap();
+		/// <summary>
+		/// Rebuilds levels 1 to Mipcount - 1 from level 0. 2D images of storage formats up to
+		/// 4096 px are reduced by a single compute dispatch, each workgroup builds levels 1-5 of a
+		/// 32x32 tile and the last one to finish builds the rest. Formats like r8 or rg16f need
+		/// shaderStorageImageExtendedFormats. Other images fall back to one blit per level.
+		/// Recorded into the current batch like a dispatch. Leaves the image read only if
+		/// OptimizeShaderAccess(true) was set, otherwise the next use picks its layout.
+		/// </summary>
+		void GenerateMipmap(GPMipFilter filter = GPMipFilter::Box);
 
 	public:
 		const ImplementationContext* Context;
@@ -142,12 +433,23 @@ namespace HA {
 		const int Mipcount;
 
 	private:
-		void TransitionImage(VkCommandBuffer cmd, VkImageLayout layout);
+		friend class ComputeShader;
+		friend class Defragmenter;
+		friend class MipGenerator;
+		friend class GPTaskGraph;
+		/// <summary>
+		/// Image bound to transient memory of a GPTaskGraph, which frees and counts the memory.
+		/// </summary>
+		GPImage(const ImplementationContext* Context, const ImplementationManagedImage* aliased, const VkFormat format, const VkImageType type,
+			const VkExtent3D size, const int Mipcount);
+		void RecordBlitMipmap(VkCommandBuffer cmd);
+		void RecordWrite(VkCommandBuffer cmd, GPBuffer* buffer);
+		void RecordReadBack(VkCommandBuffer cmd, GPBuffer* buffer);
 
 	private:
-		VkImageLayout CurrentLayout;
 		const uint32_t BufferRowLength;
 		bool ReadOnly;
+		CommandTicket LastSubmission;
 	};
 
 }
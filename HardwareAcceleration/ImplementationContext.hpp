@@ -8,6 +8,13 @@
 
 namespace HA {
 
+	class StagingPool;
+	class ShaderCache;
+	class DescriptorAllocator;
+	class Profiler;
+	class MemoryStatistics;
+	class MipGenerator;
+
 	struct ImplementationContext {
 		VkAllocationCallbacks* AllocationCallbacks;
 		VkInstance Instance;
@@ -15,9 +22,57 @@ namespace HA {
 		VkPhysicalDeviceMemoryProperties Properties;
 		VkDevice Device;
 		VkQueue Queue;
+		/// <summary>
+		/// Second queue for copies, from a transfer only family if the device has one.
+		/// Null (and _TransferThread nullptr) if the device has no second queue, the compute
+		/// queue itself if AccelerationEngine::SetForceTransferThread() is set.
+		/// </summary>
+		VkQueue TransferQueue;
+		/// <summary>
+		/// Compute and transfer queue family, buffers and images are shared by both when they differ.
+		/// </summary>
+		uint32_t QueueFamilies[2];
+		/// <summary>
+		/// The transfer family supports timestamps and query resets, the profiler skips copies on it otherwise.
+		/// </summary>
+		bool TransferTimestamps;
+		/// <summary>
+		/// minImageTransferGranularity of the transfer family is 1x1x1, so image copies of any
+		/// offset may run on it. Whole images can always be copied there.
+		/// </summary>
+		bool TransferImageGranularity;
+		/// <summary>
+		/// The transfer family also supports compute, barriers recorded on it may wait for the compute stage.
+		/// </summary>
+		bool TransferCompute;
 		VmaAllocator Allocator;
 		CommandThread* _CommandThread;
-		Logger* Logger;
+		CommandThread* _TransferThread;
+		StagingPool* _StagingPool;
+		ShaderCache* _ShaderCache;
+		DescriptorAllocator* _DescriptorAllocator;
+		Profiler* _Profiler;
+		MemoryStatistics* _MemoryStatistics;
+		MipGenerator* _MipGenerator;
+		HA::Logger* Logger;
+		/// <summary>
+		/// Instance extensions that VK_KHR_external_memory depends on are enabled.
+		/// </summary>
+		bool ExternalMemoryCapabilities;
+		/// <summary>
+		/// VK_EXT_external_memory_host is enabled, see GPBuffer::WrapHostMemory().
+		/// </summary>
+		bool ExternalMemoryHost;
+		VkDeviceSize MinImportedHostPointerAlignment;
+		PFN_vkGetMemoryHostPointerPropertiesEXT GetMemoryHostPointerProperties;
+		/// <summary>
+		/// VK_EXT_memory_budget is enabled and VMA reads its budgets from it.
+		/// </summary>
+		bool MemoryBudget;
+		/// <summary>
+		/// shaderStorageImageExtendedFormats is enabled, storage images may use formats outside the core set.
+		/// </summary>
+		bool StorageImageExtendedFormats;
 	};
 
 	std::string GetStringFromResult(VkResult result);
@@ -1,9 +1,16 @@
 #include "ImplementationLogger.hpp"
+#ifdef _WIN32
 #define _WINSOCK_DEPRECATED_NO_WARNINGS
 #include <WinSock2.h>
+#pragma comment(lib, "ws2_32.lib")
+#else
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#endif
 #include <iostream>
 #include <sstream>
-#pragma comment(lib, "ws2_32.lib")
 
 #define WEB_SERVER_PORT (4848)
 
@@ -13,8 +20,10 @@ namespace HA {
 		: WebServer(WebServer)
 	{
 		if (WebServer) {
+#ifdef _WIN32
 			WSADATA wsaData;
 			WSAStartup(MAKEWORD(2, 2), &wsaData);
+#endif
 			SocketFd = ::socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
 			sockaddr_in endpoint{};
 			endpoint.sin_addr.s_addr = inet_addr("127.0.0.1");
@@ -32,7 +41,11 @@ namespace HA {
 	Logger::~Logger()
 	{
 		if (WebServer) {
+#ifdef _WIN32
 			::closesocket(SocketFd);
+#else
+			::close((int)SocketFd);
+#endif
 		}
 	}
 
@@ -1,19 +1,74 @@
 #pragma once
 #include <vk_mem_alloc.h>
 #include <vulkan/vulkan.h>
+#include "ResourceTracker.hpp"
+#include <vector>
 
 namespace HA {
 
+	enum class GPGPUMemoryType;
+	class GPBuffer;
+	class GPImage;
+	struct ImplementationContext;
+
+	/// <summary>
+	/// VMA user data of buffer and image allocations, so defragmentation can find the
+	/// object that owns a moved allocation. One of the two is set.
+	/// </summary>
+	struct ImplementationAllocationOwner {
+		GPBuffer* Buffer;
+		GPImage* Image;
+	};
+
 	struct ImplementationManagedBuffer {
 		VkBuffer Buffer;
 		VmaAllocation Allocation;
 		VmaAllocationInfo AllocationInfo;
+		/// <summary>
+		/// Memory imported from HostPointer with VK_EXT_external_memory_host,
+		/// Allocation is null for such buffers.
+		/// </summary>
+		VkDeviceMemory ImportedMemory;
+		void* HostPointer;
+		ImplementationAllocationOwner Owner;
+		/// <summary>
+		/// Accesses recorded so far, see BarrierBatch.
+		/// </summary>
+		ResourceState State;
 	};
 
 	struct ImplementationManagedImage {
 		VkImage Image;
+		VkImageView View;
 		VmaAllocation Allocation;
 		VmaAllocationInfo AllocationInfo;
+		ImplementationAllocationOwner Owner;
+		/// <summary>
+		/// One view per mip level, created on the first GenerateMipmap() through compute.
+		/// </summary>
+		std::vector<VkImageView> LevelViews;
+		/// <summary>
+		/// Accesses and layout of every mip level, see BarrierBatch.
+		/// </summary>
+		std::vector<ResourceState> LevelStates;
 	};
 
+	/// <summary>
+	/// Create infos of a GPBuffer of memoryType, shared by GPBuffer and MemoryAllocator's pools.
+	/// Shared by both queue families when the engine has a transfer queue of another family.
+	/// </summary>
+	void GetBufferCreateInfo(const ImplementationContext* Context, GPGPUMemoryType memoryType, uint64_t size, VkBufferCreateInfo& createInfo,
+		VmaAllocationCreateInfo& allocationInfo);
+
+	/// <summary>
+	/// Create info and view of a GPImage, shared by GPImage and defragmentation.
+	/// </summary>
+	void GetImageCreateInfo(const ImplementationContext* Context, VkFormat format, VkImageType type, VkExtent3D size, uint32_t mipCount,
+		VkImageCreateInfo& createInfo);
+	VkResult CreateImageView(const ImplementationContext* Context, VkImage image, VkFormat format, VkImageType type, uint32_t mipCount, VkImageView* view);
+	/// <summary>
+	/// Invalidates and destroys LevelViews, must run before the image is destroyed or replaced.
+	/// </summary>
+	void DestroyLevelViews(const ImplementationContext* Context, ImplementationManagedImage* image);
+
 }
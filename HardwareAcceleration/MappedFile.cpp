@@ -0,0 +1,101 @@
+#include "MappedFile.hpp"
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+
+HA::MappedFile::MappedFile(const char* FileName, bool Write, uint64_t Size)
+	: Data(nullptr), Size(0), Opened(false), File(INVALID_HANDLE_VALUE), Mapping(nullptr)
+{
+	File = CreateFileA(FileName, Write ? GENERIC_READ | GENERIC_WRITE : GENERIC_READ, Write ? 0 : FILE_SHARE_READ, nullptr,
+		Write ? CREATE_ALWAYS : OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if (File == INVALID_HANDLE_VALUE)
+		return;
+	if (!Write) {
+		LARGE_INTEGER fileSize;
+		if (!GetFileSizeEx(File, &fileSize))
+			return;
+		this->Size = (uint64_t)fileSize.QuadPart;
+	}
+	else {
+		this->Size = Size;
+	}
+	if (this->Size == 0) {
+		Opened = true;
+		return;
+	}
+	Mapping = CreateFileMappingA(File, nullptr, Write ? PAGE_READWRITE : PAGE_READONLY,
+		(DWORD)(this->Size >> 32), (DWORD)(this->Size & 0xffffffff), nullptr);
+	if (!Mapping)
+		return;
+	Data = (char*)MapViewOfFile(Mapping, Write ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, 0);
+	Opened = Data != nullptr;
+}
+
+HA::MappedFile::~MappedFile()
+{
+	if (Data)
+		UnmapViewOfFile(Data);
+	if (Mapping)
+		CloseHandle(Mapping);
+	if (File != INVALID_HANDLE_VALUE)
+		CloseHandle(File);
+}
+
+bool HA::MappedFile::IsOpen() const
+{
+	return Opened;
+}
+
+#else
+
+HA::MappedFile::MappedFile(const char* FileName, bool Write, uint64_t Size)
+	: Data(nullptr), Size(0), Opened(false), File(-1)
+{
+	File = Write ? open(FileName, O_RDWR | O_CREAT | O_TRUNC, 0644) : open(FileName, O_RDONLY);
+	if (File < 0)
+		return;
+	if (!Write) {
+		struct stat status;
+		if (fstat(File, &status) != 0)
+			return;
+		this->Size = (uint64_t)status.st_size;
+	}
+	else {
+		if (ftruncate(File, (off_t)Size) != 0)
+			return;
+		this->Size = Size;
+	}
+	if (this->Size == 0) {
+		Opened = true;
+		return;
+	}
+	void* memory = mmap(nullptr, this->Size, Write ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, File, 0);
+	if (memory == MAP_FAILED)
+		return;
+	Data = (char*)memory;
+	// Files are streamed front to back once
+	posix_madvise(Data, this->Size, POSIX_MADV_SEQUENTIAL);
+	Opened = true;
+}
+
+HA::MappedFile::~MappedFile()
+{
+	if (Data)
+		munmap(Data, Size);
+	if (File >= 0)
+		close(File);
+}
+
+bool HA::MappedFile::IsOpen() const
+{
+	return Opened;
+}
+
+#endif
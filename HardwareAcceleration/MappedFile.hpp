@@ -0,0 +1,42 @@
+#pragma once
+// This file is only for internal use by the api
+#include <cstdint>
+
+namespace HA {
+
+	/// <summary>
+	/// Maps a whole file into memory, mmap on POSIX and a file mapping on Windows.
+	/// Data is nullptr if the file could not be opened or mapped, or is empty.
+	/// </summary>
+	class MappedFile {
+
+	public:
+		/// <summary>
+		/// Opens FileName read only, or creates (truncates) it with Size bytes if Write is set.
+		/// </summary>
+		MappedFile(const char* FileName, bool Write, uint64_t Size = 0);
+		~MappedFile();
+		MappedFile(const MappedFile& copy) = delete;
+		MappedFile(const MappedFile&& move) = delete;
+
+		/// <summary>
+		/// True if the file was opened, also for empty files that have no mapping.
+		/// </summary>
+		bool IsOpen() const;
+
+	public:
+		char* Data;
+		uint64_t Size;
+
+	private:
+		// Set once opening, sizing and mapping all succeeded
+		bool Opened;
+#ifdef _WIN32
+		void* File;
+		void* Mapping;
+#else
+		int File;
+#endif
+	};
+
+}
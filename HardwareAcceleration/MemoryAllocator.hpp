@@ -1,63 +1,50 @@
 #pragma once
-#if 0
-#include <vulkan/vulkan_core.h>
-#include <list>
-#include <mutex>
-#include <map>
+#include <cstdint>
 #include "GPGPUMemory.hpp"
 
-// Nonstandard Handle Type
-VK_DEFINE_NON_DISPATCHABLE_HANDLE(VkOpaque)
+struct VmaPool_T;
 
 namespace HA {
 
 	struct ImplementationContext;
 
-	struct HeapSubAllocation {
-		uint32_t Id;
-		uint64_t Offset;
-		uint64_t Size;
-		bool Used;
-		// Pointer to HeapAllocation
-		void* ParentAllocation;
-	};
-
-	struct HeapAllocation {
-		uint64_t Id;
-		VkDeviceMemory Memory;
-		uint64_t Size;
-		VkMemoryPropertyFlags MemoryProperties;
-		std::map<uint32_t, HeapSubAllocation> Suballocations;
+	enum class GPAllocatorMode {
+		/// <summary>
+		/// Bump allocation inside a single block. Buffers freed in creation order (per batch)
+		/// are reclaimed like a ring buffer, freeing out of order leaves holes until the ring wraps.
+		/// </summary>
+		Linear,
+		/// <summary>
+		/// TLSF allocation over as many blocks as needed, for long-lived buffers of mixed sizes.
+		/// </summary>
+		General
 	};
 
+	/// <summary>
+	/// Sub-allocates GPBuffers from its own VMA pools, one per GPGPUMemoryType, instead of the
+	/// engine wide allocator. Pass it to the GPBuffer constructor. Buffers that do not fit into
+	/// a full Linear allocator fall back to the engine wide allocator.
+	/// Every buffer created from the allocator must be deleted before the allocator.
+	/// </summary>
 	class MemoryAllocator {
 
 	public:
-		MemoryAllocator(ImplementationContext* context);
+		MemoryAllocator(const ImplementationContext* Context, GPAllocatorMode Mode, uint64_t BlockSize = 64ull * 1024 * 1024);
 		MemoryAllocator(const MemoryAllocator& other) = delete;
 		MemoryAllocator(const MemoryAllocator&& other) = delete;
 		~MemoryAllocator();
 
-		GPGPUBuffer* CreateBuffer(GPGPUMemoryType memoryType, const VkBufferCreateInfo& createInfo);
-		void FreeBuffer(GPGPUBuffer* buffer);
-
-	private:
-		bool CreateHeap(bool Locked, uint32_t typeFilter, GPGPUMemoryType memoryType, int size, bool preferred);
-		bool Search(VkOpaque Handle,
-			GPGPUMemoryType memoryType,
-			bool isBuffer,
-			uint32_t* OutHeapId,
-			uint32_t* OutSubAllocId,
-			const VkMemoryRequirements& memoryRequirement);
-
 	public:
 		const ImplementationContext* Context;
+		const GPAllocatorMode Mode;
+		const uint64_t BlockSize;
 
-	protected:
-		std::map<uint32_t, HeapAllocation> Allocations;
-		std::mutex AllocationAccessKey;
+	private:
+		friend class GPBuffer;
+		VmaPool_T* GetPool(GPGPUMemoryType memoryType) const;
+		void DestroyPools();
 
+		VmaPool_T* Pools[3];
 	};
 
 }
-#endif
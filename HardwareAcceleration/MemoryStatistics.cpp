@@ -0,0 +1,44 @@
+#include "MemoryStatistics.hpp"
+
+HA::MemoryStatistics::MemoryStatistics()
+{
+	for (auto& counters : Types) {
+		counters.LiveBytes.store(0);
+		counters.PeakBytes.store(0);
+		counters.BufferCount.store(0);
+		counters.ImageCount.store(0);
+	}
+}
+
+void HA::MemoryStatistics::Add(GPGPUMemoryType memoryType, bool image, uint64_t bytes)
+{
+	auto& counters = Types[(int)memoryType];
+	(image ? counters.ImageCount : counters.BufferCount).fetch_add(1, std::memory_order_relaxed);
+	uint64_t live = counters.LiveBytes.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+	uint64_t peak = counters.PeakBytes.load(std::memory_order_relaxed);
+	while (live > peak && !counters.PeakBytes.compare_exchange_weak(peak, live, std::memory_order_relaxed));
+}
+
+void HA::MemoryStatistics::Remove(GPGPUMemoryType memoryType, bool image, uint64_t bytes)
+{
+	auto& counters = Types[(int)memoryType];
+	(image ? counters.ImageCount : counters.BufferCount).fetch_sub(1, std::memory_order_relaxed);
+	counters.LiveBytes.fetch_sub(bytes, std::memory_order_relaxed);
+}
+
+HA::MemoryTypeStats HA::MemoryStatistics::Get(GPGPUMemoryType memoryType) const
+{
+	auto& counters = Types[(int)memoryType];
+	MemoryTypeStats stats{};
+	stats.LiveBytes = counters.LiveBytes.load(std::memory_order_relaxed);
+	stats.PeakBytes = counters.PeakBytes.load(std::memory_order_relaxed);
+	stats.BufferCount = counters.BufferCount.load(std::memory_order_relaxed);
+	stats.ImageCount = counters.ImageCount.load(std::memory_order_relaxed);
+	return stats;
+}
+
+void HA::MemoryStatistics::ResetPeaks()
+{
+	for (auto& counters : Types)
+		counters.PeakBytes.store(counters.LiveBytes.load(std::memory_order_relaxed), std::memory_order_relaxed);
+}
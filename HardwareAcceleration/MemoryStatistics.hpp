@@ -0,0 +1,41 @@
+#pragma once
+// This file is only for internal use by the api
+#include "AccelerationEngine.hpp"
+#include <atomic>
+#include <cstdint>
+
+namespace HA {
+
+	/// <summary>
+	/// Live and peak bytes of GPBuffer and GPImage allocations per GPGPUMemoryType.
+	/// VMA only knows Vulkan memory types, which the api's memory types do not map to one to one.
+	/// Lock free, buffers are created and destroyed from any thread.
+	/// </summary>
+	class MemoryStatistics {
+
+	public:
+		MemoryStatistics();
+		MemoryStatistics(const MemoryStatistics& copy) = delete;
+		MemoryStatistics(const MemoryStatistics&& move) = delete;
+
+		void Add(GPGPUMemoryType memoryType, bool image, uint64_t bytes);
+		void Remove(GPGPUMemoryType memoryType, bool image, uint64_t bytes);
+		MemoryTypeStats Get(GPGPUMemoryType memoryType) const;
+
+		/// <summary>
+		/// Lowers every peak to the current live bytes.
+		/// </summary>
+		void ResetPeaks();
+
+	private:
+		struct Counters {
+			std::atomic<uint64_t> LiveBytes;
+			std::atomic<uint64_t> PeakBytes;
+			std::atomic<uint64_t> BufferCount;
+			std::atomic<uint64_t> ImageCount;
+		};
+
+		Counters Types[3];
+	};
+
+}
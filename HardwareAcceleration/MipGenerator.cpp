@@ -0,0 +1,365 @@
+#include "MipGenerator.hpp"
+#include "CommandThread.hpp"
+#include "DescriptorAllocator.hpp"
+#include "ImplementationContext.hpp"
+#include "ImplementionManagedTypes.hpp"
+#include "ShaderCache.hpp"
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <shaderc/shaderc.hpp>
+
+// Level 0 plus 12 generated levels, one storage image binding each
+#define MAX_LEVELS 13
+#define COUNTER_BINDING MAX_LEVELS
+
+// Prefixed with the FORMAT qualifier and KAISER for the Kaiser variant.
+// Kaiser taps are the windowed sinc (beta 4) of a 2x reduction at distances 0.5 and 1.5.
+// Levels 2-5 read the tile in shared memory, where taps past the tile edge are clamped to
+// it like taps past the image edge; the outer taps weigh 5%, so the error stays small.
+static const char* DownsampleSource = R"(
+layout(local_size_x = 256) in;
+
+#define LEVEL(mip, i) layout(FORMAT, set = 0, binding = i) uniform coherent image2D mip;
+LEVEL(Mip0, 0) LEVEL(Mip1, 1) LEVEL(Mip2, 2) LEVEL(Mip3, 3) LEVEL(Mip4, 4) LEVEL(Mip5, 5) LEVEL(Mip6, 6)
+LEVEL(Mip7, 7) LEVEL(Mip8, 8) LEVEL(Mip9, 9) LEVEL(Mip10, 10) LEVEL(Mip11, 11) LEVEL(Mip12, 12)
+layout(set = 0, binding = 13) coherent buffer Counter { uint Finished; };
+layout(push_constant) uniform Params { ivec2 BaseSize; int Levels; uint Workgroups; };
+
+// Level 1 (16x16) at 0, level 2 (8x8) at 256, level 3 at 0 and so on
+shared vec4 Tile[320];
+shared bool Last;
+
+const float Weights[4] = float[](0.054027, 0.445973, 0.445973, 0.054027);
+
+ivec2 LevelSize(int level) {
+	return max(BaseSize >> level, ivec2(1));
+}
+
+// Constant indices, so no dynamic indexing feature is needed
+#define LOAD(mip, i) case i: return imageLoad(mip, p);
+vec4 Load(int level, ivec2 p) {
+	p = clamp(p, ivec2(0), LevelSize(level) - 1);
+	switch (level) {
+	LOAD(Mip0, 0) LOAD(Mip1, 1) LOAD(Mip2, 2) LOAD(Mip3, 3) LOAD(Mip4, 4) LOAD(Mip5, 5)
+	LOAD(Mip6, 6) LOAD(Mip7, 7) LOAD(Mip8, 8) LOAD(Mip9, 9) LOAD(Mip10, 10) LOAD(Mip11, 11)
+	}
+	return vec4(0);
+}
+
+#define STORE(mip, i) case i: imageStore(mip, p, value); break;
+void Store(int level, ivec2 p, vec4 value) {
+	if (any(greaterThanEqual(p, LevelSize(level))))
+		return;
+	switch (level) {
+	STORE(Mip1, 1) STORE(Mip2, 2) STORE(Mip3, 3) STORE(Mip4, 4) STORE(Mip5, 5) STORE(Mip6, 6)
+	STORE(Mip7, 7) STORE(Mip8, 8) STORE(Mip9, 9) STORE(Mip10, 10) STORE(Mip11, 11) STORE(Mip12, 12)
+	}
+}
+
+// Texel p of level from level - 1 in the image
+vec4 Downsample(int level, ivec2 p) {
+#ifdef KAISER
+	vec4 sum = vec4(0);
+	for (int y = 0; y < 4; y++)
+		for (int x = 0; x < 4; x++)
+			sum += Weights[x] * Weights[y] * Load(level - 1, 2 * p + ivec2(x - 1, y - 1));
+	return sum;
+#else
+	return 0.25 * (Load(level - 1, 2 * p) + Load(level - 1, 2 * p + ivec2(1, 0)) +
+		Load(level - 1, 2 * p + ivec2(0, 1)) + Load(level - 1, 2 * p + ivec2(1, 1)));
+#endif
+}
+
+vec4 TileLoad(int base, int side, ivec2 p) {
+	p = clamp(p, ivec2(0), ivec2(side - 1));
+	return Tile[base + p.y * side + p.x];
+}
+
+// Texel p of the next level from the side x side tile at base
+vec4 DownsampleTile(int base, int side, ivec2 p) {
+#ifdef KAISER
+	vec4 sum = vec4(0);
+	for (int y = 0; y < 4; y++)
+		for (int x = 0; x < 4; x++)
+			sum += Weights[x] * Weights[y] * TileLoad(base, side, 2 * p + ivec2(x - 1, y - 1));
+	return sum;
+#else
+	return 0.25 * (TileLoad(base, side, 2 * p) + TileLoad(base, side, 2 * p + ivec2(1, 0)) +
+		TileLoad(base, side, 2 * p + ivec2(0, 1)) + TileLoad(base, side, 2 * p + ivec2(1, 1)));
+#endif
+}
+
+void main() {
+	int index = int(gl_LocalInvocationIndex);
+	ivec2 tile = ivec2(gl_WorkGroupID.xy) * 32;
+
+	// Levels 1-5 of this workgroup's tile
+	ivec2 p = ivec2(index % 16, index / 16);
+	vec4 value = Downsample(1, tile / 2 + p);
+	Store(1, tile / 2 + p, value);
+	Tile[index] = value;
+	int base = 0;
+	int side = 16;
+	for (int level = 2; level <= min(Levels, 5); level++) {
+		barrier();
+		int next = base == 0 ? 256 : 0;
+		side /= 2;
+		if (index < side * side) {
+			p = ivec2(index % side, index / side);
+			value = DownsampleTile(base, side * 2, p);
+			Tile[next + index] = value;
+			Store(level, (tile >> level) + p, value);
+		}
+		base = next;
+	}
+	if (Levels <= 5)
+		return;
+
+	// Level 5 must be visible to the last workgroup before it is counted
+	memoryBarrierImage();
+	barrier();
+	if (index == 0)
+		Last = atomicAdd(Finished, 1) == Workgroups - 1;
+	barrier();
+	if (!Last)
+		return;
+	memoryBarrier();
+
+	for (int level = 6; level <= Levels; level++) {
+		ivec2 size = LevelSize(level);
+		for (int i = index; i < size.x * size.y; i += 256) {
+			p = ivec2(i % size.x, i / size.x);
+			Store(level, p, Downsample(level, p));
+		}
+		memoryBarrierImage();
+		barrier();
+	}
+	if (index == 0)
+		Finished = 0;
+}
+)";
+
+// GLSL format qualifier of the storage image formats the shader can write, nullptr otherwise.
+// Formats outside the core set need shaderStorageImageExtendedFormats.
+static const char* GetFormatQualifier(VkFormat format, bool extendedFormats)
+{
+	switch (format) {
+	case VK_FORMAT_R8G8B8A8_UNORM: return "rgba8";
+	case VK_FORMAT_R8G8B8A8_SNORM: return "rgba8_snorm";
+	case VK_FORMAT_R16G16B16A16_SFLOAT: return "rgba16f";
+	case VK_FORMAT_R32_SFLOAT: return "r32f";
+	case VK_FORMAT_R32G32B32A32_SFLOAT: return "rgba32f";
+	default: break;
+	}
+	if (!extendedFormats)
+		return nullptr;
+	switch (format) {
+	case VK_FORMAT_R8_UNORM: return "r8";
+	case VK_FORMAT_R8G8_UNORM: return "rg8";
+	case VK_FORMAT_R16_SFLOAT: return "r16f";
+	case VK_FORMAT_R16G16_SFLOAT: return "rg16f";
+	case VK_FORMAT_R16G16B16A16_UNORM: return "rgba16";
+	case VK_FORMAT_R32G32_SFLOAT: return "rg32f";
+	case VK_FORMAT_B10G11R11_UFLOAT_PACK32: return "r11f_g11f_b10f";
+	case VK_FORMAT_A2B10G10R10_UNORM_PACK32: return "rgb10_a2";
+	default: return nullptr;
+	}
+}
+
+HA::MipGenerator::MipGenerator(const ImplementationContext* Context)
+	: Context(Context), SetLayout(VK_NULL_HANDLE), PipelineLayout(VK_NULL_HANDLE),
+	Counter(VK_NULL_HANDLE), CounterAllocation(nullptr), CounterState{}
+{
+	CreateCounter();
+}
+
+HA::MipGenerator::~MipGenerator()
+{
+	for (auto& [key, pipeline] : Pipelines)
+		vkDestroyPipeline(Context->Device, pipeline, Context->AllocationCallbacks);
+	if (PipelineLayout)
+		vkDestroyPipelineLayout(Context->Device, PipelineLayout, Context->AllocationCallbacks);
+	if (SetLayout) {
+		Context->_DescriptorAllocator->Invalidate((uint64_t)SetLayout);
+		vkDestroyDescriptorSetLayout(Context->Device, SetLayout, Context->AllocationCallbacks);
+	}
+	if (Counter) {
+		Context->_DescriptorAllocator->Invalidate((uint64_t)Counter);
+		vmaDestroyBuffer(Context->Allocator, Counter, CounterAllocation);
+	}
+}
+
+bool HA::MipGenerator::Record(VkCommandBuffer cmd, GPImage* image, GPMipFilter filter, CommandTicket ticket)
+{
+	const char* qualifier = GetFormatQualifier(image->Format, Context->StorageImageExtendedFormats);
+	if (!qualifier || image->ImageType != VK_IMAGE_TYPE_2D || image->Mipcount > MAX_LEVELS)
+		return false;
+	VkFormatProperties properties;
+	vkGetPhysicalDeviceFormatProperties(Context->PhysicalDevice, image->Format, &properties);
+	if (!(properties.optimalTilingFeatures & VK_FORMAT_FEATURE_STORAGE_IMAGE_BIT))
+		return false;
+
+	// Threads record generations into their own batches, which may be submitted in any order
+	std::lock_guard<std::mutex> guard(Lock);
+	VkPipeline pipeline = GetPipeline(image->Format, qualifier, filter);
+	if (image->Image->LevelViews.empty())
+		CreateLevelViews(image);
+
+	// Earlier writes to level 0 and an earlier generation still resetting the counter. That
+	// generation may come from a batch that is submitted after this one, so the counter always
+	// waits on every compute access before it instead of on the recorded ones.
+	CounterState = { VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT, 0, 0, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+		VK_IMAGE_LAYOUT_UNDEFINED };
+	BarrierBatch barriers(Context, cmd);
+	barriers.Access(image, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT, VK_IMAGE_LAYOUT_GENERAL, 0, 1);
+	barriers.Access(image, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT,
+		VK_IMAGE_LAYOUT_GENERAL, 1, image->Mipcount - 1);
+	barriers.Access(Counter, CounterState, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT);
+	barriers.Record();
+
+	// Bindings past the last level are never accessed, they repeat the last view to stay valid
+	auto& views = image->Image->LevelViews;
+	std::vector<DescriptorResource> resources(MAX_LEVELS + 1);
+	for (uint32_t level = 0; level < MAX_LEVELS; level++) {
+		resources[level].Binding = level;
+		resources[level].Type = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+		resources[level].Image = { VK_NULL_HANDLE, views[std::min<size_t>(level, views.size() - 1)], VK_IMAGE_LAYOUT_GENERAL };
+	}
+	resources[MAX_LEVELS].Binding = COUNTER_BINDING;
+	resources[MAX_LEVELS].Type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+	resources[MAX_LEVELS].Buffer = { Counter, 0, VK_WHOLE_SIZE };
+	VkDescriptorSet set = Context->_DescriptorAllocator->Acquire(SetLayout, resources, ticket);
+
+	struct {
+		int32_t BaseSize[2];
+		int32_t Levels;
+		uint32_t Workgroups;
+	} params;
+	params.BaseSize[0] = (int32_t)image->Size.width;
+	params.BaseSize[1] = (int32_t)image->Size.height;
+	params.Levels = image->Mipcount - 1;
+	uint32_t groupsX = (image->Size.width + 31) / 32;
+	uint32_t groupsY = (image->Size.height + 31) / 32;
+	params.Workgroups = groupsX * groupsY;
+
+	vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline);
+	vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, PipelineLayout, 0, 1, &set, 0, nullptr);
+	vkCmdPushConstants(cmd, PipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(params), &params);
+	vkCmdDispatch(cmd, groupsX, groupsY, 1);
+
+	if (image->ReadOnly) {
+		barriers.Access(image, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+		barriers.Record();
+	}
+	return true;
+}
+
+VkPipeline HA::MipGenerator::GetPipeline(VkFormat format, const char* qualifier, GPMipFilter filter)
+{
+	auto found = Pipelines.find({ format, filter });
+	if (found != Pipelines.end())
+		return found->second;
+	if (!SetLayout)
+		CreateLayouts();
+
+	std::string source = std::string("#version 450\n#define FORMAT ") + qualifier + "\n";
+	if (filter == GPMipFilter::Kaiser)
+		source += "#define KAISER\n";
+	source += DownsampleSource;
+	std::vector<uint32_t> spirv;
+	if (!Context->_ShaderCache->LoadSpirv(source.data(), (uint32_t)source.size(), spirv)) {
+		shaderc::Compiler comp;
+		shaderc::CompileOptions options;
+		options.SetOptimizationLevel(shaderc_optimization_level_performance);
+		auto result = comp.CompileGlslToSpv(source.data(), source.size(), shaderc_shader_kind::shaderc_compute_shader, "downsample.comp", options);
+		if (result.GetCompilationStatus() != shaderc_compilation_status_success)
+			throw std::runtime_error("HA::MipGenerator Could not compile downsampler.\n" + result.GetErrorMessage());
+		spirv.assign(result.cbegin(), result.cend());
+		Context->_ShaderCache->StoreSpirv(source.data(), (uint32_t)source.size(), spirv);
+	}
+
+	VkShaderModuleCreateInfo moduleInfo{ VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO };
+	moduleInfo.codeSize = spirv.size() * sizeof(uint32_t);
+	moduleInfo.pCode = spirv.data();
+	VkShaderModule module;
+	VkResult result = vkCreateShaderModule(Context->Device, &moduleInfo, Context->AllocationCallbacks, &module);
+	if (result != VK_SUCCESS)
+		throw std::runtime_error("HA::MipGenerator Could not create shader module. " + GetStringFromResult(result));
+
+	VkComputePipelineCreateInfo createInfo{ VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO };
+	createInfo.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+	createInfo.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+	createInfo.stage.module = module;
+	createInfo.stage.pName = "main";
+	createInfo.layout = PipelineLayout;
+	VkPipeline pipeline;
+	result = vkCreateComputePipelines(Context->Device, Context->_ShaderCache->PipelineCache, 1, &createInfo, Context->AllocationCallbacks, &pipeline);
+	vkDestroyShaderModule(Context->Device, module, Context->AllocationCallbacks);
+	if (result != VK_SUCCESS)
+		throw std::runtime_error("HA::MipGenerator Could not create compute pipeline. " + GetStringFromResult(result));
+	Pipelines[{ format, filter }] = pipeline;
+	return pipeline;
+}
+
+void HA::MipGenerator::CreateLayouts()
+{
+	VkDescriptorSetLayoutBinding bindings[MAX_LEVELS + 1] = {};
+	for (uint32_t i = 0; i <= MAX_LEVELS; i++) {
+		bindings[i].binding = i;
+		bindings[i].descriptorType = i == COUNTER_BINDING ? VK_DESCRIPTOR_TYPE_STORAGE_BUFFER : VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+		bindings[i].descriptorCount = 1;
+		bindings[i].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+	}
+	VkDescriptorSetLayoutCreateInfo setLayoutInfo{ VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO };
+	setLayoutInfo.bindingCount = MAX_LEVELS + 1;
+	setLayoutInfo.pBindings = bindings;
+	VkResult result = vkCreateDescriptorSetLayout(Context->Device, &setLayoutInfo, Context->AllocationCallbacks, &SetLayout);
+	if (result != VK_SUCCESS)
+		throw std::runtime_error("HA::MipGenerator Could not create descriptor set layout. " + GetStringFromResult(result));
+
+	VkPushConstantRange pushConstants{ VK_SHADER_STAGE_COMPUTE_BIT, 0, 16 };
+	VkPipelineLayoutCreateInfo layoutInfo{ VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO };
+	layoutInfo.setLayoutCount = 1;
+	layoutInfo.pSetLayouts = &SetLayout;
+	layoutInfo.pushConstantRangeCount = 1;
+	layoutInfo.pPushConstantRanges = &pushConstants;
+	result = vkCreatePipelineLayout(Context->Device, &layoutInfo, Context->AllocationCallbacks, &PipelineLayout);
+	if (result != VK_SUCCESS)
+		throw std::runtime_error("HA::MipGenerator Could not create pipeline layout. " + GetStringFromResult(result));
+}
+
+void HA::MipGenerator::CreateCounter()
+{
+	// Not a GPBuffer, so it does not show up in the memory statistics
+	VkBufferCreateInfo bufferInfo;
+	VmaAllocationCreateInfo allocationInfo;
+	GetBufferCreateInfo(Context, GPGPUMemoryType::Static, sizeof(uint32_t), bufferInfo, allocationInfo);
+	VkResult result = vmaCreateBuffer(Context->Allocator, &bufferInfo, &allocationInfo, &Counter, &CounterAllocation, nullptr);
+	if (result != VK_SUCCESS)
+		throw std::runtime_error("HA::MipGenerator Could not create counter. " + GetStringFromResult(result));
+	// Zeroed once before any generation can be recorded, the last workgroup of every generation resets it
+	VkCommandBuffer cmd = Context->_CommandThread->GenCmd();
+	vkCmdFillBuffer(cmd, Counter, 0, VK_WHOLE_SIZE, 0);
+	Context->_CommandThread->Execute(cmd);
+}
+
+void HA::MipGenerator::CreateLevelViews(GPImage* image)
+{
+	auto managed = const_cast<ImplementationManagedImage*>(image->Image);
+	for (uint32_t level = 0; level < (uint32_t)image->Mipcount; level++) {
+		VkImageViewCreateInfo viewInfo{ VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO };
+		viewInfo.image = managed->Image;
+		viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+		viewInfo.format = image->Format;
+		viewInfo.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, level, 1, 0, 1 };
+		VkImageView view;
+		VkResult result = vkCreateImageView(Context->Device, &viewInfo, Context->AllocationCallbacks, &view);
+		if (result != VK_SUCCESS) {
+			DestroyLevelViews(Context, managed);
+			throw std::runtime_error("HA::MipGenerator Could not create level view. " + GetStringFromResult(result));
+		}
+		managed->LevelViews.push_back(view);
+	}
+}
@@ -0,0 +1,62 @@
+#pragma once
+// This file is only for internal use by the api
+#include "GPGPUMemory.hpp"
+#include "ResourceTracker.hpp"
+#include <vk_mem_alloc.h>
+#include <map>
+#include <mutex>
+#include <utility>
+
+namespace HA {
+
+	struct ImplementationContext;
+
+	/// <summary>
+	/// Single pass mip chain generation in the style of AMD's single pass downsampler.
+	/// Every workgroup reduces a 32x32 tile of level 0 to levels 1-5 in shared memory,
+	/// then counts itself done on a global atomic. The last workgroup builds the remaining
+	/// levels from level 5, which all other workgroups have written by then.
+	/// Levels are bound as one storage image view each, so only 2D images of formats with
+	/// a GLSL format qualifier and at most 13 levels are supported.
+	/// Record() may be called from any thread.
+	/// </summary>
+	class MipGenerator {
+
+	public:
+		MipGenerator(const ImplementationContext* Context);
+		~MipGenerator();
+		MipGenerator(const MipGenerator& copy) = delete;
+		MipGenerator(const MipGenerator&& move) = delete;
+
+		/// <summary>
+		/// Records the dispatch with its barriers into cmd.
+		/// </summary>
+		/// <param name="ticket">Submission of cmd, the descriptor set is kept until it retires</param>
+		/// <returns>False if the image is not supported, nothing was recorded then</returns>
+		bool Record(VkCommandBuffer cmd, GPImage* image, GPMipFilter filter, CommandTicket ticket);
+
+	private:
+		VkPipeline GetPipeline(VkFormat format, const char* qualifier, GPMipFilter filter);
+		void CreateLayouts();
+		void CreateCounter();
+		void CreateLevelViews(GPImage* image);
+
+	private:
+		const ImplementationContext* Context;
+		VkDescriptorSetLayout SetLayout;
+		VkPipelineLayout PipelineLayout;
+		std::map<std::pair<VkFormat, GPMipFilter>, VkPipeline> Pipelines;
+		/// <summary>
+		/// Workgroups that finished levels 1-5, reset to 0 by the last one.
+		/// Zeroed by a submission that completes in the constructor.
+		/// </summary>
+		VkBuffer Counter;
+		VmaAllocation CounterAllocation;
+		ResourceState CounterState;
+		/// <summary>
+		/// Guards the pipelines, the layouts, level view creation and CounterState.
+		/// </summary>
+		std::mutex Lock;
+	};
+
+}
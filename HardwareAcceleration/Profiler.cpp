@@ -0,0 +1,181 @@
+#define _CRT_SECURE_NO_WARNINGS
+#include "Profiler.hpp"
+#include "ImplementationContext.hpp"
+#include <stdio.h>
+#include <algorithm>
+
+// Durations kept per label for the p99
+#define STATS_WINDOW (16384)
+// Trace events kept for ExportChromeTrace, later samples only update the stats
+#define MAX_TRACE_SAMPLES (1 << 20)
+
+HA::Profiler::Profiler(const ImplementationContext* Context, uint32_t TimestampValidBits, float TimestampPeriod, uint32_t QueryCount)
+	: Context(Context), Supported(TimestampValidBits != 0), QueryPool(VK_NULL_HANDLE),
+	TimestampMask(TimestampValidBits >= 64 ? UINT64_MAX : (1ull << TimestampValidBits) - 1),
+	TimestampPeriod(TimestampPeriod), Enabled(false), FirstTimestamp(UINT64_MAX), Created(std::chrono::steady_clock::now())
+{
+	if (!Supported)
+		return;
+	VkQueryPoolCreateInfo createInfo{ VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO };
+	createInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+	createInfo.queryCount = QueryCount & ~1u;
+	VkResult result = vkCreateQueryPool(Context->Device, &createInfo, Context->AllocationCallbacks, &QueryPool);
+	if (result != VK_SUCCESS) {
+		QueryPool = VK_NULL_HANDLE;
+		if (Context->Logger)
+			Context->Logger->Print(("Could not create timestamp query pool. " + GetStringFromResult(result)).c_str());
+		return;
+	}
+	Scopes.resize(createInfo.queryCount / 2);
+	for (uint32_t i = (uint32_t)Scopes.size(); i > 0; i--)
+		FreeScopes.push_back(i - 1);
+}
+
+HA::Profiler::~Profiler()
+{
+	if (QueryPool)
+		vkDestroyQueryPool(Context->Device, QueryPool, Context->AllocationCallbacks);
+}
+
+void HA::Profiler::SetEnabled(bool enable)
+{
+	if (enable && !QueryPool) {
+		if (Context->Logger)
+			Context->Logger->Print("The queue does not support timestamps, profiling stays disabled.");
+		return;
+	}
+	Enabled = enable;
+}
+
+uint32_t HA::Profiler::Begin(VkCommandBuffer cmd, const char* label)
+{
+	if (!Enabled)
+		return UINT32_MAX;
+	// Transfer families without timestamp support are not profiled
+	if (!Context->TransferTimestamps && Context->_TransferThread && Context->_TransferThread->Owns(cmd))
+		return UINT32_MAX;
+	uint32_t scope;
+	{
+		std::lock_guard<std::mutex> guard(Lock);
+		if (FreeScopes.empty())
+			return UINT32_MAX;
+		scope = FreeScopes.back();
+		FreeScopes.pop_back();
+	}
+	Scopes[scope] = { label, std::chrono::steady_clock::now() };
+	vkCmdResetQueryPool(cmd, QueryPool, scope * 2, 2);
+	vkCmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, QueryPool, scope * 2);
+	return scope;
+}
+
+void HA::Profiler::End(VkCommandBuffer cmd, uint32_t scope)
+{
+	if (scope == UINT32_MAX)
+		return;
+	vkCmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, QueryPool, scope * 2 + 1);
+
+	auto now = std::chrono::steady_clock::now();
+	uint64_t begin = std::chrono::duration_cast<std::chrono::nanoseconds>(Scopes[scope].HostBegin - Created).count();
+	uint64_t duration = std::chrono::duration_cast<std::chrono::nanoseconds>(now - Scopes[scope].HostBegin).count();
+	Record(Scopes[scope].Label, begin, duration, false);
+
+	Context->_CommandThread->AddPostExectute(cmd, [this, scope]() {
+		Resolve(scope);
+	});
+}
+
+std::vector<HA::ProfileStats> HA::Profiler::GetStats()
+{
+	std::lock_guard<std::mutex> guard(Lock);
+	std::vector<ProfileStats> stats;
+	for (auto& [label, entry] : Stats) {
+		ProfileStats stat{};
+		stat.Label = label;
+		stat.Count = entry.Count;
+		stat.MinNs = (double)entry.Min;
+		stat.AvgNs = (double)entry.Sum / entry.Count;
+		std::vector<uint64_t> window = entry.Recent;
+		size_t index = std::min(window.size() - 1, (size_t)(window.size() * 0.99));
+		std::nth_element(window.begin(), window.begin() + index, window.end());
+		stat.P99Ns = (double)window[index];
+		stats.push_back(stat);
+	}
+	return stats;
+}
+
+void HA::Profiler::Reset()
+{
+	std::lock_guard<std::mutex> guard(Lock);
+	Stats.clear();
+	Samples.clear();
+}
+
+bool HA::Profiler::ExportChromeTrace(const char* path)
+{
+	std::lock_guard<std::mutex> guard(Lock);
+	FILE* io = fopen(path, "w");
+	if (!io)
+		return false;
+	// GPU and host clocks are not calibrated against each other, they are shown as separate threads.
+	fprintf(io, "{\"traceEvents\":[\n");
+	fprintf(io, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":0,\"args\":{\"name\":\"GPU\"}},\n");
+	fprintf(io, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":1,\"args\":{\"name\":\"Host recording\"}}");
+	for (auto& sample : Samples) {
+		std::string name;
+		for (const char* c = sample.Label; *c; c++) {
+			if (*c == '"' || *c == '\\')
+				name += '\\';
+			name += *c;
+		}
+		fprintf(io, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":0,\"tid\":%d}",
+			name.c_str(), sample.Device ? "gpu" : "host", sample.Begin / 1000.0, sample.Duration / 1000.0, sample.Device ? 0 : 1);
+	}
+	fprintf(io, "\n],\"displayTimeUnit\":\"ns\"}\n");
+	return fclose(io) == 0;
+}
+
+void HA::Profiler::Resolve(uint32_t scope)
+{
+	uint64_t timestamps[2];
+	VkResult result = vkGetQueryPoolResults(Context->Device, QueryPool, scope * 2, 2, sizeof(timestamps), timestamps,
+		sizeof(uint64_t), VK_QUERY_RESULT_64_BIT);
+	const char* label = Scopes[scope].Label;
+	{
+		std::lock_guard<std::mutex> guard(Lock);
+		FreeScopes.push_back(scope);
+	}
+	if (result != VK_SUCCESS)
+		return;
+	uint64_t begin = timestamps[0] & TimestampMask;
+	uint64_t end = timestamps[1] & TimestampMask;
+	uint64_t ticks = (end - begin) & TimestampMask;
+	uint64_t start;
+	{
+		std::lock_guard<std::mutex> guard(Lock);
+		if (FirstTimestamp == UINT64_MAX)
+			FirstTimestamp = begin;
+		start = begin >= FirstTimestamp ? begin - FirstTimestamp : 0;
+	}
+	Record(label, (uint64_t)(start * TimestampPeriod), (uint64_t)(ticks * TimestampPeriod), true);
+}
+
+void HA::Profiler::Record(const char* label, uint64_t begin, uint64_t duration, bool device)
+{
+	std::lock_guard<std::mutex> guard(Lock);
+	// Host and device durations of the same label are reported separately.
+	auto& entry = Stats[std::string(label) + (device ? "" : " (host)")];
+	if (entry.Count == 0)
+		entry.Min = duration;
+	entry.Count++;
+	entry.Min = std::min(entry.Min, duration);
+	entry.Sum += duration;
+	if (entry.Recent.size() < STATS_WINDOW) {
+		entry.Recent.push_back(duration);
+	}
+	else {
+		entry.Recent[entry.Next] = duration;
+		entry.Next = (entry.Next + 1) % STATS_WINDOW;
+	}
+	if (Samples.size() < MAX_TRACE_SAMPLES)
+		Samples.push_back({ label, begin, duration, device });
+}
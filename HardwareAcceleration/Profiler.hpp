@@ -0,0 +1,92 @@
+#pragma once
+// This file is only for internal use by the api
+#include "AccelerationEngine.hpp"
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <vulkan/vulkan_core.h>
+
+namespace HA {
+
+	struct ImplementationContext;
+
+	/// <summary>
+	/// Wraps recorded regions in timestamp query pairs. Results are read back in the
+	/// post function of the submission, so profiling never blocks the host.
+	/// Disabled by default, Begin() is a single branch while disabled.
+	/// </summary>
+	class Profiler {
+
+	public:
+		Profiler(const ImplementationContext* Context, uint32_t TimestampValidBits, float TimestampPeriod, uint32_t QueryCount = 4096);
+		~Profiler();
+		Profiler(const Profiler& copy) = delete;
+		Profiler(const Profiler&& move) = delete;
+
+		void SetEnabled(bool enable);
+
+		/// <summary>
+		/// Writes the start timestamp of a region into cmd.
+		/// </summary>
+		/// <param name="label">Must outlive the profiler, string literals are expected</param>
+		/// <returns>Scope to pass to End(), UINT32_MAX if profiling is disabled or out of queries</returns>
+		uint32_t Begin(VkCommandBuffer cmd, const char* label);
+
+		/// <summary>
+		/// Writes the end timestamp, must be recorded into the same cmd as Begin().
+		/// </summary>
+		void End(VkCommandBuffer cmd, uint32_t scope);
+
+		std::vector<ProfileStats> GetStats();
+		void Reset();
+		bool ExportChromeTrace(const char* path);
+
+	public:
+		const ImplementationContext* Context;
+		const bool Supported;
+
+	private:
+		struct Scope {
+			const char* Label;
+			std::chrono::steady_clock::time_point HostBegin;
+		};
+
+		struct Sample {
+			const char* Label;
+			// Nanoseconds, GPU samples relative to the first GPU timestamp and
+			// host samples relative to the creation of the profiler.
+			uint64_t Begin;
+			uint64_t Duration;
+			bool Device;
+		};
+
+		struct LabelStats {
+			uint64_t Count;
+			uint64_t Min;
+			uint64_t Sum;
+			// Window of the most recent durations, p99 is computed over it.
+			std::vector<uint64_t> Recent;
+			size_t Next;
+		};
+
+		void Resolve(uint32_t scope);
+		void Record(const char* label, uint64_t begin, uint64_t duration, bool device);
+
+	private:
+		VkQueryPool QueryPool;
+		const uint64_t TimestampMask;
+		const double TimestampPeriod;
+		bool Enabled;
+		std::vector<Scope> Scopes;
+		std::vector<uint32_t> FreeScopes;
+		std::map<std::string, LabelStats> Stats;
+		std::vector<Sample> Samples;
+		uint64_t FirstTimestamp;
+		std::chrono::steady_clock::time_point Created;
+		std::mutex Lock;
+	};
+
+}
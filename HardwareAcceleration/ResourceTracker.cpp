@@ -0,0 +1,151 @@
+#include "ResourceTracker.hpp"
+#include "CommandThread.hpp"
+#include "GPGPUMemory.hpp"
+#include "ImplementationContext.hpp"
+#include "ImplementionManagedTypes.hpp"
+
+#define WRITE_ACCESS (VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_TRANSFER_WRITE_BIT | VK_ACCESS_HOST_WRITE_BIT | VK_ACCESS_MEMORY_WRITE_BIT)
+
+// Accesses that are valid in stages, masks are narrowed along with the stages
+static VkAccessFlags GetStageAccess(VkPipelineStageFlags stages)
+{
+	VkAccessFlags access = 0;
+	if (stages & VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT)
+		access |= VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_UNIFORM_READ_BIT;
+	if (stages & VK_PIPELINE_STAGE_TRANSFER_BIT)
+		access |= VK_ACCESS_TRANSFER_READ_BIT | VK_ACCESS_TRANSFER_WRITE_BIT;
+	return access;
+}
+
+HA::BarrierBatch::BarrierBatch(const ImplementationContext* Context, VkCommandBuffer cmd)
+	: Cmd(cmd), QueueStages(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT), SrcStages(0), DstStages(0)
+{
+	// A transfer only family can not name the compute stage in its barriers
+	if (Context->_TransferThread && !Context->TransferCompute && Context->_TransferThread->Owns(cmd))
+		QueueStages = VK_PIPELINE_STAGE_TRANSFER_BIT;
+}
+
+void HA::BarrierBatch::Access(GPBuffer* buffer, VkPipelineStageFlags stage, VkAccessFlags access)
+{
+	auto managed = const_cast<ImplementationManagedBuffer*>(buffer->Buffer);
+	Access(managed->Buffer, managed->State, stage, access);
+}
+
+void HA::BarrierBatch::Access(GPImage* image, VkPipelineStageFlags stage, VkAccessFlags access, VkImageLayout layout,
+	uint32_t baseLevel, uint32_t levelCount)
+{
+	auto managed = const_cast<ImplementationManagedImage*>(image->Image);
+	if (levelCount == 0)
+		levelCount = (uint32_t)image->Mipcount - baseLevel;
+	Access(managed->Image, managed->LevelStates.data(), baseLevel, levelCount, stage, access, layout);
+}
+
+void HA::BarrierBatch::Access(VkBuffer buffer, ResourceState& state, VkPipelineStageFlags stage, VkAccessFlags access)
+{
+	VkAccessFlags srcAccess;
+	if (!Resolve(state, stage, access, VK_IMAGE_LAYOUT_UNDEFINED, srcAccess))
+		return;
+	VkBufferMemoryBarrier barrier{ VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER };
+	barrier.srcAccessMask = srcAccess;
+	barrier.dstAccessMask = access;
+	barrier.srcQueueFamilyIndex = barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.buffer = buffer;
+	barrier.offset = 0;
+	barrier.size = VK_WHOLE_SIZE;
+	BufferBarriers.push_back(barrier);
+}
+
+void HA::BarrierBatch::Access(VkImage image, ResourceState* levels, uint32_t baseLevel, uint32_t levelCount,
+	VkPipelineStageFlags stage, VkAccessFlags access, VkImageLayout layout)
+{
+	for (uint32_t level = baseLevel; level < baseLevel + levelCount; level++) {
+		VkImageLayout oldLayout = levels[level].Layout;
+		VkAccessFlags srcAccess;
+		if (!Resolve(levels[level], stage, access, layout, srcAccess))
+			continue;
+		// Neighbouring levels in the same state share one barrier
+		if (ImageBarriers.size() > 0) {
+			auto& last = ImageBarriers.back();
+			if (last.image == image && last.oldLayout == oldLayout && last.newLayout == layout && last.srcAccessMask == srcAccess &&
+				last.dstAccessMask == access && last.subresourceRange.baseMipLevel + last.subresourceRange.levelCount == level) {
+				last.subresourceRange.levelCount++;
+				continue;
+			}
+		}
+		VkImageMemoryBarrier barrier{ VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER };
+		barrier.srcAccessMask = srcAccess;
+		barrier.dstAccessMask = access;
+		barrier.oldLayout = oldLayout;
+		barrier.newLayout = layout;
+		barrier.srcQueueFamilyIndex = barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		barrier.image = image;
+		barrier.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, level, 1, 0, 1 };
+		ImageBarriers.push_back(barrier);
+	}
+}
+
+void HA::BarrierBatch::Memory(VkPipelineStageFlags srcStage, VkAccessFlags srcAccess, VkPipelineStageFlags dstStage, VkAccessFlags dstAccess)
+{
+	srcStage &= QueueStages;
+	if (!srcStage)
+		return;
+	VkMemoryBarrier barrier{ VK_STRUCTURE_TYPE_MEMORY_BARRIER };
+	barrier.srcAccessMask = srcAccess & GetStageAccess(srcStage);
+	barrier.dstAccessMask = dstAccess;
+	MemoryBarriers.push_back(barrier);
+	SrcStages |= srcStage;
+	DstStages |= dstStage;
+}
+
+void HA::BarrierBatch::Record()
+{
+	if (MemoryBarriers.empty() && BufferBarriers.empty() && ImageBarriers.empty())
+		return;
+	// Nothing to wait for, only layout transitions of resources that were never used
+	if (!SrcStages)
+		SrcStages = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
+	vkCmdPipelineBarrier(Cmd, SrcStages, DstStages, 0, (uint32_t)MemoryBarriers.size(), MemoryBarriers.data(),
+		(uint32_t)BufferBarriers.size(), BufferBarriers.data(), (uint32_t)ImageBarriers.size(), ImageBarriers.data());
+	MemoryBarriers.clear();
+	BufferBarriers.clear();
+	ImageBarriers.clear();
+	SrcStages = DstStages = 0;
+}
+
+bool HA::BarrierBatch::Resolve(ResourceState& state, VkPipelineStageFlags stage, VkAccessFlags access, VkImageLayout layout,
+	VkAccessFlags& srcAccess)
+{
+	// Host accesses are ordered by the submission and the fence wait, only their visibility needs a barrier
+	VkPipelineStageFlags deviceStage = stage & ~VK_PIPELINE_STAGE_HOST_BIT;
+	VkPipelineStageFlags srcStage;
+	bool transition = layout != state.Layout;
+	if ((access & WRITE_ACCESS) || transition) {
+		// Wait for every access since the last write, only the write itself needs to be made available
+		srcStage = (state.WriteStages | state.ReadStages) & QueueStages;
+		srcAccess = state.WriteAccess & GetStageAccess(srcStage);
+		bool write = (access & WRITE_ACCESS) != 0;
+		state.WriteStages = deviceStage;
+		state.WriteAccess = access & WRITE_ACCESS;
+		state.VisibleStages = write ? 0 : stage;
+		state.VisibleAccess = write ? 0 : access;
+		state.ReadStages = write ? 0 : deviceStage;
+		state.Layout = layout;
+		if (!transition && !srcStage)
+			return false;
+	}
+	else {
+		state.ReadStages |= deviceStage;
+		// Read after read, or the write is already visible to this stage
+		if (!state.WriteStages || ((state.VisibleStages & stage) == stage && (state.VisibleAccess & access) == access))
+			return false;
+		srcStage = state.WriteStages & QueueStages;
+		srcAccess = state.WriteAccess & GetStageAccess(srcStage);
+		state.VisibleStages |= stage;
+		state.VisibleAccess |= access;
+		if (!srcStage)
+			return false;
+	}
+	SrcStages |= srcStage;
+	DstStages |= stage;
+	return true;
+}
@@ -0,0 +1,91 @@
+#pragma once
+// This file is only for internal use by the api
+#include <vulkan/vulkan_core.h>
+#include <cstdint>
+#include <vector>
+
+namespace HA {
+
+	class GPBuffer;
+	class GPImage;
+	struct ImplementationContext;
+
+	/// <summary>
+	/// Accesses to a buffer or to one mip level of an image since its last write. Commands are
+	/// submitted in the order they are recorded, so recording order is taken as execution order.
+	/// Zero initialized it describes a resource that was never used.
+	/// </summary>
+	struct ResourceState {
+		/// <summary>
+		/// Stage and access of the last write, a layout transition counts as a write without access.
+		/// </summary>
+		VkPipelineStageFlags WriteStages;
+		VkAccessFlags WriteAccess;
+		/// <summary>
+		/// Stages and accesses the last write was already made visible to.
+		/// </summary>
+		VkPipelineStageFlags VisibleStages;
+		VkAccessFlags VisibleAccess;
+		/// <summary>
+		/// Stages that read since the last write, the next write or transition waits for them.
+		/// </summary>
+		VkPipelineStageFlags ReadStages;
+		VkImageLayout Layout;
+	};
+
+	/// <summary>
+	/// Collects the barriers the resource accesses of one command need and records them as a
+	/// single vkCmdPipelineBarrier. Reads of data that is already visible to their stage need
+	/// no barrier, writes after reads only an execution dependency.
+	/// Call Access() once per resource and command, with the union of its accesses.
+	/// </summary>
+	class BarrierBatch {
+
+	public:
+		BarrierBatch(const ImplementationContext* Context, VkCommandBuffer cmd);
+		BarrierBatch(const BarrierBatch& copy) = delete;
+		BarrierBatch(const BarrierBatch&& move) = delete;
+
+		void Access(GPBuffer* buffer, VkPipelineStageFlags stage, VkAccessFlags access);
+		/// <summary>
+		/// Accesses levelCount mip levels from baseLevel in layout, 0 means all remaining levels.
+		/// </summary>
+		void Access(GPImage* image, VkPipelineStageFlags stage, VkAccessFlags access, VkImageLayout layout,
+			uint32_t baseLevel = 0, uint32_t levelCount = 0);
+		/// <summary>
+		/// Resources that are no GPBuffer or GPImage, the caller keeps their state.
+		/// </summary>
+		void Access(VkBuffer buffer, ResourceState& state, VkPipelineStageFlags stage, VkAccessFlags access);
+		void Access(VkImage image, ResourceState* levels, uint32_t baseLevel, uint32_t levelCount,
+			VkPipelineStageFlags stage, VkAccessFlags access, VkImageLayout layout);
+
+		/// <summary>
+		/// Global dependency for memory that is reached through another buffer or image, like aliased
+		/// resources. Buffer and image barriers only cover accesses through their own handle.
+		/// </summary>
+		void Memory(VkPipelineStageFlags srcStage, VkAccessFlags srcAccess, VkPipelineStageFlags dstStage, VkAccessFlags dstAccess);
+
+		/// <summary>
+		/// Records the barriers collected so far, if any. The batch can be reused for the next command.
+		/// </summary>
+		void Record();
+
+	private:
+		bool Resolve(ResourceState& state, VkPipelineStageFlags stage, VkAccessFlags access, VkImageLayout layout,
+			VkAccessFlags& srcAccess);
+
+	private:
+		VkCommandBuffer Cmd;
+		/// <summary>
+		/// Stages of the queue cmd belongs to, earlier accesses at other stages ran on the
+		/// other queue and are ordered by the semaphore between them.
+		/// </summary>
+		VkPipelineStageFlags QueueStages;
+		VkPipelineStageFlags SrcStages;
+		VkPipelineStageFlags DstStages;
+		std::vector<VkMemoryBarrier> MemoryBarriers;
+		std::vector<VkBufferMemoryBarrier> BufferBarriers;
+		std::vector<VkImageMemoryBarrier> ImageBarriers;
+	};
+
+}
@@ -0,0 +1,162 @@
+#define _CRT_SECURE_NO_WARNINGS
+#include "ShaderCache.hpp"
+#include "ImplementationContext.hpp"
+#include <stdio.h>
+#include <cstring>
+#include <filesystem>
+#include <random>
+
+// Bump when the compile options in ComputeShader::Load change so stale SPIR-V is not reused.
+#define SPIRV_CACHE_VERSION "HA-SPIRV-1-performance"
+#define SPIRV_MAGIC (0x07230203u)
+
+HA::ShaderCache::ShaderCache(const ImplementationContext* Context, const std::string& Directory)
+	: Context(Context), Directory(Directory), PipelineCache(VK_NULL_HANDLE)
+{
+	vkGetPhysicalDeviceProperties(Context->PhysicalDevice, &DeviceProperties);
+
+	std::vector<uint8_t> data;
+	if (!Directory.empty()) {
+		std::error_code error;
+		std::filesystem::create_directories(Directory, error);
+		char name[96];
+		snprintf(name, sizeof(name), "pipeline_%08x_%08x_%08x.bin",
+			DeviceProperties.vendorID, DeviceProperties.deviceID, DeviceProperties.driverVersion);
+		PipelineCachePath = (std::filesystem::path(Directory) / name).string();
+
+		// Drivers are supposed to reject foreign data, but not all of them do.
+		if (ReadFile(PipelineCachePath, data)) {
+			VkPipelineCacheHeaderVersionOne header;
+			bool valid = data.size() >= sizeof(header);
+			if (valid) {
+				memcpy(&header, data.data(), sizeof(header));
+				valid = header.headerVersion == VK_PIPELINE_CACHE_HEADER_VERSION_ONE &&
+					header.vendorID == DeviceProperties.vendorID &&
+					header.deviceID == DeviceProperties.deviceID &&
+					memcmp(header.pipelineCacheUUID, DeviceProperties.pipelineCacheUUID, VK_UUID_SIZE) == 0;
+			}
+			if (!valid) {
+				if (Context->Logger)
+					Context->Logger->Print("Discarding pipeline cache created by a different device or driver.");
+				data.clear();
+			}
+		}
+	}
+
+	VkPipelineCacheCreateInfo createInfo{ VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO };
+	createInfo.initialDataSize = data.size();
+	createInfo.pInitialData = data.size() ? data.data() : nullptr;
+	VkResult result = vkCreatePipelineCache(Context->Device, &createInfo, Context->AllocationCallbacks, &PipelineCache);
+	if (result != VK_SUCCESS && data.size()) {
+		createInfo.initialDataSize = 0;
+		createInfo.pInitialData = nullptr;
+		result = vkCreatePipelineCache(Context->Device, &createInfo, Context->AllocationCallbacks, &PipelineCache);
+	}
+	if (result != VK_SUCCESS) {
+		PipelineCache = VK_NULL_HANDLE;
+		if (Context->Logger)
+			Context->Logger->Print(("Could not create pipeline cache. " + GetStringFromResult(result)).c_str());
+	}
+}
+
+HA::ShaderCache::~ShaderCache()
+{
+	Save();
+	if (PipelineCache)
+		vkDestroyPipelineCache(Context->Device, PipelineCache, Context->AllocationCallbacks);
+}
+
+bool HA::ShaderCache::LoadSpirv(const void* sourceCode, uint32_t length, std::vector<uint32_t>& spirv)
+{
+	if (Directory.empty())
+		return false;
+	std::vector<uint8_t> data;
+	if (!ReadFile(GetSpirvPath(sourceCode, length), data))
+		return false;
+	if (data.size() < sizeof(uint32_t) || data.size() % sizeof(uint32_t) != 0)
+		return false;
+	spirv.resize(data.size() / sizeof(uint32_t));
+	memcpy(spirv.data(), data.data(), data.size());
+	return spirv[0] == SPIRV_MAGIC;
+}
+
+void HA::ShaderCache::StoreSpirv(const void* sourceCode, uint32_t length, const std::vector<uint32_t>& spirv)
+{
+	if (Directory.empty())
+		return;
+	if (!WriteFile(GetSpirvPath(sourceCode, length), spirv.data(), spirv.size() * sizeof(uint32_t)) && Context->Logger)
+		Context->Logger->Print("Could not write SPIR-V to the shader cache.");
+}
+
+void HA::ShaderCache::Save()
+{
+	if (Directory.empty() || !PipelineCache)
+		return;
+	size_t size = 0;
+	if (vkGetPipelineCacheData(Context->Device, PipelineCache, &size, nullptr) != VK_SUCCESS || size == 0)
+		return;
+	std::vector<uint8_t> data(size);
+	if (vkGetPipelineCacheData(Context->Device, PipelineCache, &size, data.data()) != VK_SUCCESS)
+		return;
+	if (!WriteFile(PipelineCachePath, data.data(), size) && Context->Logger)
+		Context->Logger->Print("Could not write the pipeline cache.");
+}
+
+uint64_t HA::ShaderCache::Hash(const void* data, uint64_t length, uint64_t seed)
+{
+	// 64 bit FNV-1a
+	uint64_t hash = seed;
+	auto bytes = (const uint8_t*)data;
+	for (uint64_t i = 0; i < length; i++) {
+		hash ^= bytes[i];
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+std::string HA::ShaderCache::GetSpirvPath(const void* sourceCode, uint32_t length)
+{
+	uint64_t hash = Hash(SPIRV_CACHE_VERSION, sizeof(SPIRV_CACHE_VERSION) - 1);
+	hash = Hash(sourceCode, length, hash);
+	char name[32];
+	snprintf(name, sizeof(name), "%016llx.spv", (unsigned long long)hash);
+	return (std::filesystem::path(Directory) / name).string();
+}
+
+bool HA::ShaderCache::ReadFile(const std::string& path, std::vector<uint8_t>& data)
+{
+	FILE* io = fopen(path.c_str(), "rb");
+	if (!io)
+		return false;
+	fseek(io, 0, SEEK_END);
+	long size = ftell(io);
+	fseek(io, 0, SEEK_SET);
+	data.resize(size > 0 ? size : 0);
+	bool success = size > 0 && fread(data.data(), 1, data.size(), io) == data.size();
+	fclose(io);
+	return success;
+}
+
+bool HA::ShaderCache::WriteFile(const std::string& path, const void* data, uint64_t size)
+{
+	// Write next to the target and rename so another process never reads a partial file.
+	// The temporary name is unique, processes compiling the same shader must not share it.
+	std::lock_guard<std::mutex> guard(Lock);
+	std::random_device random;
+	char suffix[32];
+	snprintf(suffix, sizeof(suffix), ".%08x%08x.tmp", random(), random());
+	std::string temporary = path + suffix;
+	FILE* io = fopen(temporary.c_str(), "wb");
+	if (!io)
+		return false;
+	bool success = fwrite(data, 1, size, io) == size;
+	success &= fclose(io) == 0;
+	std::error_code error;
+	if (success)
+		std::filesystem::rename(temporary, path, error);
+	if (!success || error) {
+		std::filesystem::remove(temporary, error);
+		return false;
+	}
+	return true;
+}
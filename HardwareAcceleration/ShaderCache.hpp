@@ -0,0 +1,64 @@
+#pragma once
+// This file is only for internal use by the api
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <vulkan/vulkan_core.h>
+
+namespace HA {
+
+	struct ImplementationContext;
+
+	/// <summary>
+	/// Persists compiled SPIR-V and the VkPipelineCache between runs.
+	/// SPIR-V is stored per source hash as &lt;Directory&gt;/&lt;hash&gt;.spv, the pipeline cache
+	/// is stored per device and driver version and is discarded if its header does not match.
+	/// An empty Directory disables the disk cache, PipelineCache is still created.
+	/// </summary>
+	class ShaderCache {
+
+	public:
+		ShaderCache(const ImplementationContext* Context, const std::string& Directory);
+		/// <summary>
+		/// Stores the pipeline cache to disk.
+		/// </summary>
+		~ShaderCache();
+		ShaderCache(const ShaderCache& copy) = delete;
+		ShaderCache(const ShaderCache&& move) = delete;
+
+		/// <summary>
+		/// Looks up the SPIR-V compiled from the source code.
+		/// </summary>
+		/// <returns>True if the cached SPIR-V was found and is valid</returns>
+		bool LoadSpirv(const void* sourceCode, uint32_t length, std::vector<uint32_t>& spirv);
+
+		/// <summary>
+		/// Stores the SPIR-V compiled from the source code.
+		/// </summary>
+		void StoreSpirv(const void* sourceCode, uint32_t length, const std::vector<uint32_t>& spirv);
+
+		/// <summary>
+		/// Writes the pipeline cache to disk, called on destruction.
+		/// </summary>
+		void Save();
+
+		static uint64_t Hash(const void* data, uint64_t length, uint64_t seed = 14695981039346656037ull);
+
+	public:
+		const ImplementationContext* Context;
+		const std::string Directory;
+		VkPipelineCache PipelineCache;
+
+	private:
+		std::string GetSpirvPath(const void* sourceCode, uint32_t length);
+		bool ReadFile(const std::string& path, std::vector<uint8_t>& data);
+		bool WriteFile(const std::string& path, const void* data, uint64_t size);
+
+	private:
+		std::string PipelineCachePath;
+		VkPhysicalDeviceProperties DeviceProperties;
+		std::mutex Lock;
+	};
+
+}
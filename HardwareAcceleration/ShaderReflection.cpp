@@ -0,0 +1,327 @@
+#include "ShaderReflection.hpp"
+#include <cstring>
+#include <stdexcept>
+#include <unordered_map>
+
+// SPIR-V opcodes, decorations and enums used below (SPIR-V 1.0 specification).
+#define SPV_MAGIC (0x07230203u)
+#define SPV_OP_NAME (5)
+#define SPV_OP_EXECUTION_MODE (16)
+#define SPV_OP_TYPE_BOOL (20)
+#define SPV_OP_TYPE_INT (21)
+#define SPV_OP_TYPE_FLOAT (22)
+#define SPV_OP_TYPE_VECTOR (23)
+#define SPV_OP_TYPE_MATRIX (24)
+#define SPV_OP_TYPE_IMAGE (25)
+#define SPV_OP_TYPE_SAMPLER (26)
+#define SPV_OP_TYPE_SAMPLED_IMAGE (27)
+#define SPV_OP_TYPE_ARRAY (28)
+#define SPV_OP_TYPE_RUNTIME_ARRAY (29)
+#define SPV_OP_TYPE_STRUCT (30)
+#define SPV_OP_TYPE_POINTER (32)
+#define SPV_OP_CONSTANT (43)
+#define SPV_OP_CONSTANT_COMPOSITE (44)
+#define SPV_OP_SPEC_CONSTANT_TRUE (48)
+#define SPV_OP_SPEC_CONSTANT_FALSE (49)
+#define SPV_OP_SPEC_CONSTANT (50)
+#define SPV_OP_SPEC_CONSTANT_COMPOSITE (51)
+#define SPV_OP_VARIABLE (59)
+#define SPV_OP_DECORATE (71)
+#define SPV_OP_MEMBER_DECORATE (72)
+#define SPV_DECORATION_SPEC_ID (1)
+#define SPV_DECORATION_BLOCK (2)
+#define SPV_DECORATION_BUFFER_BLOCK (3)
+#define SPV_DECORATION_ARRAY_STRIDE (6)
+#define SPV_DECORATION_BUILTIN (11)
+#define SPV_DECORATION_BINDING (33)
+#define SPV_DECORATION_DESCRIPTOR_SET (34)
+#define SPV_DECORATION_OFFSET (35)
+#define SPV_BUILTIN_WORKGROUP_SIZE (25)
+#define SPV_EXECUTION_MODE_LOCAL_SIZE (17)
+#define SPV_STORAGE_UNIFORM_CONSTANT (0)
+#define SPV_STORAGE_UNIFORM (2)
+#define SPV_STORAGE_PUSH_CONSTANT (9)
+#define SPV_STORAGE_STORAGE_BUFFER (12)
+#define SPV_DIM_BUFFER (5)
+
+namespace HA {
+
+	struct SpirvDecorations {
+		uint32_t Set = 0;
+		uint32_t Binding = UINT32_MAX;
+		uint32_t ArrayStride = 0;
+		uint32_t SpecId = UINT32_MAX;
+		bool Block = false;
+		bool BufferBlock = false;
+		bool WorkgroupSize = false;
+		std::vector<uint32_t> MemberOffsets;
+	};
+
+	struct SpirvModule {
+		// Operands after the result id for every type and constant.
+		std::unordered_map<uint32_t, std::pair<uint32_t, std::vector<uint32_t>>> Definitions;
+		std::unordered_map<uint32_t, SpirvDecorations> Decorations;
+		std::unordered_map<uint32_t, std::string> Names;
+
+		uint32_t GetSize(uint32_t type) const;
+		uint32_t GetConstant(uint32_t id) const;
+	};
+
+	static std::string ReadString(const uint32_t* words, uint32_t count)
+	{
+		size_t length = strnlen((const char*)words, count * sizeof(uint32_t));
+		return std::string((const char*)words, length);
+	}
+
+	uint32_t SpirvModule::GetSize(uint32_t type) const
+	{
+		auto it = Definitions.find(type);
+		if (it == Definitions.end())
+			return 0;
+		auto& [opcode, operands] = it->second;
+		switch (opcode) {
+		case SPV_OP_TYPE_BOOL:
+			return 4;
+		case SPV_OP_TYPE_INT:
+		case SPV_OP_TYPE_FLOAT:
+			return operands[0] / 8;
+		case SPV_OP_TYPE_VECTOR:
+		case SPV_OP_TYPE_MATRIX:
+			return GetSize(operands[0]) * operands[1];
+		case SPV_OP_TYPE_ARRAY: {
+			auto decoration = Decorations.find(type);
+			uint32_t stride = decoration != Decorations.end() && decoration->second.ArrayStride ?
+				decoration->second.ArrayStride : GetSize(operands[0]);
+			return stride * GetConstant(operands[1]);
+		}
+		case SPV_OP_TYPE_STRUCT: {
+			auto decoration = Decorations.find(type);
+			uint32_t size = 0;
+			for (uint32_t i = 0; i < operands.size(); i++) {
+				uint32_t offset = size;
+				if (decoration != Decorations.end() && i < decoration->second.MemberOffsets.size())
+					offset = decoration->second.MemberOffsets[i];
+				uint32_t end = offset + GetSize(operands[i]);
+				if (end > size)
+					size = end;
+			}
+			return size;
+		}
+		default:
+			return 0;
+		}
+	}
+
+	uint32_t SpirvModule::GetConstant(uint32_t id) const
+	{
+		auto it = Definitions.find(id);
+		if (it == Definitions.end())
+			return 0;
+		auto& [opcode, operands] = it->second;
+		// operands[0] is the result type
+		if ((opcode == SPV_OP_CONSTANT || opcode == SPV_OP_SPEC_CONSTANT) && operands.size() > 1)
+			return operands[1];
+		return 0;
+	}
+
+}
+
+HA::ShaderReflection::ShaderReflection(const uint32_t* code, size_t wordCount)
+	: PushConstantSize(0), WorkgroupSize{ 1, 1, 1 }, WorkgroupSizeSpecIds{ -1, -1, -1 }
+{
+	if (wordCount < 5 || code[0] != SPV_MAGIC)
+		throw std::runtime_error("HA::ShaderReflection Invalid SPIR-V header.");
+
+	SpirvModule module;
+	struct Variable { uint32_t Type; uint32_t Id; uint32_t StorageClass; };
+	std::vector<Variable> variables;
+	std::vector<uint32_t> specConstants;
+
+	for (size_t i = 5; i < wordCount;) {
+		uint32_t opcode = code[i] & 0xffff;
+		uint32_t count = code[i] >> 16;
+		if (count == 0 || i + count > wordCount)
+			throw std::runtime_error("HA::ShaderReflection Malformed SPIR-V instruction.");
+		const uint32_t* operands = code + i + 1;
+		uint32_t operandCount = count - 1;
+
+		switch (opcode) {
+		case SPV_OP_NAME:
+			if (operandCount >= 2)
+				module.Names[operands[0]] = ReadString(operands + 1, operandCount - 1);
+			break;
+		case SPV_OP_EXECUTION_MODE:
+			if (operandCount >= 5 && operands[1] == SPV_EXECUTION_MODE_LOCAL_SIZE) {
+				WorkgroupSize[0] = operands[2];
+				WorkgroupSize[1] = operands[3];
+				WorkgroupSize[2] = operands[4];
+			}
+			break;
+		case SPV_OP_DECORATE: {
+			if (operandCount < 2)
+				break;
+			auto& decoration = module.Decorations[operands[0]];
+			uint32_t value = operandCount >= 3 ? operands[2] : 0;
+			switch (operands[1]) {
+			case SPV_DECORATION_SPEC_ID: decoration.SpecId = value; break;
+			case SPV_DECORATION_BLOCK: decoration.Block = true; break;
+			case SPV_DECORATION_BUFFER_BLOCK: decoration.BufferBlock = true; break;
+			case SPV_DECORATION_ARRAY_STRIDE: decoration.ArrayStride = value; break;
+			case SPV_DECORATION_BINDING: decoration.Binding = value; break;
+			case SPV_DECORATION_DESCRIPTOR_SET: decoration.Set = value; break;
+			case SPV_DECORATION_BUILTIN: decoration.WorkgroupSize = value == SPV_BUILTIN_WORKGROUP_SIZE; break;
+			}
+			break;
+		}
+		case SPV_OP_MEMBER_DECORATE:
+			if (operandCount >= 4 && operands[2] == SPV_DECORATION_OFFSET) {
+				auto& offsets = module.Decorations[operands[0]].MemberOffsets;
+				if (offsets.size() <= operands[1])
+					offsets.resize(operands[1] + 1, 0);
+				offsets[operands[1]] = operands[3];
+			}
+			break;
+		case SPV_OP_TYPE_BOOL:
+		case SPV_OP_TYPE_INT:
+		case SPV_OP_TYPE_FLOAT:
+		case SPV_OP_TYPE_VECTOR:
+		case SPV_OP_TYPE_MATRIX:
+		case SPV_OP_TYPE_IMAGE:
+		case SPV_OP_TYPE_SAMPLER:
+		case SPV_OP_TYPE_SAMPLED_IMAGE:
+		case SPV_OP_TYPE_ARRAY:
+		case SPV_OP_TYPE_RUNTIME_ARRAY:
+		case SPV_OP_TYPE_STRUCT:
+		case SPV_OP_TYPE_POINTER:
+			if (operandCount >= 1)
+				module.Definitions[operands[0]] = { opcode, std::vector<uint32_t>(operands + 1, operands + operandCount) };
+			break;
+		case SPV_OP_CONSTANT:
+		case SPV_OP_CONSTANT_COMPOSITE:
+		case SPV_OP_SPEC_CONSTANT:
+		case SPV_OP_SPEC_CONSTANT_TRUE:
+		case SPV_OP_SPEC_CONSTANT_FALSE:
+		case SPV_OP_SPEC_CONSTANT_COMPOSITE:
+			// Constants put the result type first, keep it so the layout matches the types above.
+			if (operandCount >= 2) {
+				std::vector<uint32_t> values{ operands[0] };
+				values.insert(values.end(), operands + 2, operands + operandCount);
+				module.Definitions[operands[1]] = { opcode, values };
+				if (opcode == SPV_OP_SPEC_CONSTANT || opcode == SPV_OP_SPEC_CONSTANT_TRUE || opcode == SPV_OP_SPEC_CONSTANT_FALSE)
+					specConstants.push_back(operands[1]);
+			}
+			break;
+		case SPV_OP_VARIABLE:
+			if (operandCount >= 3)
+				variables.push_back({ operands[0], operands[1], operands[2] });
+			break;
+		}
+		i += count;
+	}
+
+	// The WorkgroupSize builtin overrides the LocalSize execution mode.
+	for (auto& [id, decoration] : module.Decorations) {
+		if (!decoration.WorkgroupSize)
+			continue;
+		auto it = module.Definitions.find(id);
+		if (it != module.Definitions.end() && it->second.second.size() == 4) {
+			for (int c = 0; c < 3; c++) {
+				uint32_t component = it->second.second[c + 1];
+				WorkgroupSize[c] = module.GetConstant(component);
+				auto specialized = module.Decorations.find(component);
+				if (specialized != module.Decorations.end() && specialized->second.SpecId != UINT32_MAX)
+					WorkgroupSizeSpecIds[c] = (int32_t)specialized->second.SpecId;
+			}
+		}
+	}
+
+	for (auto id : specConstants) {
+		auto decoration = module.Decorations.find(id);
+		if (decoration == module.Decorations.end() || decoration->second.SpecId == UINT32_MAX)
+			continue;
+		ReflectedConstant constant{};
+		constant.Name = module.Names[id];
+		constant.Id = decoration->second.SpecId;
+		auto& [opcode, operands] = module.Definitions[id];
+		constant.Size = module.GetSize(operands[0]);
+		constant.DefaultValue = opcode == SPV_OP_SPEC_CONSTANT_TRUE ? 1 : opcode == SPV_OP_SPEC_CONSTANT_FALSE ? 0 : module.GetConstant(id);
+		SpecializationConstants.push_back(constant);
+	}
+
+	for (auto& variable : variables) {
+		auto pointer = module.Definitions.find(variable.Type);
+		if (pointer == module.Definitions.end() || pointer->second.first != SPV_OP_TYPE_POINTER)
+			continue;
+		uint32_t type = pointer->second.second[1];
+
+		if (variable.StorageClass == SPV_STORAGE_PUSH_CONSTANT) {
+			PushConstantSize = module.GetSize(type);
+			continue;
+		}
+		if (variable.StorageClass != SPV_STORAGE_UNIFORM_CONSTANT && variable.StorageClass != SPV_STORAGE_UNIFORM &&
+			variable.StorageClass != SPV_STORAGE_STORAGE_BUFFER)
+			continue;
+		auto& decoration = module.Decorations[variable.Id];
+		if (decoration.Binding == UINT32_MAX)
+			continue;
+
+		ReflectedBinding binding{};
+		binding.Set = decoration.Set;
+		binding.Binding = decoration.Binding;
+		binding.Count = 1;
+		// Unwrap arrays of descriptors
+		auto definition = module.Definitions.find(type);
+		while (definition != module.Definitions.end() &&
+			(definition->second.first == SPV_OP_TYPE_ARRAY || definition->second.first == SPV_OP_TYPE_RUNTIME_ARRAY)) {
+			if (definition->second.first == SPV_OP_TYPE_ARRAY)
+				binding.Count *= module.GetConstant(definition->second.second[1]);
+			type = definition->second.second[0];
+			definition = module.Definitions.find(type);
+		}
+		if (definition == module.Definitions.end())
+			continue;
+
+		switch (definition->second.first) {
+		case SPV_OP_TYPE_IMAGE: {
+			// operands: sampled type, dim, depth, arrayed, ms, sampled, format
+			auto& operands = definition->second.second;
+			bool storage = operands.size() > 5 && operands[5] == 2;
+			// Nothing can bind a VkBufferView, fail here rather than on every dispatch
+			if (operands.size() > 1 && operands[1] == SPV_DIM_BUFFER)
+				throw std::runtime_error("HA::ShaderReflection Texel buffer " + module.Names[variable.Id] + " is not supported, use a storage buffer.");
+			binding.Type = storage ? VK_DESCRIPTOR_TYPE_STORAGE_IMAGE : VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE;
+			break;
+		}
+		case SPV_OP_TYPE_SAMPLED_IMAGE:
+			binding.Type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+			break;
+		case SPV_OP_TYPE_SAMPLER:
+			binding.Type = VK_DESCRIPTOR_TYPE_SAMPLER;
+			break;
+		case SPV_OP_TYPE_STRUCT:
+			binding.Type = variable.StorageClass == SPV_STORAGE_STORAGE_BUFFER || module.Decorations[type].BufferBlock ?
+				VK_DESCRIPTOR_TYPE_STORAGE_BUFFER : VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+			binding.TypeName = module.Names[type];
+			break;
+		default:
+			continue;
+		}
+		binding.Name = module.Names[variable.Id];
+		if (binding.Name.empty())
+			binding.Name = binding.TypeName;
+		Bindings.push_back(binding);
+	}
+}
+
+const HA::ReflectedBinding* HA::ShaderReflection::Find(const char* name) const
+{
+	for (auto& binding : Bindings) {
+		if (binding.Name == name)
+			return &binding;
+	}
+	for (auto& binding : Bindings) {
+		if (!binding.TypeName.empty() && binding.TypeName == name)
+			return &binding;
+	}
+	return nullptr;
+}
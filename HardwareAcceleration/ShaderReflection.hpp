@@ -0,0 +1,71 @@
+#pragma once
+// This file is only for internal use by the api
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <vulkan/vulkan_core.h>
+
+namespace HA {
+
+	struct ReflectedBinding {
+		/// <summary>
+		/// Variable name, for anonymous blocks the block name.
+		/// </summary>
+		std::string Name;
+		/// <summary>
+		/// Block or struct type name, empty for images and samplers.
+		/// </summary>
+		std::string TypeName;
+		uint32_t Set;
+		uint32_t Binding;
+		uint32_t Count;
+		VkDescriptorType Type;
+	};
+
+	struct ReflectedConstant {
+		std::string Name;
+		uint32_t Id;
+		/// <summary>
+		/// Size in bytes, 4 for bool, 32 bit int and float.
+		/// </summary>
+		uint32_t Size;
+		/// <summary>
+		/// 32 bit pattern of the default value, booleans are 0 or 1.
+		/// </summary>
+		uint32_t DefaultValue;
+	};
+
+	/// <summary>
+	/// Minimal SPIR-V reflection of a compute shader: descriptor bindings,
+	/// push constant block size, specialization constants and workgroup size.
+	/// Throws std::runtime_error if the code is not valid SPIR-V.
+	/// </summary>
+	class ShaderReflection {
+
+	public:
+		ShaderReflection(const uint32_t* code, size_t wordCount);
+
+		/// <summary>
+		/// Finds a binding by variable or block name.
+		/// </summary>
+		/// <returns>nullptr if not found</returns>
+		const ReflectedBinding* Find(const char* name) const;
+
+	public:
+		std::vector<ReflectedBinding> Bindings;
+		/// <summary>
+		/// Size in bytes of the push constant block, 0 if the shader has none.
+		/// </summary>
+		uint32_t PushConstantSize;
+		std::vector<ReflectedConstant> SpecializationConstants;
+		/// <summary>
+		/// Workgroup size with the default specialization constant values.
+		/// </summary>
+		uint32_t WorkgroupSize[3];
+		/// <summary>
+		/// Specialization constant id of each workgroup dimension (local_size_x_id), -1 if fixed.
+		/// </summary>
+		int32_t WorkgroupSizeSpecIds[3];
+	};
+
+}
@@ -0,0 +1,74 @@
+#include "StagingPool.hpp"
+#include "ImplementationContext.hpp"
+#include "ImplementionManagedTypes.hpp"
+
+// Smallest bucket is 4KB so tiny uploads share buffers.
+#define MIN_BUCKET (12)
+
+HA::StagingPool::StagingPool(const ImplementationContext* Context, uint64_t MaxCachedBytes)
+	: Context(Context), MaxCachedBytes(MaxCachedBytes), CachedBytes(0)
+{}
+
+HA::StagingPool::~StagingPool()
+{
+	Trim();
+}
+
+HA::GPBuffer* HA::StagingPool::Acquire(uint64_t size)
+{
+	uint32_t bucket = GetBucket(size);
+	{
+		std::lock_guard<std::mutex> guard(Lock);
+		auto& buffers = FreeBuffers[bucket];
+		if (buffers.size() > 0) {
+			GPBuffer* buffer = buffers.back();
+			buffers.pop_back();
+			CachedBytes -= buffer->Size;
+			return buffer;
+		}
+	}
+	GPBuffer* buffer = new GPBuffer(Context, GPGPUMemoryType::Host, 1ull << bucket);
+	buffer->MapBuffer();
+	return buffer;
+}
+
+void HA::StagingPool::Release(VkCommandBuffer cmd, GPBuffer* buffer)
+{
+	Context->_CommandThread->AddPostExectute(cmd, [this, buffer]() {
+		Release(buffer);
+	});
+}
+
+void HA::StagingPool::Release(GPBuffer* buffer)
+{
+	// Every use has retired, the next one needs no barrier against them
+	const_cast<ImplementationManagedBuffer*>(buffer->Buffer)->State = {};
+	{
+		std::lock_guard<std::mutex> guard(Lock);
+		if (CachedBytes + buffer->Size <= MaxCachedBytes) {
+			FreeBuffers[GetBucket(buffer->Size)].push_back(buffer);
+			CachedBytes += buffer->Size;
+			return;
+		}
+	}
+	delete buffer;
+}
+
+void HA::StagingPool::Trim()
+{
+	std::lock_guard<std::mutex> guard(Lock);
+	for (auto& [bucket, buffers] : FreeBuffers) {
+		for (auto buffer : buffers)
+			delete buffer;
+		buffers.clear();
+	}
+	CachedBytes = 0;
+}
+
+uint32_t HA::StagingPool::GetBucket(uint64_t size)
+{
+	uint32_t bucket = MIN_BUCKET;
+	while ((1ull << bucket) < size)
+		bucket++;
+	return bucket;
+}
@@ -0,0 +1,58 @@
+#pragma once
+// This file is only for internal use by the api
+#include "GPGPUMemory.hpp"
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <vector>
+
+namespace HA {
+
+	struct ImplementationContext;
+
+	/// <summary>
+	/// Recycles the Host memory staging buffers used by Static memory transfers.
+	/// Buffers are bucketed by power of two size and stay mapped for their whole lifetime.
+	/// </summary>
+	class StagingPool {
+
+	public:
+		StagingPool(const ImplementationContext* Context, uint64_t MaxCachedBytes = 256ull * 1024 * 1024);
+		~StagingPool();
+		StagingPool(const StagingPool& copy) = delete;
+		StagingPool(const StagingPool&& move) = delete;
+
+		/// <summary>
+		/// Returns a mapped Host memory buffer of at least size bytes.
+		/// </summary>
+		GPBuffer* Acquire(uint64_t size);
+
+		/// <summary>
+		/// Returns the buffer to the pool once cmd has executed.
+		/// </summary>
+		void Release(VkCommandBuffer cmd, GPBuffer* buffer);
+
+		/// <summary>
+		/// Returns the buffer to the pool right away, the device must be done with it.
+		/// </summary>
+		void Release(GPBuffer* buffer);
+
+		/// <summary>
+		/// Destroys every buffer that is not currently in use.
+		/// </summary>
+		void Trim();
+
+	public:
+		const ImplementationContext* Context;
+		const uint64_t MaxCachedBytes;
+
+	private:
+		static uint32_t GetBucket(uint64_t size);
+
+	private:
+		std::map<uint32_t, std::vector<GPBuffer*>> FreeBuffers;
+		uint64_t CachedBytes;
+		std::mutex Lock;
+	};
+
+}
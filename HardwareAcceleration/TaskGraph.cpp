@@ -0,0 +1,423 @@
+#include "TaskGraph.hpp"
+#include "ComputeShader.hpp"
+#include "GPGPUMemory.hpp"
+#include "ImplementationContext.hpp"
+#include "ImplementionManagedTypes.hpp"
+#include "MemoryStatistics.hpp"
+#include "Profiler.hpp"
+#include "ResourceTracker.hpp"
+#include "ShaderReflection.hpp"
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <stdexcept>
+#include <string>
+
+static bool IsImageBinding(VkDescriptorType type)
+{
+	return type == VK_DESCRIPTOR_TYPE_STORAGE_IMAGE || type == VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE ||
+		type == VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+}
+
+HA::GPTaskGraph::GPTaskGraph(const ImplementationContext* Context)
+	: Context(Context), TransientBytes(0), AllocatedBytes(0), Changed(true), LastSubmission(0)
+{
+}
+
+HA::GPTaskGraph::~GPTaskGraph()
+{
+	Release();
+}
+
+HA::GPTaskResource HA::GPTaskGraph::Import(GPBuffer* buffer)
+{
+	for (GPTaskResource index = 0; index < Resources.size(); index++) {
+		if (!Resources[index].Transient && Resources[index].Buffer == buffer)
+			return index;
+	}
+	Resource resource{};
+	resource.Buffer = buffer;
+	return Add(resource);
+}
+
+HA::GPTaskResource HA::GPTaskGraph::Import(GPImage* image)
+{
+	for (GPTaskResource index = 0; index < Resources.size(); index++) {
+		if (!Resources[index].Transient && Resources[index].Image == image)
+			return index;
+	}
+	Resource resource{};
+	resource.Image = image;
+	return Add(resource);
+}
+
+HA::GPTaskResource HA::GPTaskGraph::CreateBuffer(uint64_t size)
+{
+	Resource resource{};
+	resource.Transient = true;
+	resource.Size = size;
+	return Add(resource);
+}
+
+HA::GPTaskResource HA::GPTaskGraph::CreateImage(VkFormat format, VkImageType type, VkExtent3D size, int mipCount)
+{
+	Resource resource{};
+	resource.Transient = true;
+	resource.Format = format;
+	resource.Type = type;
+	resource.Extent = size;
+	resource.Mipcount = mipCount;
+	return Add(resource);
+}
+
+HA::GPTaskResource HA::GPTaskGraph::Add(const Resource& resource)
+{
+	Resources.push_back(resource);
+	Resources.back().FirstWave = Resources.back().LastWave = -1;
+	Changed = true;
+	return (GPTaskResource)(Resources.size() - 1);
+}
+
+void HA::GPTaskGraph::AddPass(ComputeShader* shader, const std::vector<GPTaskBinding>& bindings, uint32_t x, uint32_t y, uint32_t z,
+	const void* pushConstants, uint32_t pushConstantSize)
+{
+	Pass pass{};
+	pass.Shader = shader;
+	for (auto& binding : bindings) {
+		if (binding.Resource >= Resources.size())
+			throw std::runtime_error("HA::GPTaskGraph Binding " + std::string(binding.Name) + " uses an unknown resource.");
+		pass.Bindings.push_back({ binding.Name, binding.Resource });
+		pass.Accesses.push_back(binding.Access);
+	}
+	pass.Groups[0] = x;
+	pass.Groups[1] = y;
+	pass.Groups[2] = z;
+	if (pushConstantSize > 0) {
+		pass.PushConstants.resize(pushConstantSize);
+		memcpy(pass.PushConstants.data(), pushConstants, pushConstantSize);
+	}
+	Passes.push_back(pass);
+	Changed = true;
+}
+
+HA::CommandTicket HA::GPTaskGraph::Execute()
+{
+	if (Changed)
+		Compile();
+	// Writes to imported resources that another thread still records are submitted first
+	for (auto& resource : Resources) {
+		if (!resource.Transient)
+			Context->_CommandThread->Flush(resource.Buffer ? resource.Buffer->LastSubmission : resource.Image->LastSubmission);
+	}
+	// Transient contents are discarded. Aliases start untracked, the memory barrier at their
+	// first wave orders them after whatever used their memory last, in this or the previous execution.
+	std::vector<bool> aliasedWaves(Waves.size(), false);
+	for (auto& resource : Resources) {
+		if (!resource.Transient || resource.FirstWave < 0)
+			continue;
+		if (resource.Aliased)
+			aliasedWaves[resource.FirstWave] = true;
+		if (resource.Buffer) {
+			auto managed = const_cast<ImplementationManagedBuffer*>(resource.Buffer->Buffer);
+			if (resource.Aliased)
+				managed->State = {};
+		}
+		else {
+			auto managed = const_cast<ImplementationManagedImage*>(resource.Image->Image);
+			for (auto& state : managed->LevelStates) {
+				if (resource.Aliased)
+					state = {};
+				else
+					state.Layout = VK_IMAGE_LAYOUT_UNDEFINED;
+			}
+		}
+	}
+
+	{
+		CommandThread::Batch batch(Context->_CommandThread);
+		auto cmd = batch.Cmd;
+		uint32_t scope = Context->_Profiler->Begin(cmd, "GPTaskGraph::Execute");
+		BarrierBatch barriers(Context, cmd);
+		for (size_t wave = 0; wave < Waves.size(); wave++) {
+			// One barrier for every pass of the wave. Writes through another alias of the same
+			// memory are not covered by buffer and image barriers.
+			if (aliasedWaves[wave])
+				barriers.Memory(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+					VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT);
+			for (auto index : Waves[wave]) {
+				for (auto& access : Passes[index].ResourceAccesses) {
+					auto& resource = Resources[access.Resource];
+					if (resource.Buffer)
+						barriers.Access(resource.Buffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, access.Access);
+					else
+						barriers.Access(resource.Image, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, access.Access, access.Layout);
+				}
+			}
+			barriers.Record();
+			for (auto index : Waves[wave]) {
+				auto& pass = Passes[index];
+				// The shader is the user's, its own bindings are restored once the pass is recorded
+				auto bindings = pass.Shader->Bindings;
+				auto pushConstants = pass.Shader->PushConstants;
+				for (auto& [name, resource] : pass.Bindings) {
+					if (Resources[resource].Buffer)
+						pass.Shader->Bind(name.c_str(), Resources[resource].Buffer);
+					else
+						pass.Shader->Bind(name.c_str(), Resources[resource].Image);
+				}
+				if (pass.PushConstants.size() > 0)
+					pass.Shader->SetPushConstants(pass.PushConstants.data(), (uint32_t)pass.PushConstants.size());
+				pass.Shader->Prepare();
+				pass.Shader->Record(cmd, batch.Ticket, pass.Shader->GetImageLayouts(), pass.Groups[0], pass.Groups[1], pass.Groups[2]);
+				pass.Shader->Bindings = std::move(bindings);
+				pass.Shader->PushConstants = std::move(pushConstants);
+			}
+		}
+		// Host visible buffers are read by the host after Wait()
+		for (auto& resource : Resources) {
+			if (resource.Transient || !resource.Buffer || resource.Buffer->MemoryType == GPGPUMemoryType::Static)
+				continue;
+			if (resource.Buffer->Buffer->State.WriteAccess & VK_ACCESS_SHADER_WRITE_BIT)
+				barriers.Access(resource.Buffer, VK_PIPELINE_STAGE_HOST_BIT, VK_ACCESS_HOST_READ_BIT);
+		}
+		barriers.Record();
+		Context->_Profiler->End(cmd, scope);
+		LastSubmission = batch.Ticket;
+	}
+	// Batches other threads are recording stay open
+	Context->_CommandThread->SubmitCurrent();
+	return LastSubmission;
+}
+
+HA::GPTaskGraphStats HA::GPTaskGraph::GetStats() const
+{
+	return { (uint32_t)Passes.size(), (uint32_t)Waves.size(), TransientBytes, AllocatedBytes };
+}
+
+void HA::GPTaskGraph::Compile()
+{
+	// Resources of the old schedule may still be in use
+	if (LastSubmission)
+		Context->_CommandThread->Wait(LastSubmission);
+	for (auto& pass : Passes) {
+		auto reflection = pass.Shader->Reflection;
+		for (auto& reflected : reflection->Bindings) {
+			// Immutable samplers have nothing to bind
+			if (reflected.Type == VK_DESCRIPTOR_TYPE_SAMPLER)
+				continue;
+			bool bound = false;
+			for (auto& [name, resource] : pass.Bindings)
+				bound |= name == reflected.Name;
+			if (!bound)
+				throw std::runtime_error("HA::GPTaskGraph Binding " + reflected.Name + " is not bound.");
+		}
+		// Each resource is accessed once per pass, with the union of its bindings
+		pass.ResourceAccesses.clear();
+		for (size_t i = 0; i < pass.Bindings.size(); i++) {
+			auto& [name, resource] = pass.Bindings[i];
+			auto reflected = reflection->Find(name.c_str());
+			if (!reflected)
+				throw std::runtime_error("HA::GPTaskGraph The shader has no binding " + name + ".");
+			bool image = Resources[resource].Image || Resources[resource].Mipcount > 0;
+			if (image != IsImageBinding(reflected->Type))
+				throw std::runtime_error("HA::GPTaskGraph Binding " + name + " does not match the type of its resource.");
+			bool readOnly = reflected->Type != VK_DESCRIPTOR_TYPE_STORAGE_BUFFER && reflected->Type != VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+			if (readOnly && pass.Accesses[i] != GPTaskAccess::Read)
+				throw std::runtime_error("HA::GPTaskGraph Binding " + name + " is read only.");
+
+			VkAccessFlags access = 0;
+			if (pass.Accesses[i] != GPTaskAccess::Write)
+				access |= reflected->Type == VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER ? VK_ACCESS_UNIFORM_READ_BIT : VK_ACCESS_SHADER_READ_BIT;
+			if (pass.Accesses[i] != GPTaskAccess::Read)
+				access |= VK_ACCESS_SHADER_WRITE_BIT;
+			VkImageLayout layout = VK_IMAGE_LAYOUT_UNDEFINED;
+			if (image)
+				layout = reflected->Type == VK_DESCRIPTOR_TYPE_STORAGE_IMAGE ? VK_IMAGE_LAYOUT_GENERAL : VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+
+			auto existing = std::find_if(pass.ResourceAccesses.begin(), pass.ResourceAccesses.end(),
+				[&](const PassAccess& other) { return other.Resource == resource; });
+			if (existing == pass.ResourceAccesses.end()) {
+				pass.ResourceAccesses.push_back({ resource, access, layout });
+				continue;
+			}
+			existing->Access |= access;
+			if (layout == VK_IMAGE_LAYOUT_GENERAL)
+				existing->Layout = layout;
+		}
+	}
+	Schedule();
+	Release();
+	Allocate();
+	Changed = false;
+}
+
+void HA::GPTaskGraph::Schedule()
+{
+	// Last wave that wrote each resource, and the last that read it since
+	std::vector<int32_t> lastWrite(Resources.size(), -1);
+	std::vector<int32_t> lastRead(Resources.size(), -1);
+	std::vector<VkImageLayout> readLayout(Resources.size(), VK_IMAGE_LAYOUT_UNDEFINED);
+	for (auto& resource : Resources)
+		resource.FirstWave = resource.LastWave = -1;
+	Waves.clear();
+
+	for (uint32_t index = 0; index < Passes.size(); index++) {
+		auto& pass = Passes[index];
+		// A layout transition writes the image, so readers in another layout are ordered like writers
+		std::vector<bool> writes;
+		int32_t wave = 0;
+		for (auto& access : pass.ResourceAccesses) {
+			auto resource = access.Resource;
+			bool write = (access.Access & VK_ACCESS_SHADER_WRITE_BIT) || (lastRead[resource] >= 0 && readLayout[resource] != access.Layout);
+			writes.push_back(write);
+			wave = std::max(wave, (write ? std::max(lastWrite[resource], lastRead[resource]) : lastWrite[resource]) + 1);
+		}
+		for (size_t i = 0; i < pass.ResourceAccesses.size(); i++) {
+			auto resource = pass.ResourceAccesses[i].Resource;
+			if (writes[i]) {
+				lastWrite[resource] = wave;
+				lastRead[resource] = -1;
+			}
+			else {
+				lastRead[resource] = std::max(lastRead[resource], wave);
+				readLayout[resource] = pass.ResourceAccesses[i].Layout;
+			}
+			auto& lifetime = Resources[resource];
+			if (lifetime.FirstWave < 0)
+				lifetime.FirstWave = wave;
+			lifetime.LastWave = std::max(lifetime.LastWave, wave);
+		}
+		if (Waves.size() <= (size_t)wave)
+			Waves.resize(wave + 1);
+		Waves[wave].push_back(index);
+	}
+}
+
+void HA::GPTaskGraph::Allocate()
+{
+	struct Placement {
+		GPTaskResource Resource;
+		VkMemoryRequirements Requirements;
+		uint64_t Offset;
+	};
+	// Buffers and images are kept apart so linear and optimal resources never share a granularity page
+	std::map<std::pair<bool, uint32_t>, std::vector<Placement>> groups;
+
+	for (GPTaskResource index = 0; index < Resources.size(); index++) {
+		auto& resource = Resources[index];
+		if (!resource.Transient || resource.FirstWave < 0)
+			continue;
+		Placement placement{ index };
+		VkResult result;
+		if (resource.Mipcount == 0) {
+			VkBufferCreateInfo createInfo;
+			VmaAllocationCreateInfo allocationInfo;
+			GetBufferCreateInfo(Context, GPGPUMemoryType::Static, resource.Size, createInfo, allocationInfo);
+			auto managed = new ImplementationManagedBuffer{};
+			result = vkCreateBuffer(Context->Device, &createInfo, Context->AllocationCallbacks, &managed->Buffer);
+			if (result != VK_SUCCESS) {
+				delete managed;
+				throw std::runtime_error("HA::GPTaskGraph Could not create buffer. " + GetStringFromResult(result));
+			}
+			resource.Buffer = new GPBuffer(Context, managed, GPGPUMemoryType::Static, resource.Size);
+			vkGetBufferMemoryRequirements(Context->Device, managed->Buffer, &placement.Requirements);
+		}
+		else {
+			VkImageCreateInfo createInfo;
+			GetImageCreateInfo(Context, resource.Format, resource.Type, resource.Extent, resource.Mipcount, createInfo);
+			auto managed = new ImplementationManagedImage{};
+			result = vkCreateImage(Context->Device, &createInfo, Context->AllocationCallbacks, &managed->Image);
+			if (result != VK_SUCCESS) {
+				delete managed;
+				throw std::runtime_error("HA::GPTaskGraph Could not create image. " + GetStringFromResult(result));
+			}
+			managed->LevelStates.resize(resource.Mipcount);
+			resource.Image = new GPImage(Context, managed, resource.Format, resource.Type, resource.Extent, resource.Mipcount);
+			vkGetImageMemoryRequirements(Context->Device, managed->Image, &placement.Requirements);
+		}
+		TransientBytes += placement.Requirements.size;
+		groups[{ resource.Mipcount > 0, placement.Requirements.memoryTypeBits }].push_back(placement);
+	}
+
+	for (auto& [key, placements] : groups) {
+		// Largest first, each at the lowest offset that is free during its waves
+		std::stable_sort(placements.begin(), placements.end(),
+			[](const Placement& a, const Placement& b) { return a.Requirements.size > b.Requirements.size; });
+		VkMemoryRequirements requirements{ 0, 1, key.second };
+		for (size_t i = 0; i < placements.size(); i++) {
+			auto& placement = placements[i];
+			auto& resource = Resources[placement.Resource];
+			uint64_t alignment = placement.Requirements.alignment;
+			bool moved = true;
+			while (moved) {
+				moved = false;
+				for (size_t j = 0; j < i; j++) {
+					auto& other = Resources[placements[j].Resource];
+					if (other.LastWave < resource.FirstWave || resource.LastWave < other.FirstWave)
+						continue;
+					uint64_t end = placements[j].Offset + placements[j].Requirements.size;
+					if (placement.Offset < end && placements[j].Offset < placement.Offset + placement.Requirements.size) {
+						placement.Offset = (end + alignment - 1) / alignment * alignment;
+						moved = true;
+					}
+				}
+			}
+			requirements.size = std::max(requirements.size, placement.Offset + placement.Requirements.size);
+			requirements.alignment = std::max(requirements.alignment, alignment);
+		}
+		// Resources that share memory can overwrite each other between executions
+		for (size_t i = 0; i < placements.size(); i++) {
+			for (size_t j = 0; j < placements.size(); j++) {
+				if (i != j && placements[i].Offset < placements[j].Offset + placements[j].Requirements.size &&
+					placements[j].Offset < placements[i].Offset + placements[i].Requirements.size)
+					Resources[placements[i].Resource].Aliased = true;
+			}
+		}
+
+		VmaAllocationCreateInfo createInfo{};
+		createInfo.preferredFlags = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
+		VmaAllocation allocation;
+		VkResult result = vmaAllocateMemory(Context->Allocator, &requirements, &createInfo, &allocation, nullptr);
+		if (result != VK_SUCCESS)
+			throw std::runtime_error("HA::GPTaskGraph Could not allocate transient memory. " + GetStringFromResult(result));
+		Heaps.push_back({ allocation, requirements.size, key.first });
+		AllocatedBytes += requirements.size;
+		Context->_MemoryStatistics->Add(GPGPUMemoryType::Static, key.first, requirements.size);
+
+		for (auto& placement : placements) {
+			auto& resource = Resources[placement.Resource];
+			if (resource.Buffer) {
+				result = vmaBindBufferMemory2(Context->Allocator, allocation, placement.Offset, resource.Buffer->Buffer->Buffer, nullptr);
+				if (result != VK_SUCCESS)
+					throw std::runtime_error("HA::GPTaskGraph Could not bind buffer memory. " + GetStringFromResult(result));
+				continue;
+			}
+			auto managed = const_cast<ImplementationManagedImage*>(resource.Image->Image);
+			result = vmaBindImageMemory2(Context->Allocator, allocation, placement.Offset, managed->Image, nullptr);
+			if (result != VK_SUCCESS)
+				throw std::runtime_error("HA::GPTaskGraph Could not bind image memory. " + GetStringFromResult(result));
+			result = CreateImageView(Context, managed->Image, resource.Format, resource.Type, resource.Mipcount, &managed->View);
+			if (result != VK_SUCCESS)
+				throw std::runtime_error("HA::GPTaskGraph Could not create image view. " + GetStringFromResult(result));
+		}
+	}
+}
+
+void HA::GPTaskGraph::Release()
+{
+	for (auto& resource : Resources) {
+		if (!resource.Transient)
+			continue;
+		delete resource.Buffer;
+		delete resource.Image;
+		resource.Buffer = nullptr;
+		resource.Image = nullptr;
+		resource.Aliased = false;
+	}
+	for (auto& heap : Heaps) {
+		vmaFreeMemory(Context->Allocator, heap.Allocation);
+		Context->_MemoryStatistics->Remove(GPGPUMemoryType::Static, heap.Image, heap.Size);
+	}
+	Heaps.clear();
+	TransientBytes = AllocatedBytes = 0;
+}
@@ -0,0 +1,164 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <vulkan/vulkan_core.h>
+#include "CommandThread.hpp"
+
+struct VmaAllocation_T;
+
+namespace HA {
+
+	class ComputeShader;
+	class GPBuffer;
+	class GPImage;
+	struct ImplementationContext;
+
+	/// <summary>
+	/// Resource of a GPTaskGraph, returned by Import(), CreateBuffer() and CreateImage().
+	/// </summary>
+	typedef uint32_t GPTaskResource;
+
+	enum class GPTaskAccess {
+		Read,
+		Write,
+		ReadWrite
+	};
+
+	/// <summary>
+	/// Binds a graph resource to a shader variable, or block name for anonymous blocks.
+	/// Passes that only read a resource can run in the same wave.
+	/// </summary>
+	struct GPTaskBinding {
+		const char* Name;
+		GPTaskResource Resource;
+		GPTaskAccess Access;
+	};
+
+	struct GPTaskGraphStats {
+		uint32_t Passes;
+		/// <summary>
+		/// Groups of passes without dependencies between them, each one is preceded by a single barrier.
+		/// </summary>
+		uint32_t Waves;
+		/// <summary>
+		/// Memory the transient resources would need on their own, and what they share after aliasing.
+		/// </summary>
+		uint64_t TransientBytes;
+		uint64_t AllocatedBytes;
+	};
+
+	/// <summary>
+	/// Records a fixed sequence of compute passes as one submission. Passes are declared in program order
+	/// with the resources they read and write and are scheduled into waves: each pass runs in the first
+	/// wave after the passes it depends on, so independent passes share a barrier.
+	/// Transient resources only live inside the graph. Their memory is aliased between resources whose
+	/// waves do not overlap and their contents are undefined at the start of every Execute().
+	/// The graph is compiled on the first Execute() after a change and reused afterwards.
+	/// </summary>
+	class GPTaskGraph {
+
+	public:
+		GPTaskGraph(const ImplementationContext* Context);
+		~GPTaskGraph();
+		GPTaskGraph(const GPTaskGraph& copy) = delete;
+		GPTaskGraph(const GPTaskGraph&& move) = delete;
+
+		/// <summary>
+		/// Uses a resource created outside the graph, it must outlive the graph.
+		/// Importing it again returns the same GPTaskResource.
+		/// </summary>
+		GPTaskResource Import(GPBuffer* buffer);
+		GPTaskResource Import(GPImage* image);
+
+		/// <summary>
+		/// Static buffer that is allocated on the next Execute().
+		/// </summary>
+		GPTaskResource CreateBuffer(uint64_t size);
+		/// <summary>
+		/// Static image that is allocated on the next Execute().
+		/// </summary>
+		GPTaskResource CreateImage(VkFormat format, VkImageType type, VkExtent3D size, int mipCount = 1);
+
+		/// <summary>
+		/// Adds a dispatch of x * y * z workgroups. bindings must bind every binding the shader declares,
+		/// push constants are copied. The shader runs the variant it is specialized to when Execute() records,
+		/// its own bindings and push constants are left as they were.
+		/// </summary>
+		void AddPass(ComputeShader* shader, const std::vector<GPTaskBinding>& bindings, uint32_t x, uint32_t y, uint32_t z,
+			const void* pushConstants = nullptr, uint32_t pushConstantSize = 0);
+
+		/// <summary>
+		/// Records every pass into the calling thread's shared command buffer and submits it, the WriteAsync
+		/// calls before it execute first. Wait on the returned ticket before reading written Host or Stream buffers.
+		/// </summary>
+		CommandTicket Execute();
+
+		/// <summary>
+		/// Valid after the first Execute().
+		/// </summary>
+		GPTaskGraphStats GetStats() const;
+
+	public:
+		const ImplementationContext* Context;
+
+	private:
+		struct Resource {
+			GPBuffer* Buffer;
+			GPImage* Image;
+			bool Transient;
+			// Description of a transient resource
+			uint64_t Size;
+			VkFormat Format;
+			VkImageType Type;
+			VkExtent3D Extent;
+			int Mipcount;
+			// First and last wave that uses the resource, -1 if none does
+			int32_t FirstWave;
+			int32_t LastWave;
+			// Shares memory with a resource of earlier waves
+			bool Aliased;
+		};
+
+		struct PassAccess {
+			GPTaskResource Resource;
+			VkAccessFlags Access;
+			VkImageLayout Layout;
+		};
+
+		struct Heap {
+			VmaAllocation_T* Allocation;
+			uint64_t Size;
+			bool Image;
+		};
+
+		struct Pass {
+			ComputeShader* Shader;
+			std::vector<std::pair<std::string, GPTaskResource>> Bindings;
+			std::vector<GPTaskAccess> Accesses;
+			uint32_t Groups[3];
+			std::vector<uint8_t> PushConstants;
+			// Union of the bindings per resource, set when compiled
+			std::vector<PassAccess> ResourceAccesses;
+		};
+
+		GPTaskResource Add(const Resource& resource);
+		void Compile();
+		void Schedule();
+		void Allocate();
+		void Release();
+
+		std::vector<Resource> Resources;
+		std::vector<Pass> Passes;
+		/// <summary>
+		/// Pass indices of every wave, in declaration order.
+		/// </summary>
+		std::vector<std::vector<uint32_t>> Waves;
+		std::vector<Heap> Heaps;
+		uint64_t TransientBytes;
+		uint64_t AllocatedBytes;
+		bool Changed;
+		CommandTicket LastSubmission;
+	};
+
+}
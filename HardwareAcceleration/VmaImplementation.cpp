@@ -0,0 +1,5 @@
+// Only compiled by the CMake build, the vcxproj uses dep/VulkanMemoryAllocator/src/VmaUsage.cpp.
+#define VMA_IMPLEMENTATION
+#define VMA_STATIC_VULKAN_FUNCTIONS 1
+#define VMA_DYNAMIC_VULKAN_FUNCTIONS 0
+#include <vk_mem_alloc.h>